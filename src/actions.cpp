@@ -0,0 +1,117 @@
+#include "actions.hpp"
+#include "gamestate.hpp"
+#include "powers.hpp"
+
+ActionEnumerator::ActionEnumerator()
+{
+	stats.candidates = 0;
+	stats.prefiltered = 0;
+	stats.tested = 0;
+	stats.usable = 0;
+}
+
+bool ActionEnumerator::area_key::operator<(const area_key &k) const
+{
+	if(tile != k.tile) return tile < k.tile;
+	if(range != k.range) return range < k.range;
+	return direction < k.direction;
+}
+
+const Tile::List &ActionEnumerator::area(pawn_ptr pawn, unsigned int direction, Tile *target, GameState *state)
+{
+	area_key key;
+	if(direction == Powers::Power::targeted) {
+		key.tile = target;
+		key.range = 0;
+	}else{
+		key.tile = pawn->cur_tile;
+		key.range = pawn->range;
+	}
+	key.direction = direction;
+
+	std::map<area_key, Tile::List>::iterator i = areas.find(key);
+	if(i != areas.end()) {
+		return i->second;
+	}
+
+	Tile::List &tiles = areas[key];
+	if(direction == Powers::Power::targeted) {
+		tiles.push_back(target);
+	}else{
+		state->power_area(pawn, direction, tiles);
+	}
+
+	return tiles;
+}
+
+void ActionEnumerator::enumerate(pawn_ptr pawn, GameState *state, std::vector<action> &out)
+{
+	// Area properties per direction, shared by all of this pawn's powers.
+	std::map<unsigned int, unsigned int> props;
+
+	for(Pawn::PowerList::iterator p = pawn->powers.begin(); p != pawn->powers.end(); ++p) {
+		const Powers::Power &power = Powers::powers[p->first];
+
+		std::vector<unsigned int> directions;
+		if(power.direction == Powers::Power::undirected) {
+			directions.push_back(Powers::Power::undirected);
+		}else{
+			for(unsigned int bit = 1; bit <= power.direction; bit <<= 1) {
+				if(power.direction & bit) {
+					directions.push_back(bit);
+				}
+			}
+		}
+
+		for(std::vector<unsigned int>::iterator d = directions.begin(); d != directions.end(); ++d) {
+			std::vector<Tile *> targets;
+			if(*d == Powers::Power::targeted) {
+				targets = state->tiles;
+			}else{
+				targets.push_back(NULL);
+			}
+
+			for(std::vector<Tile *>::iterator t = targets.begin(); t != targets.end(); ++t) {
+				++stats.candidates;
+
+				const Tile::List &tiles = area(pawn, *d, *t, state);
+				if((*d & Powers::Power::adjacent) && !tiles[0]) {
+					++stats.prefiltered;
+					continue;
+				}
+
+				if(power.preconditions) {
+					unsigned int area_props;
+					if(*d == Powers::Power::targeted) {
+						area_props = Powers::area_properties(pawn, tiles);
+					}else{
+						std::map<unsigned int, unsigned int>::iterator i = props.find(*d);
+						if(i == props.end()) {
+							i = props.insert(std::make_pair(*d, Powers::area_properties(pawn, tiles))).first;
+						}
+						area_props = i->second;
+					}
+
+					if(!(area_props & power.preconditions)) {
+						++stats.prefiltered;
+						continue;
+					}
+				}
+
+				++stats.tested;
+				if(!power.can_use(pawn, tiles, state)) {
+					continue;
+				}
+				++stats.usable;
+
+				action a;
+				a.pawn = pawn;
+				a.power = p->first;
+				a.direction = *d;
+				a.target = *t;
+				a.area = &tiles;
+				out.push_back(a);
+			}
+		}
+	}
+}
@@ -0,0 +1,57 @@
+#ifndef ACTIONS_HPP
+#define ACTIONS_HPP
+
+#include <vector>
+#include <map>
+
+#include "tile.hpp"
+
+class GameState;
+
+/* Enumerates the powers the AI, or a loadgen bot, could use.
+ *
+ * Power areas only depend on where the pawn stands and its range, so they
+ * are cached for the whole game. Before a power's can_use function is
+ * called, the AREA_* properties of the area are checked against the
+ * power's preconditions, which throws away most candidates cheaply.
+*/
+class ActionEnumerator {
+public:
+	struct action {
+		pawn_ptr pawn;
+		int power;
+		unsigned int direction;
+		Tile *target; // Only set for targeted powers.
+		const Tile::List *area;
+	};
+
+	struct counters {
+		unsigned long candidates;  // (power, direction, target) triples looked at.
+		unsigned long prefiltered; // Rejected by the preconditions.
+		unsigned long tested;      // Passed on to can_use.
+		unsigned long usable;
+	};
+
+	ActionEnumerator();
+
+	// Append the usable powers of a pawn to out.
+	void enumerate(pawn_ptr pawn, GameState *state, std::vector<action> &out);
+
+	counters stats;
+
+private:
+	struct area_key {
+		Tile *tile;
+		int range;
+		unsigned int direction;
+
+		bool operator<(const area_key &k) const;
+	};
+
+	// Entries are never removed, so pointers into the map stay valid.
+	std::map<area_key, Tile::List> areas;
+
+	const Tile::List &area(pawn_ptr pawn, unsigned int direction, Tile *target, GameState *state);
+};
+
+#endif /* !ACTIONS_HPP */
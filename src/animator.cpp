@@ -9,9 +9,9 @@ Animators::Generic::~Generic() {
 }
 
 Animators::ImageAnimation::ImageAnimation(Tile *tile, Uint32 runtime, const std::string &image,
-					  const scale_tween_point_vec &scale_tween) :
+					  const scale_tween_point_vec &scale_tween, Uint32 delay) :
 	tile(tile),
-	init_ticks(SDL_GetTicks()), runtime(runtime),
+	init_ticks(SDL_GetTicks() + delay), runtime(runtime),
 	image(ImgStuff::GetImage(image)),
 	scale_tween(scale_tween) {
 }
@@ -21,6 +21,9 @@ bool Animators::ImageAnimation::render() {
 	if(current_time >= init_ticks+runtime) {
 		return false;
 	}
+	if(current_time < init_ticks) {
+		return true;
+	}
 	float scale = scale_factor(current_time - init_ticks);
 
 	if(scale == 1.0) {
@@ -77,10 +80,11 @@ static const Animators::ImageAnimation::scale_tween_point boom_animation_tween[]
 	{400, 0.75f}
 };
 
-Animators::PawnBoom::PawnBoom(Tile *tile) :
+Animators::PawnBoom::PawnBoom(Tile *tile, Uint32 delay) :
 	ImageAnimation(tile, 700, "graphics/boom.png",
 		       scale_tween_point_vec(&boom_animation_tween[0],
-					     &boom_animation_tween[boost::size(boom_animation_tween)])) {
+					     &boom_animation_tween[boost::size(boom_animation_tween)]),
+		       delay) {
 }
 
 static const Animators::ImageAnimation::scale_tween_point aiee_animation_tween[] = {
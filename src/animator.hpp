@@ -28,9 +28,11 @@ public:
 	SDL_Surface *image;
 	scale_tween_point_vec scale_tween;
 
-	/* Runtime is number of milliseconds to run for. */
+	/* Runtime is number of milliseconds to run for, starting delay
+	 * milliseconds from now. */
 	ImageAnimation(Tile *tile, Uint32 runtime, const std::string &image,
-		       const scale_tween_point_vec &scale_tween = scale_tween_point_vec());
+		       const scale_tween_point_vec &scale_tween = scale_tween_point_vec(),
+		       Uint32 delay = 0);
 	bool render();
 private:
 	float scale_factor(Uint32 time);
@@ -48,7 +50,7 @@ public:
 
 class PawnBoom : public ImageAnimation {
 public:
-	PawnBoom(Tile *tile);
+	PawnBoom(Tile *tile, Uint32 delay = 0);
 };
 
 class PawnOhShitIFellDownAHole : public ImageAnimation {
@@ -0,0 +1,738 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <new>
+#include <algorithm>
+#include <stdexcept>
+#include <arpa/inet.h>
+#include <boost/filesystem.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
+#include <boost/asio.hpp>
+#include <google/protobuf/arena.h>
+
+#include "bench.hpp"
+#include "gamestate.hpp"
+#include "evaluator.hpp"
+#include "search.hpp"
+#include "ttable.hpp"
+#include "threatmap.hpp"
+#include "powers.hpp"
+#include "network.hpp"
+
+typedef void (*bench_fn)(const std::string &scenario, const std::string &path);
+
+#ifdef BENCH_ALLOCS
+/* Heap allocations made by the current thread, for the msgs benchmark.
+ * Only built with scons bench_allocs=1, as it replaces operator new for
+ * the whole program.
+*/
+static __thread unsigned long allocations = 0;
+
+// Not inlined, or GCC sees malloc and free behind new and delete and
+// warns about mismatches.
+__attribute__((noinline)) void *operator new(size_t size)
+{
+	++allocations;
+
+	void *p = malloc(size ? size : 1);
+	if(!p) {
+		throw std::bad_alloc();
+	}
+	return p;
+}
+
+__attribute__((noinline)) void operator delete(void *p) throw()
+{
+	free(p);
+}
+#endif
+
+// Wall clock seconds, for timing loops.
+static double now()
+{
+	static const boost::posix_time::ptime epoch(boost::gregorian::date(1970, 1, 1));
+	return (boost::posix_time::microsec_clock::universal_time() - epoch).total_microseconds() / 1e6;
+}
+
+static std::vector<std::string> scenarios()
+{
+	using namespace boost::filesystem;
+
+	std::vector<std::string> names;
+	for(directory_iterator node("scenario"); node != directory_iterator(); ++node) {
+		names.push_back(node->path().filename().string());
+	}
+	std::sort(names.begin(), names.end());
+
+	return names;
+}
+
+/// eval: Incremental evaluation against rescoring the whole board.
+static void bench_eval(const std::string &scenario, const std::string &path)
+{
+	const unsigned int ITERATIONS = 200000;
+
+	GameState state;
+	state.load_file(path);
+
+	Evaluator evaluator;
+	evaluator.sync(state);
+
+	std::set<PlayerColour> colours = state.colours();
+	std::vector<PlayerColour> sides(colours.begin(), colours.end());
+	std::vector< std::vector<Evaluator::move> > moves(sides.size());
+	for(size_t i = 0; i < sides.size(); ++i) {
+		evaluator.moves(sides[i], moves[i]);
+	}
+
+	// Both methods must agree before timing them means anything.
+	for(size_t i = 0; i < sides.size(); ++i) {
+		for(size_t m = 0; m < moves[i].size(); ++m) {
+			evaluator.make_move(moves[i][m]);
+			if(evaluator.evaluate(sides[i]) != evaluator.evaluate_from_scratch(sides[i])) {
+				throw std::runtime_error("Incremental evaluation mismatch in " + scenario);
+			}
+			evaluator.undo_move();
+		}
+	}
+
+	// The sums keep the evaluations from being optimised out, and the two
+	// loops evaluate the same positions so they must match.
+	double rate[2];
+	long sum[2] = { 0, 0 };
+	for(int scratch = 0; scratch < 2; ++scratch) {
+		double start = now();
+		for(unsigned int n = 0; n < ITERATIONS; ++n) {
+			size_t side = n % sides.size();
+			if(moves[side].empty()) continue;
+
+			evaluator.make_move(moves[side][n % moves[side].size()]);
+			sum[scratch] += scratch ?
+				evaluator.evaluate_from_scratch(sides[side]) :
+				evaluator.evaluate(sides[side]);
+			evaluator.undo_move();
+		}
+		rate[scratch] = ITERATIONS / (now() - start);
+	}
+	if(sum[0] != sum[1]) {
+		throw std::runtime_error("Incremental evaluation mismatch in " + scenario);
+	}
+
+	printf("%-14s %5u tiles  incremental %10.0f evals/s  scratch %10.0f evals/s  %5.1fx\n",
+	       scenario.c_str(), (unsigned int)state.tiles.size(),
+	       rate[0], rate[1], rate[0] / rate[1]);
+}
+
+// One search for bench_search, printed as it goes.
+static Search::result timed_search(const std::string &scenario, const char *label,
+	const Evaluator &evaluator, PlayerColour colour, TranspositionTable *table)
+{
+	const int DEPTH = 4;
+
+	std::vector<Evaluator::move> root;
+	evaluator.moves(colour, root);
+
+	double start = now();
+	Search::result r = Search::search(evaluator, colour, root, DEPTH, options.ai_threads, table);
+	double elapsed = now() - start;
+
+	printf("%-14s %-10s %9lu nodes  %8.1f ms  hits %5.1f%%  best %d\n",
+	       scenario.c_str(), label, r.nodes, elapsed * 1000,
+	       r.probes ? 100.0 * r.hits / r.probes : 0.0,
+	       r.best == -1 ? 0 : r.scores[r.best]);
+
+	return r;
+}
+
+/// search: A turn without a transposition table and with an empty one,
+/// then the same side's next turn, after its move and a reply, without a
+/// table, with an empty one and with the one from the turn before.
+static void bench_search(const std::string &scenario, const std::string &path)
+{
+	GameState state;
+	state.load_file(path);
+
+	Evaluator evaluator;
+	evaluator.sync(state);
+
+	std::set<PlayerColour> colours = state.colours();
+	if(colours.size() < 2) {
+		return;
+	}
+	PlayerColour colour = *colours.begin();
+	PlayerColour opponent = *++colours.begin();
+
+	// Both made before timing anything, filling them takes a while.
+	TranspositionTable kept(options.ai_hash_mb), fresh(options.ai_hash_mb);
+
+	timed_search(scenario, "none", evaluator, colour, NULL);
+	Search::result r = timed_search(scenario, "cold", evaluator, colour, &kept);
+	if(r.best == -1) {
+		return;
+	}
+
+	std::vector<Evaluator::move> moves;
+	evaluator.moves(colour, moves);
+	evaluator.make_move(moves[r.best]);
+
+	// A quick reply, kept out of the tables.
+	moves.clear();
+	evaluator.moves(opponent, moves);
+	Search::result reply = Search::search(evaluator, opponent, moves, 2, 1, NULL);
+	if(reply.best == -1) {
+		return;
+	}
+	evaluator.make_move(moves[reply.best]);
+
+	timed_search(scenario, "next none", evaluator, colour, NULL);
+	timed_search(scenario, "next cold", evaluator, colour, &fresh);
+	timed_search(scenario, "next warm", evaluator, colour, &kept);
+}
+
+// Give every pawn an attack power and some range, so there is something to count.
+static void arm_pawns(GameState &state)
+{
+	std::vector<int> attacks;
+	for(size_t p = 0; p < Powers::powers.size(); ++p) {
+		if(Powers::powers[p].preconditions & (Powers::AREA_PAWN | Powers::AREA_ENEMY_PAWN)) {
+			attacks.push_back(p);
+		}
+	}
+
+	std::vector<pawn_ptr> pawns = state.all_pawns();
+	for(size_t i = 0; i < pawns.size(); ++i) {
+		pawns[i]->powers[attacks[i % attacks.size()]] = 1;
+		pawns[i]->range = i % 3;
+	}
+}
+
+// Count attacks the slow way, with the GameState area functions.
+static void check_threats(GameState &state, const ThreatMap &threats, const std::string &scenario)
+{
+	typedef Tile *(GameState::*step_fn)(Tile *);
+	const step_fn steps[] = {
+		&GameState::tile_right_of, &GameState::tile_left_of,
+		&GameState::tile_ne_of, &GameState::tile_nw_of,
+		&GameState::tile_se_of, &GameState::tile_sw_of,
+	};
+	const unsigned int step_dirs[] = {
+		Powers::Power::east, Powers::Power::west,
+		Powers::Power::northeast, Powers::Power::northwest,
+		Powers::Power::southeast, Powers::Power::southwest,
+	};
+
+	std::map<Tile *, int> expect[ThreatMap::KINDS][SPECTATE];
+
+	for(Tile::List::iterator t = state.tiles.begin(); t != state.tiles.end(); ++t) {
+		Tile *tile = *t;
+		for(int s = 0; s < 6; ++s) {
+			Tile *from = (state.*steps[s])(tile);
+			if(!from || !from->pawn || tile->has_black_hole) continue;
+
+			pawn_ptr p = from->pawn;
+			if((tile->height > from->height + 1 || tile->smashed) && !(p->flags & PWR_CLIMB)) continue;
+
+			expect[ThreatMap::ADJACENT][p->colour][tile]++;
+			if(tile->pawn && tile->pawn->colour != p->colour && !(tile->pawn->flags & PWR_SHIELD)) {
+				expect[ThreatMap::STOMP][p->colour][tile]++;
+			}
+		}
+
+		pawn_ptr p = tile->pawn;
+		if(!p) continue;
+
+		unsigned int dirs = 0;
+		for(Pawn::PowerList::iterator pw = p->powers.begin(); pw != p->powers.end(); ++pw) {
+			const Powers::Power &power = Powers::powers[pw->first];
+			if(power.preconditions & (Powers::AREA_PAWN | Powers::AREA_ENEMY_PAWN)) {
+				dirs |= power.direction;
+			}
+		}
+
+		std::vector<Tile::List> areas;
+		if(dirs & Powers::Power::east_west) areas.push_back(p->RowTiles());
+		if(dirs & Powers::Power::northwest_southeast) areas.push_back(p->bs_tiles());
+		if(dirs & Powers::Power::northeast_southwest) areas.push_back(p->fs_tiles());
+		if(dirs & Powers::Power::radial) areas.push_back(p->RadialTiles());
+		for(int s = 0; s < 6; ++s) {
+			if(dirs & step_dirs[s]) {
+				Tile *to = (state.*steps[s])(tile);
+				if(to) areas.push_back(Tile::List(1, to));
+			}
+		}
+
+		for(size_t a = 0; a < areas.size(); ++a) {
+			for(Tile::List::iterator i = areas[a].begin(); i != areas[a].end(); ++i) {
+				if(!(*i)->has_black_hole) {
+					expect[ThreatMap::RANGED][p->colour][*i]++;
+				}
+			}
+		}
+	}
+
+	for(int k = 0; k < ThreatMap::KINDS; ++k) {
+		for(int c = 0; c < SPECTATE; ++c) {
+			for(Tile::List::iterator t = state.tiles.begin(); t != state.tiles.end(); ++t) {
+				int want = expect[k][c].count(*t) ? expect[k][c][*t] : 0;
+				if(threats.count((ThreatMap::kind)k, *t, (PlayerColour)c) != (unsigned int)want) {
+					throw std::runtime_error("Threat map mismatch in " + scenario);
+				}
+			}
+		}
+	}
+}
+
+// Copy a board side by side until it has at least min_tiles tiles.
+static void tile_board(GameState &from, GameState &to, size_t min_tiles)
+{
+	int cols = 0, rows = 0;
+	for(Tile::List::iterator t = from.tiles.begin(); t != from.tiles.end(); ++t) {
+		cols = std::max(cols, (*t)->col + 1);
+		rows = std::max(rows, (*t)->row + 1);
+	}
+	rows += rows % 2; // Keep row parity.
+
+	for(int n = 0; to.tiles.size() < min_tiles; ++n) {
+		int dc = (n % 4) * cols, dr = (n / 4) * rows;
+		for(Tile::List::iterator t = from.tiles.begin(); t != from.tiles.end(); ++t) {
+			Tile *tile = new Tile((*t)->col + dc, (*t)->row + dr, (*t)->height);
+			tile->smashed = (*t)->smashed;
+			to.tiles.push_back(tile);
+
+			if((*t)->pawn) {
+				tile->pawn.reset(new Pawn((*t)->pawn->colour, &to, tile));
+				tile->pawn->powers = (*t)->pawn->powers;
+				tile->pawn->range = (*t)->pawn->range;
+				tile->pawn->flags = (*t)->pawn->flags;
+			}
+		}
+	}
+}
+
+/// threat: Threat map against the GameState area functions, and build
+/// times for the scenario and for copies of it with at least 2000 tiles.
+static void bench_threat(const std::string &scenario, const std::string &path)
+{
+	const unsigned int ITERATIONS = 2000;
+
+	GameState state;
+	state.load_file(path);
+	arm_pawns(state);
+
+	ThreatMap threats;
+	threats.build(state);
+	check_threats(state, threats, scenario);
+
+	GameState big;
+	tile_board(state, big, 2000);
+
+	GameState *boards[] = { &state, &big };
+	double usec[2];
+	for(int b = 0; b < 2; ++b) {
+		double start = now();
+		for(unsigned int n = 0; n < ITERATIONS; ++n) {
+			threats.build(*boards[b]);
+		}
+		usec[b] = (now() - start) / ITERATIONS * 1e6;
+	}
+
+	printf("%-14s %5u tiles %7.1f us  %5u tiles %7.1f us\n",
+	       scenario.c_str(),
+	       (unsigned int)state.tiles.size(), usec[0],
+	       (unsigned int)big.tiles.size(), usec[1]);
+}
+
+// Both boards must hold the same tiles and pawns in the same order.
+static void check_boards(GameState &a, GameState &b, const std::string &scenario)
+{
+	bool same = a.tiles.size() == b.tiles.size();
+	for(size_t i = 0; same && i < a.tiles.size(); ++i) {
+		Tile *x = a.tiles[i], *y = b.tiles[i];
+		same = x->col == y->col && x->row == y->row && x->height == y->height &&
+			x->has_power == y->has_power && x->smashed == y->smashed &&
+			x->has_mine == y->has_mine && (!x->has_mine || x->mine_colour == y->mine_colour) &&
+			x->has_landing_pad == y->has_landing_pad && (!x->has_landing_pad || x->landing_pad_colour == y->landing_pad_colour) &&
+			x->has_black_hole == y->has_black_hole && (!x->has_black_hole || x->black_hole_power == y->black_hole_power) &&
+			x->has_eye == y->has_eye && (!x->has_eye || x->eye_colour == y->eye_colour) &&
+			x->wrap == y->wrap && x->hill == y->hill &&
+			!x->pawn == !y->pawn &&
+			(!x->pawn || (x->pawn->colour == y->pawn->colour && x->pawn->range == y->pawn->range && x->pawn->flags == y->pawn->flags));
+	}
+
+	if(!same) {
+		throw std::runtime_error("Packed board differs from the original in " + scenario);
+	}
+}
+
+/// board: Size, encode and decode time of the full board as one message
+/// per tile against the packed arrays, for the scenario and for a copy
+/// of it with at least 2000 tiles.
+static void bench_board(const std::string &scenario, const std::string &path)
+{
+	const unsigned int ITERATIONS = 200;
+
+	GameState state;
+	state.load_file(path);
+
+	GameState big;
+	tile_board(state, big, 2000);
+
+	GameState *boards[] = { &state, &big };
+	for(int b = 0; b < 2; ++b) {
+		size_t bytes[2];
+		double encode[2], decode[2];
+
+		for(int packed = 0; packed < 2; ++packed) {
+			std::string pb;
+
+			double start = now();
+			for(unsigned int n = 0; n < ITERATIONS; ++n) {
+				protocol::message msg;
+				msg.set_msg(protocol::BEGIN);
+				if(packed) {
+					boards[b]->serialize_packed(msg);
+				}else{
+					boards[b]->serialize(msg);
+				}
+				msg.SerializeToString(&pb);
+			}
+			encode[packed] = (now() - start) / ITERATIONS * 1e6;
+			bytes[packed] = pb.size();
+
+			start = now();
+			for(unsigned int n = 0; n < ITERATIONS; ++n) {
+				protocol::message msg;
+				msg.ParseFromString(pb);
+
+				GameState copy;
+				copy.deserialize(msg);
+				if(n == 0) {
+					check_boards(*boards[b], copy, scenario);
+				}
+			}
+			decode[packed] = (now() - start) / ITERATIONS * 1e6;
+		}
+
+		printf("%-14s %5u tiles  tiles %7u B %8.1f us %8.1f us  packed %7u B %8.1f us %8.1f us\n",
+		       scenario.c_str(), (unsigned int)boards[b]->tiles.size(),
+		       (unsigned int)bytes[0], encode[0], decode[0],
+		       (unsigned int)bytes[1], encode[1], decode[1]);
+	}
+}
+
+// Build the messages one move of a pawn with powers onto an enemy sends,
+// the way ServerGameState does.
+static void build_move(google::protobuf::Arena *arena, Tile *from, Tile *to, uint32_t to_index, std::string &out)
+{
+	protocol::message *msgs[5];
+	for(int i = 0; i < 5; ++i) {
+		msgs[i] = google::protobuf::Arena::CreateMessage<protocol::message>(arena);
+	}
+
+	msgs[0]->set_msg(protocol::ANIMATION);
+	protocol::animation *a = msgs[0]->mutable_animation();
+	a->set_type(protocol::CRUSH);
+	a->set_tile(to_index);
+
+	msgs[1]->set_msg(protocol::DESTROY);
+	protocol::pawn *p = msgs[1]->add_pawns();
+	p->set_col(to->col);
+	p->set_row(to->row);
+
+	msgs[2]->set_msg(protocol::FORCE_MOVE);
+	p = msgs[2]->add_pawns();
+	p->set_col(from->col);
+	p->set_row(from->row);
+	p->set_new_col(to->col);
+	p->set_new_row(to->row);
+
+	msgs[3]->set_msg(protocol::UPDATE);
+	from->pawn->CopyToProto(msgs[3]->add_pawns(), true);
+	to->CopyToProto(msgs[3]->add_tiles());
+
+	msgs[4]->set_msg(protocol::ADD_POWER_NOTIFICATION);
+	p = msgs[4]->add_pawns();
+	p->set_col(to->col);
+	p->set_row(to->row);
+	p->set_use_power(0);
+
+	for(int i = 0; i < 5; ++i) {
+		msgs[i]->SerializeToString(&out);
+	}
+
+	if(!arena) {
+		for(int i = 0; i < 5; ++i) {
+			delete msgs[i];
+		}
+	}
+}
+
+/// msgs: Building and serialising the messages for a move on the heap
+/// and on an arena that is reset after every move. The arena side also
+/// reports the bytes each message takes and how many moves outgrew the
+/// initial block and had to go to the heap. Built with bench_allocs=1,
+/// both sides report heap allocations per message too.
+static void bench_msgs(const std::string &scenario, const std::string &path)
+{
+	const unsigned int ITERATIONS = 100000;
+	const unsigned int MESSAGES = 5;
+
+	GameState state;
+	state.load_file(path);
+
+	Tile *from = NULL, *to = NULL;
+	for(Tile::List::iterator t = state.tiles.begin(); t != state.tiles.end() && !from; ++t) {
+		if((*t)->pawn) {
+			from = *t;
+			to = state.tile_right_of(from);
+			if(!to) {
+				to = state.tile_left_of(from);
+			}
+		}
+	}
+	if(!from || !to) {
+		return;
+	}
+	arm_pawns(state);
+	uint32_t to_index = std::find(state.tiles.begin(), state.tiles.end(), to) - state.tiles.begin();
+
+	std::string out;
+	double rate[2], per_msg[2] = { -1, -1 };
+	uint64_t used = 0;
+	unsigned long spills = 0;
+	std::vector<char> block(ARENA_BLOCK_SIZE);
+	for(int use_arena = 0; use_arena < 2; ++use_arena) {
+		google::protobuf::ArenaOptions arena_options;
+		arena_options.initial_block = &block[0];
+		arena_options.initial_block_size = block.size();
+		google::protobuf::Arena arena(arena_options);
+
+#ifdef BENCH_ALLOCS
+		unsigned long before = allocations;
+#endif
+		double start = now();
+		for(unsigned int n = 0; n < ITERATIONS; ++n) {
+			build_move(use_arena ? &arena : NULL, from, to, to_index, out);
+			if(use_arena) {
+				used += arena.SpaceUsed();
+				spills += arena.SpaceAllocated() > block.size();
+				arena.Reset();
+			}
+		}
+		rate[use_arena] = ITERATIONS * MESSAGES / (now() - start);
+#ifdef BENCH_ALLOCS
+		per_msg[use_arena] = (double)(allocations - before) / (ITERATIONS * MESSAGES);
+#endif
+	}
+
+	printf("%-14s heap %10.0f msgs/s", scenario.c_str(), rate[0]);
+	if(per_msg[0] >= 0) {
+		printf(" %5.2f allocs/msg", per_msg[0]);
+	}
+	printf("  arena %10.0f msgs/s", rate[1]);
+	if(per_msg[1] >= 0) {
+		printf(" %5.2f allocs/msg", per_msg[1]);
+	}
+	printf(" %6.1f bytes/msg %lu spills\n", (double)used / (ITERATIONS * MESSAGES), spills);
+}
+
+/* A spectating admin driving one room of the rooms benchmark, over a
+ * blocking socket on its own thread.
+*/
+struct bench_room {
+	boost::asio::ip::tcp::socket socket;
+	boost::mutex mutex;
+	unsigned long turns;
+
+	bench_room(boost::asio::io_service &io) : socket(io), turns(0) {}
+
+	void send(const protocol::message &msg) {
+		std::string pb;
+		msg.SerializeToString(&pb);
+
+		uint32_t size = htonl(pb.size());
+		boost::asio::write(socket, boost::asio::buffer(&size, sizeof(size)));
+		boost::asio::write(socket, boost::asio::buffer(pb));
+	}
+
+	bool recv(protocol::message &msg) {
+		uint32_t size;
+		boost::system::error_code error;
+
+		boost::asio::read(socket, boost::asio::buffer(&size, sizeof(size)), error);
+		if(error) {
+			return false;
+		}
+
+		std::vector<char> buf(ntohl(size));
+		boost::asio::read(socket, boost::asio::buffer(buf), error);
+
+		return !error && msg.ParseFromArray(buf.empty() ? NULL : &buf[0], buf.size());
+	}
+
+	void start(uint16_t port, const std::string &name) {
+		socket.connect(boost::asio::ip::tcp::endpoint(boost::asio::ip::address_v4::loopback(), port));
+
+		protocol::message msg;
+		msg.set_msg(protocol::INIT);
+		msg.set_player_name("bench");
+		msg.set_room(name);
+		send(msg);
+
+		protocol::message ginfo;
+		if(!recv(ginfo) || ginfo.msg() != protocol::GINFO) {
+			throw std::runtime_error("Room " + name + " refused the benchmark");
+		}
+
+		msg.Clear();
+		msg.set_msg(protocol::CCOLOUR);
+		msg.add_players()->set_id(ginfo.player_id());
+		msg.mutable_players(0)->set_colour(protocol::SPECTATE);
+		send(msg);
+
+		for(int i = 0; i < 2; ++i) {
+			msg.Clear();
+			msg.set_msg(protocol::ADD_AI);
+			send(msg);
+		}
+
+		begin();
+	}
+
+	void begin() {
+		protocol::message msg;
+		msg.set_msg(protocol::BEGIN);
+		send(msg);
+	}
+
+	void count(const protocol::message &msg) {
+		if(msg.msg() == protocol::TURN) {
+			boost::unique_lock<boost::mutex> lock(mutex);
+			++turns;
+		}else if(msg.msg() == protocol::GOVER) {
+			// Keep the room busy for the whole run.
+			begin();
+		}
+	}
+
+	void run() {
+		protocol::message msg;
+		try {
+			while(recv(msg)) {
+				count(msg);
+				for(int i = 0; i < msg.batch_size(); ++i) {
+					count(msg.batch(i));
+				}
+			}
+		} catch(const boost::system::system_error &) {
+			// The server went away while restarting a game.
+		}
+	}
+
+	unsigned long turns_so_far() {
+		boost::unique_lock<boost::mutex> lock(mutex);
+		return turns;
+	}
+};
+
+/// rooms: AI games played in parallel rooms on one server, as turns per
+/// second with 1, 2 and 4 server threads.
+static void bench_rooms(const std::string &scenario, const std::string &)
+{
+	const unsigned int ROOMS = 8;
+	const uint16_t PORT = 9192;
+	const double SECONDS = 2.0;
+	const unsigned int threads[] = { 1, 2, 4 };
+
+	unsigned int old_threads = options.server_threads;
+
+	double rate[sizeof threads / sizeof threads[0]];
+	for(unsigned int t = 0; t < sizeof threads / sizeof threads[0]; ++t) {
+		options.server_threads = threads[t];
+
+		Server *server = new Server(PORT, scenario);
+
+		boost::asio::io_service io;
+		std::vector<boost::shared_ptr<bench_room> > rooms;
+		boost::thread_group readers;
+
+		try {
+			for(unsigned int r = 0; r < ROOMS; ++r) {
+				std::ostringstream name;
+				name << "bench-" << r;
+
+				rooms.push_back(boost::shared_ptr<bench_room>(new bench_room(io)));
+				rooms.back()->start(PORT, name.str());
+				readers.create_thread(boost::bind(&bench_room::run, rooms.back().get()));
+			}
+		} catch(...) {
+			delete server;
+			readers.join_all();
+			options.server_threads = old_threads;
+			throw;
+		}
+
+		boost::this_thread::sleep(boost::posix_time::milliseconds((long)(SECONDS * 1000)));
+
+		unsigned long turns = 0;
+		for(unsigned int r = 0; r < ROOMS; ++r) {
+			turns += rooms[r]->turns_so_far();
+		}
+
+		// Closes every connection, which ends the readers.
+		delete server;
+		readers.join_all();
+
+		rate[t] = turns / SECONDS;
+	}
+
+	printf("%-14s", scenario.c_str());
+	for(unsigned int t = 0; t < sizeof threads / sizeof threads[0]; ++t) {
+		printf("  %u threads %8.1f turns/s", threads[t], rate[t]);
+	}
+	printf("\n");
+
+	options.server_threads = old_threads;
+}
+
+static struct {
+	const char *name;
+	bench_fn fn;
+} benchmarks[] = {
+	{"eval", &bench_eval},
+	{"search", &bench_search},
+	{"threat", &bench_threat},
+	{"board", &bench_board},
+	{"msgs", &bench_msgs},
+	{"rooms", &bench_rooms},
+};
+
+int run_benchmark(const std::string &name)
+{
+	for(unsigned int i = 0; i < sizeof benchmarks / sizeof benchmarks[0]; ++i) {
+		if(name != benchmarks[i].name) {
+			continue;
+		}
+
+		std::vector<std::string> names = scenarios();
+		for(std::vector<std::string>::iterator s = names.begin(); s != names.end(); ++s) {
+			try {
+				benchmarks[i].fn(*s, "scenario/" + *s);
+			} catch(std::exception &e) {
+				fprintf(stderr, "%s: %s\n", s->c_str(), e.what());
+				return 1;
+			}
+		}
+
+		return 0;
+	}
+
+	fprintf(stderr, "Unknown benchmark '%s'. Available:", name.c_str());
+	for(unsigned int i = 0; i < sizeof benchmarks / sizeof benchmarks[0]; ++i) {
+		fprintf(stderr, " %s", benchmarks[i].name);
+	}
+	fprintf(stderr, "\n");
+
+	return 1;
+}
@@ -0,0 +1,11 @@
+#ifndef BENCH_HPP
+#define BENCH_HPP
+
+#include <string>
+
+/* Run a named microbenchmark against every scenario and print the results.
+ * Returns the process exit status.
+*/
+int run_benchmark(const std::string &name);
+
+#endif /* !BENCH_HPP */
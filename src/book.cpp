@@ -0,0 +1,277 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <algorithm>
+#include <map>
+#include <set>
+#include <stdexcept>
+#include <boost/filesystem.hpp>
+
+#include "book.hpp"
+#include "gamestate.hpp"
+#include "evaluator.hpp"
+#include "search.hpp"
+#include "ttable.hpp"
+
+const size_t HEADER_SIZE = 16;
+const size_t RECORD_SIZE = 16;
+
+static uint64_t get_le(const unsigned char *p, int bytes)
+{
+	uint64_t v = 0;
+	for(int i = bytes - 1; i >= 0; --i) {
+		v = (v << 8) | p[i];
+	}
+	return v;
+}
+
+static void put_le(unsigned char *p, uint64_t v, int bytes)
+{
+	for(int i = 0; i < bytes; ++i) {
+		p[i] = v >> (i * 8);
+	}
+}
+
+boost::shared_ptr<MoveBook> MoveBook::open(const std::string &filename)
+{
+	if(!boost::filesystem::exists(filename)) {
+		return boost::shared_ptr<MoveBook>();
+	}
+
+	return boost::shared_ptr<MoveBook>(new MoveBook(filename));
+}
+
+MoveBook::MoveBook(const std::string &filename) :
+	file(filename.c_str(), boost::interprocess::read_only),
+	region(file, boost::interprocess::read_only),
+	records(NULL), count(0)
+{
+	const unsigned char *data = (const unsigned char *)region.get_address();
+	size_t size = region.get_size();
+
+	if(size < HEADER_SIZE || memcmp(data, "HRB1", 4) != 0) {
+		throw std::runtime_error("Not a move book: " + filename);
+	}
+
+	count = get_le(data + 4, 4);
+	if(size < HEADER_SIZE + count * RECORD_SIZE) {
+		throw std::runtime_error("Truncated move book: " + filename);
+	}
+
+	records = data + HEADER_SIZE;
+}
+
+bool MoveBook::lookup(uint64_t key, entry &e) const
+{
+	size_t lo = 0, hi = count;
+	while(lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		const unsigned char *r = records + mid * RECORD_SIZE;
+		uint64_t k = get_le(r, 8);
+
+		if(k < key) {
+			lo = mid + 1;
+		}else if(k > key) {
+			hi = mid;
+		}else{
+			e.from = get_le(r + 8, 2);
+			e.to = get_le(r + 10, 2);
+			e.score = (int16_t)get_le(r + 12, 2);
+			e.depth = get_le(r + 14, 2);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/* Book generation.
+ *
+ * Openings: every position reachable from the start within OPENING_PLIES
+ * plies, with the colours moving in order.
+ *
+ * Endgames: positions with at most ENDGAME_PAWNS pawns left, or half the
+ * starting pawns on bigger maps, found by playing random games from the
+ * start and searched from there for a few more plies.
+ *
+ * Each position is searched to BOOK_DEPTH, far deeper than the AI can
+ * afford during a game.
+*/
+
+const int OPENING_PLIES = 6;
+const int ENDGAME_PAWNS = 4;
+const int ENDGAME_PLIES = 2;
+const int PLAYOUTS = 2000;
+const int PLAYOUT_PLIES = 200;
+const int BOOK_DEPTH = 8;
+
+namespace {
+	struct builder {
+		Evaluator evaluator;
+		std::vector<PlayerColour> colours;
+		TranspositionTable table;
+		std::map<uint64_t, MoveBook::entry> entries;
+
+		int endgame_pawns;
+
+		builder() : table(options.ai_hash_mb), endgame_pawns(0) {}
+
+		int next_turn(int turn);
+		void add(PlayerColour colour);
+		void expand(int turn, int plies);
+		void playout();
+	};
+}
+
+// Next colour with any moves, or -1 if the game is over.
+int builder::next_turn(int turn)
+{
+	std::set<int> alive;
+	for(size_t c = 0; c < colours.size(); ++c) {
+		std::vector<Evaluator::move> moves;
+		evaluator.moves(colours[c], moves);
+		if(!moves.empty()) {
+			alive.insert(c);
+		}
+	}
+	if(alive.size() < 2) {
+		return -1;
+	}
+
+	for(size_t i = 1; i <= colours.size(); ++i) {
+		int t = (turn + i) % colours.size();
+		if(alive.count(t)) {
+			return t;
+		}
+	}
+	return -1;
+}
+
+void builder::add(PlayerColour colour)
+{
+	uint64_t key = Search::position_key(evaluator.hash(), colour);
+	if(entries.count(key)) {
+		return;
+	}
+
+	std::vector<Evaluator::move> root;
+	evaluator.moves(colour, root);
+	if(root.empty()) {
+		return;
+	}
+
+	Search::result r = Search::search(evaluator, colour, root, BOOK_DEPTH, options.ai_threads, &table);
+
+	MoveBook::entry e;
+	e.from = root[r.best].from;
+	e.to = root[r.best].to;
+	e.score = std::max(std::min(r.scores[r.best], (int)SHRT_MAX), -(int)SHRT_MAX);
+	e.depth = BOOK_DEPTH;
+	entries[key] = e;
+}
+
+void builder::expand(int turn, int plies)
+{
+	add(colours[turn]);
+	if(plies == 0) {
+		return;
+	}
+
+	std::vector<Evaluator::move> moves;
+	evaluator.moves(colours[turn], moves);
+	for(size_t i = 0; i < moves.size(); ++i) {
+		evaluator.make_move(moves[i]);
+		int next = next_turn(turn);
+		if(next != -1) {
+			expand(next, plies - 1);
+		}
+		evaluator.undo_move();
+	}
+}
+
+void builder::playout()
+{
+	int turn = 0, depth = 0;
+	for(; depth < PLAYOUT_PLIES && turn != -1; ++depth) {
+		if(evaluator.pawn_count() <= endgame_pawns) {
+			expand(turn, ENDGAME_PLIES);
+			break;
+		}
+
+		std::vector<Evaluator::move> moves;
+		evaluator.moves(colours[turn], moves);
+		if(moves.empty()) {
+			// Boxed in, nothing further down this line is worth a book entry.
+			break;
+		}
+		evaluator.make_move(moves[rand() % moves.size()]);
+		turn = next_turn(turn);
+	}
+
+	for(; depth > 0; --depth) {
+		evaluator.undo_move();
+	}
+}
+
+void MoveBook::generate(const std::string &scenario, const std::string &filename)
+{
+	GameState state;
+	state.load_file(scenario);
+
+	builder b;
+	b.evaluator.sync(state);
+
+	std::set<PlayerColour> colours = state.colours();
+	b.colours.assign(colours.begin(), colours.end());
+	if(b.colours.size() < 2) {
+		throw std::runtime_error("Scenario needs at least two colours: " + scenario);
+	}
+
+	b.endgame_pawns = std::min(ENDGAME_PAWNS, b.evaluator.pawn_count() / 2);
+
+	b.expand(0, OPENING_PLIES);
+	size_t openings = b.entries.size();
+
+	srand(1);
+	for(int i = 0; i < PLAYOUTS; ++i) {
+		b.playout();
+	}
+
+	std::string data(HEADER_SIZE + b.entries.size() * RECORD_SIZE, 0);
+	unsigned char *p = (unsigned char *)&data[0];
+	memcpy(p, "HRB1", 4);
+	put_le(p + 4, b.entries.size(), 4);
+	p += HEADER_SIZE;
+
+	// std::map keeps the keys sorted.
+	for(std::map<uint64_t, entry>::iterator i = b.entries.begin(); i != b.entries.end(); ++i) {
+		put_le(p, i->first, 8);
+		put_le(p + 8, i->second.from, 2);
+		put_le(p + 10, i->second.to, 2);
+		put_le(p + 12, (uint16_t)i->second.score, 2);
+		put_le(p + 14, i->second.depth, 2);
+		p += RECORD_SIZE;
+	}
+
+	FILE *fh = fopen(filename.c_str(), "wb");
+	if(!fh) {
+		throw std::runtime_error("Could not open " + filename);
+	}
+	if(fwrite(data.data(), data.size(), 1, fh) != 1) {
+		fclose(fh);
+		throw std::runtime_error("Failed to write book " + filename);
+	}
+	fclose(fh);
+
+	boost::shared_ptr<MoveBook> book = open(filename);
+	for(std::map<uint64_t, entry>::iterator i = b.entries.begin(); i != b.entries.end(); ++i) {
+		entry e;
+		if(!book->lookup(i->first, e) || e.from != i->second.from || e.to != i->second.to) {
+			throw std::runtime_error("Book doesn't read back: " + filename);
+		}
+	}
+
+	printf("%s: %u opening and %u endgame positions\n", filename.c_str(),
+	       (unsigned int)openings, (unsigned int)(b.entries.size() - openings));
+}
@@ -0,0 +1,53 @@
+#ifndef BOOK_HPP
+#define BOOK_HPP
+
+#include <string>
+#include <stddef.h>
+#include <stdint.h>
+#include <boost/shared_ptr.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+/* Precomputed best moves for one scenario.
+ *
+ * Book files are "HRB1", a 4-byte LE record count and 8 reserved bytes,
+ * followed by 16-byte records sorted by key:
+ *
+ *  0-7   position key (Search::position_key), with the colours of the
+ *        scenario file rather than the players, LE
+ *  8-9   from tile index, LE
+ * 10-11  to tile index, LE
+ * 12-13  score, LE
+ * 14-15  search depth, LE
+ *
+ * Books are memory mapped and searched in place.
+*/
+class MoveBook {
+public:
+	struct entry {
+		int from, to;
+		int score;
+		int depth;
+	};
+
+	// Map a book, returns an empty pointer if the file doesn't exist.
+	static boost::shared_ptr<MoveBook> open(const std::string &filename);
+
+	bool lookup(uint64_t key, entry &e) const;
+
+	size_t size() const { return count; }
+
+	// Write a book for a scenario, see book.cpp for what goes in it.
+	static void generate(const std::string &scenario, const std::string &filename);
+
+private:
+	boost::interprocess::file_mapping file;
+	boost::interprocess::mapped_region region;
+
+	const unsigned char *records;
+	size_t count;
+
+	MoveBook(const std::string &filename);
+};
+
+#endif /* !BOOK_HPP */
@@ -0,0 +1,94 @@
+#include <stdexcept>
+#include <zlib.h>
+
+#include "chunk.hpp"
+#include "hexradius.hpp"
+
+void chunk_message(const protocol::message &msg, std::vector<protocol::message> &out)
+{
+	std::string pb;
+	msg.SerializeToString(&pb);
+
+	if(pb.size() + sizeof(uint32_t) <= MAX_MSGSIZE - FRAME_HEADROOM) {
+		out.push_back(msg);
+		return;
+	}
+
+	if(pb.size() > MAX_CHUNKED_SIZE) {
+		throw std::runtime_error("Message too big to send");
+	}
+
+	std::string data(compressBound(pb.size()), 0);
+	uLongf size = data.size();
+	uint32_t inflated = 0;
+
+	if(compress2((Bytef*)&data[0], &size, (const Bytef*)pb.data(), pb.size(), Z_BEST_COMPRESSION) == Z_OK && size < pb.size()) {
+		data.resize(size);
+		inflated = pb.size();
+	}else{
+		data = pb;
+	}
+
+	for(size_t off = 0; off < data.size(); off += CHUNK_SIZE) {
+		protocol::message chunk;
+		chunk.set_msg(protocol::CHUNK);
+		chunk.set_chunk(data.substr(off, CHUNK_SIZE));
+		if(off == 0) {
+			chunk.set_chunk_total(data.size());
+			if(inflated) {
+				chunk.set_chunk_inflated(inflated);
+			}
+		}
+
+		out.push_back(chunk);
+	}
+}
+
+bool ChunkAssembler::add(const protocol::message &chunk, protocol::message &msg)
+{
+	if(chunk.has_chunk_total()) {
+		if(chunk.chunk_total() > MAX_CHUNKED_SIZE || chunk.chunk_inflated() > MAX_CHUNKED_SIZE) {
+			active = false;
+			throw std::runtime_error("Chunked message too big");
+		}
+
+		data.clear();
+		data.reserve(chunk.chunk_total());
+		total = chunk.chunk_total();
+		inflated = chunk.chunk_inflated();
+		active = true;
+	}
+
+	if(!active) {
+		throw std::runtime_error("Chunk received without a start");
+	}
+
+	if(chunk.chunk().size() > total - data.size()) {
+		active = false;
+		throw std::runtime_error("Chunked message longer than expected");
+	}
+
+	data.append(chunk.chunk());
+	if(data.size() < total) {
+		return false;
+	}
+
+	active = false;
+
+	if(inflated) {
+		std::string pb(inflated, 0);
+		uLongf size = inflated;
+
+		if(uncompress((Bytef*)&pb[0], &size, (const Bytef*)data.data(), data.size()) != Z_OK || size != inflated) {
+			throw std::runtime_error("Cannot inflate chunked message");
+		}
+
+		data.swap(pb);
+	}
+
+	if(!msg.ParseFromString(data)) {
+		throw std::runtime_error("Cannot parse chunked message");
+	}
+
+	return true;
+}
@@ -0,0 +1,30 @@
+#ifndef CHUNK_HPP
+#define CHUNK_HPP
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "hexradius.pb.h"
+
+/* Split msg into CHUNK messages if it is too big for one frame, otherwise
+ * out just gets msg. Chunked data is compressed when that makes it smaller.
+*/
+void chunk_message(const protocol::message &msg, std::vector<protocol::message> &out);
+
+/* Reassembles the chunks of one message at a time. */
+class ChunkAssembler {
+public:
+	ChunkAssembler() : total(0), inflated(0), active(false) {}
+
+	// Add the next chunk. Returns true and sets msg once the message is
+	// complete, throws std::runtime_error on bad chunks.
+	bool add(const protocol::message &chunk, protocol::message &msg);
+
+private:
+	std::string data;
+	uint32_t total, inflated;
+	bool active;
+};
+
+#endif /* !CHUNK_HPP */
@@ -1,6 +1,8 @@
+#include <stdio.h>
 #include <stdint.h>
 #include <boost/asio.hpp>
 #include <string>
+#include <set>
 #include <boost/shared_ptr.hpp>
 #include <boost/bind.hpp>
 #include <stdexcept>
@@ -23,6 +25,8 @@
 const int EVENT_RDTIMER = 1;	// Redraw timer has fired
 const int EVENT_RETURN = 2;	// Client should return - i.e. leave button pressed
 
+const size_t MAX_RECV_SPARE = 16;	// Handled messages kept to parse into
+
 static int within_rect(SDL_Rect rect, int x, int y) {
 	return (x >= rect.x && x < rect.x+rect.w && y >= rect.y && y < rect.y+rect.h);
 }
@@ -49,10 +53,10 @@ static Uint32 redraw_callback(Uint32 interval, void *) {
 	return interval;
 }
 
-Client::Client(std::string host, uint16_t port) :
+Client::Client(std::string host, uint16_t port, std::string room) :
 	quit(false), game_state(0),
-	socket(io_service), redraw_timer(NULL), turn(0),
-	state(CONNECTING), last_redraw(0), board(SDL_Rect()),
+	socket(io_service), connected(false), redraw_timer(NULL), write_batch(0), turn(0),
+	state(CONNECTING), room_name(room), last_seq(0), last_redraw(0), board(SDL_Rect()), show_danger(false),
 	dpawn(pawn_ptr()), mpawn(pawn_ptr()), hpawn(pawn_ptr()),
 	pmenu_area(SDL_Rect()), lobby_gui(0, 0, 800, 600)
 {
@@ -68,10 +72,10 @@ Client::Client(std::string host, uint16_t port) :
 	boost::asio::ip::tcp::resolver::query query(host, "");
 	boost::asio::ip::tcp::resolver::iterator it = resolver.resolve(query);
 
-	boost::asio::ip::tcp::endpoint ep = *it;
-	ep.port(port);
+	server = *it;
+	server.port(port);
 
-	socket.async_connect(ep, boost::bind(&Client::connect_callback, this, boost::asio::placeholders::error));
+	socket.async_connect(server, boost::bind(&Client::connect_callback, this, boost::asio::placeholders::error));
 
 	redraw_timer = SDL_AddTimer(FRAME_DELAY, &redraw_callback, NULL);
 	network_thread = boost::thread(boost::bind(&Client::net_thread_main, this));
@@ -83,6 +87,7 @@ Client::~Client() {
 	}
 
 	io_service.stop();
+	network_thread.interrupt();
 
 	std::cout << "Waiting for client network thread to exit..." << std::endl;
 	network_thread.join();
@@ -95,14 +100,91 @@ Client::~Client() {
 }
 
 void Client::net_thread_main() {
+	std::string error;
+
 	try {
-		io_service.run();
-	} catch(std::runtime_error e) {
+		while(1) {
+			try {
+				io_service.run();
+				return;
+			} catch(std::runtime_error e) {
+				error = e.what();
+			}
+
+			std::cerr << "Network error: " << error << std::endl;
+
+			if(!reconnect()) {
+				break;
+			}
+		}
+	} catch(boost::thread_interrupted &) {
+		return;
+	}
+
+	protocol::message msg;
+	msg.set_msg(protocol::QUIT);
+	msg.set_quit_msg(std::string("Network error: ") + error);
+
+	boost::unique_lock<boost::mutex> lock(the_mutex);
+	recv_queue.push_back(msg);
+}
+
+bool Client::reconnect() {
+	{
+		boost::unique_lock<boost::mutex> lock(the_mutex);
+
+		if(state != GAME || session.empty()) {
+			return false;
+		}
+
+		connected = false;
+	}
+
+	// Let whatever was waiting on the old connection see it close.
+	boost::system::error_code ec;
+	socket.close(ec);
+	io_service.reset();
+	io_service.poll();
+	io_service.reset();
+
+	{
+		boost::unique_lock<boost::mutex> lock(the_mutex);
+
+		// Whatever was being sent is lost, the player can try again.
+		send_queue.clear();
+		write_batch = 0;
+	}
+
+	for(unsigned int i = 0; i < RECONNECT_TRIES; ++i) {
+		boost::this_thread::sleep(boost::posix_time::seconds(1));
+
+		std::cerr << "Reconnecting..." << std::endl;
+
+		socket.close(ec);
+		socket.connect(server, ec);
+		if(ec) {
+			continue;
+		}
+
+		boost::unique_lock<boost::mutex> lock(the_mutex);
+
 		protocol::message msg;
-		msg.set_msg(protocol::QUIT);
-		msg.set_quit_msg(std::string("Network error: ") + e.what());
-		recv_queue.push(msg);
+		msg.set_msg(protocol::INIT);
+		msg.set_player_name(options.username);
+		msg.set_room(room_name);
+		msg.set_session(session);
+		msg.set_seq(last_seq);
+
+		connected = true;
+		send_queue.push_front(send_buf(msg));
+		StartWrite();
+
+		ReadSize();
+
+		return true;
 	}
+
+	return false;
 }
 
 void Client::connect_callback(const boost::system::error_code& error) {
@@ -112,9 +194,14 @@ void Client::connect_callback(const boost::system::error_code& error) {
 		throw std::runtime_error("Connection failed: " + error.message());
 	}
 
+	connected = true;
+
 	protocol::message msg;
 	msg.set_msg(protocol::INIT);
 	msg.set_player_name(options.username);
+	if(!room_name.empty()) {
+		msg.set_room(room_name);
+	}
 
 	WriteProto(msg);
 
@@ -122,34 +209,53 @@ void Client::connect_callback(const boost::system::error_code& error) {
 }
 
 void Client::WriteProto(const protocol::message &msg) {
-	send_queue.push(send_buf(msg));
+	send_queue.push_back(send_buf(msg));
+
+	if(!write_batch && connected) {
+		StartWrite();
+	}
+}
+
+// Hand as much of the queue as allowed to a single write.
+void Client::StartWrite() {
+	std::vector<boost::asio::const_buffer> buffers;
+	size_t bytes = 0;
+
+	for(std::deque<send_buf>::iterator i = send_queue.begin(); i != send_queue.end(); ++i) {
+		if(!buffers.empty() && (buffers.size() == MAX_WRITE_FRAMES || bytes + i->size > MAX_WRITE_BYTES)) {
+			break;
+		}
 
-	if(send_queue.size() == 1) {
-		async_write(socket,
-			    boost::asio::buffer(send_queue.front().buf.get(),
-						send_queue.front().size),
-			    boost::bind(&Client::WriteFinish,
-					this,
-					boost::asio::placeholders::error));
+		buffers.push_back(boost::asio::buffer(i->buf.get(), i->size));
+		bytes += i->size;
 	}
+
+	write_batch = buffers.size();
+
+	async_write(socket,
+		    buffers,
+		    boost::bind(&Client::WriteFinish,
+				this,
+				boost::asio::placeholders::error));
 }
 
 void Client::WriteFinish(const boost::system::error_code& error) {
 	boost::unique_lock<boost::mutex> lock(the_mutex);
 
-	send_queue.pop();
+	// Closed by reconnect(), which clears the queue itself.
+	if(error == boost::asio::error::operation_aborted) {
+		return;
+	}
+
+	send_queue.erase(send_queue.begin(), send_queue.begin() + write_batch);
+	write_batch = 0;
 
 	if(error) {
 		throw std::runtime_error("Write error: " + error.message());
 	}
 
 	if(!send_queue.empty()) {
-		async_write(socket,
-			    boost::asio::buffer(send_queue.front().buf.get(),
-						send_queue.front().size),
-			    boost::bind(&Client::WriteFinish,
-					this,
-					boost::asio::placeholders::error));
+		StartWrite();
 	}
 }
 
@@ -168,11 +274,15 @@ void Client::run() {
 			return;
 		}
 
+		// The network thread can't add to the queue while we hold the lock.
 		while(!recv_queue.empty()) {
-			protocol::message message = recv_queue.front();
-			recv_queue.pop();
+			handle_message(recv_queue.front());
 
-			handle_message(message);
+			if(recv_spare.size() < MAX_RECV_SPARE) {
+				recv_spare.push_back(protocol::message());
+				recv_spare.back().Swap(&recv_queue.front());
+			}
+			recv_queue.pop_front();
 		}
 		if(dpawn && dpawn->destroyed()) dpawn.reset();
 		if(mpawn && mpawn->destroyed()) mpawn.reset();
@@ -327,6 +437,10 @@ void Client::run() {
 			}
 		}
 		else if(event.type == SDL_KEYDOWN) {
+			if(event.key.keysym.sym == SDLK_d) {
+				show_danger = !show_danger;
+				last_redraw = 0;
+			}
 			if(event.key.keysym.scancode == 49) {
 				int mouse_x, mouse_y;
 				SDL_GetMouseState(&mouse_x, &mouse_y);
@@ -358,6 +472,10 @@ void Client::ReadSize(void) {
 void Client::ReadMessage(const boost::system::error_code& error) {
 	boost::unique_lock<boost::mutex> lock(the_mutex);
 
+	if(error == boost::asio::error::operation_aborted) {
+		return;
+	}
+
 	if(error) {
 		throw std::runtime_error("Read error: " + error.message());
 	}
@@ -379,24 +497,62 @@ void Client::ReadMessage(const boost::system::error_code& error) {
 void Client::ReadFinish(const boost::system::error_code& error) {
 	boost::unique_lock<boost::mutex> lock(the_mutex);
 
+	if(error == boost::asio::error::operation_aborted) {
+		return;
+	}
+
 	if(error) {
 		throw std::runtime_error("Read error: " + error.message());
 	}
 
-	std::string msgstring(msgbuf.begin(), msgbuf.end());
+	recv_queue.push_back(protocol::message());
+	protocol::message &msg = recv_queue.back();
+	if(!recv_spare.empty()) {
+		msg.Swap(&recv_spare.back());
+		recv_spare.pop_back();
+	}
 
-	protocol::message msg;
-	if(!msg.ParseFromString(msgstring)) {
+	if(!msg.ParseFromArray(msgsize ? &msgbuf[0] : NULL, msgsize)) {
+		recv_queue.pop_back();
 		throw std::runtime_error("Invalid protobuf recieved from server");
 	}
 
-	recv_queue.push(msg);
+	if(msg.has_seq()) {
+		last_seq = msg.seq();
+	}
+
+	// Chunks are put back together here so a bad one is a protocol error
+	// like any other.
+	if(msg.msg() == protocol::CHUNK) {
+		protocol::message chunk, whole;
+		chunk.Swap(&msg);
+		recv_queue.pop_back();
+
+		if(!chunks.add(chunk, whole)) {
+			ReadSize();
+			return;
+		}
+
+		recv_queue.push_back(protocol::message());
+		recv_queue.back().Swap(&whole);
+	}
+
+	// Thrown out, don't try to come back.
+	if(recv_queue.back().msg() == protocol::QUIT) {
+		session.clear();
+	}
 
 	ReadSize();
 }
 
 void Client::handle_message(const protocol::message &msg) {
-	if(msg.msg() == protocol::PQUIT) {
+	if(msg.msg() == protocol::BATCH) {
+		// The state may change part way through (GOVER), so each message
+		// goes through the full dispatch.
+		for(int i = 0; i < msg.batch_size(); ++i) {
+			handle_message(msg.batch(i));
+		}
+	}else if(msg.msg() == protocol::PQUIT) {
 		if(msg.players_size() == 1) {
 			PlayerColour c = (PlayerColour)msg.players(0).colour();
 
@@ -419,6 +575,13 @@ void Client::handle_message(const protocol::message &msg) {
 	}else if(msg.msg() == protocol::QUIT) {
 		std::cout << "You have been disconnected by the server (" << msg.quit_msg() << ")" << std::endl;
 		push_sdl_event(EVENT_RETURN);
+	}else if(msg.msg() == protocol::GINFO && state == GAME) {
+		// Back in the game after reconnecting, with a snapshot of it.
+		state = LOBBY;
+		delete game_state;
+		game_state = 0;
+
+		handle_message_lobby(msg);
 	}else{
 		if(state == GAME) {
 			handle_message_game(msg);
@@ -470,6 +633,14 @@ void Client::handle_message_lobby(const protocol::message &msg) {
 		my_id = msg.player_id();
 
 		map_name = msg.map_name();
+		if(msg.has_room()) {
+			room_name = msg.room();
+		}
+		if(msg.has_session()) {
+			session = msg.session();
+		}
+
+		players.clear();
 
 		for(int i = 0; i < msg.players_size(); i++) {
 			Player p;
@@ -575,9 +746,14 @@ void Client::handle_message_game(const protocol::message &msg) {
 				continue;
 			}
 
-			pawn->flags = msg.pawns(i).flags();
-			pawn->range = msg.pawns(i).range();
-			pawn->colour = PlayerColour(msg.pawns(i).colour());
+			// Only the fields that changed are sent.
+			if(msg.pawns(i).has_flags()) pawn->flags = msg.pawns(i).flags();
+			if(msg.pawns(i).has_range()) pawn->range = msg.pawns(i).range();
+			if(msg.pawns(i).has_colour()) pawn->colour = PlayerColour(msg.pawns(i).colour());
+			if(!msg.pawns(i).all_powers() && msg.pawns(i).powers_size() == 0) {
+				continue;
+			}
+
 			std::map<int, int> old_powers(pawn->powers);
 			pawn->powers.clear();
 
@@ -612,125 +788,8 @@ void Client::handle_message_game(const protocol::message &msg) {
 		game_state = 0;
 
 		ImgStuff::set_mode(MENU_WIDTH, MENU_HEIGHT);
-	} else if(msg.msg() == protocol::PAWN_ANIMATION) {
-		if(msg.animation_name() == "teleport") {
-			if(msg.pawns_size() != 1) {
-				std::cerr << "Recieved invalid teleport animation." << std::endl;
-				return;
-			}
-			pawn_ptr pawn = game_state->pawn_at(msg.pawns(0).col(), msg.pawns(0).row());
-			if(!pawn) {
-				std::cerr << "Recieved invalid teleport animation. No such pawn " << msg.pawns(0).col() << "," << msg.pawns(0).col() << std::endl;
-				return;
-			}
-
-			// Beware! The teleport animation message is sent before the move message.
-			// This expects that the pawn will move soon after the animation starts playing.
-			// The animation message contains source (col/row) tile and the target (new_col/new_row)
-			// tile coordinates, but these aren't used yet.
-			pawn->last_tile = pawn->cur_tile;
-			pawn->last_tile->render_pawn = pawn;
-			pawn->teleport_time = SDL_GetTicks();
-		} else if(msg.animation_name() == "prod") {
-			// Pawn 0 = originator
-			// Pawn 1 = target
-			if(msg.pawns_size() != 2) {
-				std::cerr << "Recieved invalid teleport animation." << std::endl;
-				return;
-			}
-			pawn_ptr pawn = game_state->pawn_at(msg.pawns(0).col(), msg.pawns(0).row());
-			if(!pawn) {
-				std::cerr << "Recieved invalid prod animation. No such pawn " << msg.pawns(0).col() << "," << msg.pawns(0).col() << std::endl;
-				return;
-			}
-			pawn_ptr target = game_state->pawn_at(msg.pawns(1).col(), msg.pawns(1).row());
-			if(!target) {
-				std::cerr << "Recieved invalid prod animation. No such pawn " << msg.pawns(1).col() << "," << msg.pawns(1).col() << std::endl;
-				return;
-			}
-
-			target->prod_time = SDL_GetTicks();
-		} else {
-			std::cerr << "Unknown pawn animation " << msg.animation_name() << std::endl;
-		}
-	} else if(msg.msg() == protocol::TILE_ANIMATION) {
-		if(msg.animation_name() != "elevation") {
-			std::cerr << "Received unsupported animation " << msg.animation_name() << std::endl;
-			return;
-		}
-		bool got_delay_factor = false;
-		bool got_mode = false;
-		bool got_target_elevation = false;
-		float delay_factor = 0.0f;
-		TileAnimators::ElevationMode mode = TileAnimators::ABSOLUTE;
-		int target_elevation = -1;
-		for(int i = 0; i < msg.misc_size(); i++) {
-			if(msg.misc(i).key() == "delay-factor") {
-				got_delay_factor = true;
-				delay_factor = msg.misc(i).float_value();
-			} else if(msg.misc(i).key() == "mode") {
-				got_mode = true;
-				if(msg.misc(i).string_value() == "absolute") {
-					mode = TileAnimators::ABSOLUTE;
-				} else if(msg.misc(i).string_value() == "relative") {
-					mode = TileAnimators::RELATIVE;
-				} else {
-					std::cerr << "Recieved unsupported elevation animation mode " << msg.misc(i).string_value() << std::endl;
-					return;
-				}
-			} else if(msg.misc(i).key() == "target-elevation") {
-				got_target_elevation = true;
-				target_elevation = msg.misc(i).int_value();
-			} else {
-				std::cerr << "Recieved unsupported animation " << msg.animation_name() << std::endl;
-				return;
-			}
-		}
-		if(!got_target_elevation || !got_delay_factor || !got_mode || msg.tiles_size() < 1) {
-			std::cerr << "Recieved unsupported animation " << msg.animation_name() << std::endl;
-			return;
-		}
-		Tile *center = game_state->tile_at(msg.tiles(0).col(), msg.tiles(0).row());
-		assert(center);
-		Tile::List tiles;
-		for(int i = 1; i < msg.tiles_size(); ++i) {
-			Tile *tile = game_state->tile_at(msg.tiles(i).col(), msg.tiles(i).row());
-			assert(tile);
-			tiles.push_back(tile);
-		}
-		tile_animators.push_back(new TileAnimators::ElevationAnimator(tiles, center, delay_factor, mode, target_elevation));
-	} else if(msg.msg() == protocol::PARTICLE_ANIMATION) {
-		int tile_col = -1, tile_row = -1;
-		for(int i = 0; i < msg.misc_size(); i++) {
-			if(msg.misc(i).key() == "tile-col") {
-				tile_col = msg.misc(i).int_value();
-			} else if(msg.misc(i).key() == "tile-row") {
-				tile_row = msg.misc(i).int_value();
-			} else {
-				std::cerr << "Recieved unsupported animation " << msg.animation_name() << std::endl;
-				return;
-			}
-		}
-		if(tile_col == -1 || tile_row == -1) {
-			std::cerr << "Recieved unsupported animation " << msg.animation_name() << std::endl;
-			return;
-		}
-		Tile *tile = game_state->tile_at(tile_col, tile_row);
-		if(!tile) {
-			std::cerr << "Recieved unsupported animation " << msg.animation_name() << std::endl;
-			return;
-		}
-		if(msg.animation_name() == "crush") {
-			add_animator(new Animators::PawnCrush(tile));
-		} else if(msg.animation_name() == "pow") {
-			add_animator(new Animators::PawnPow(tile));
-		} else if(msg.animation_name() == "boom") {
-			add_animator(new Animators::PawnBoom(tile));
-		} else if(msg.animation_name() == "ohshitifelldownahole") {
-			add_animator(new Animators::PawnOhShitIFellDownAHole(tile));
-		} else {
-			std::cerr << "Recieved unsupported animation " << msg.animation_name() << std::endl;
-		}
+	} else if(msg.msg() == protocol::ANIMATION) {
+		handle_animation(msg.animation());
 	} else if(msg.msg() == protocol::ADD_POWER_NOTIFICATION) {
 		assert(msg.pawns_size() == 1);
 		Tile* tile = game_state->tile_at(msg.pawns(0).col(), msg.pawns(0).row());
@@ -757,6 +816,107 @@ void Client::handle_message_game(const protocol::message &msg) {
 	}
 }
 
+void Client::handle_animation(const protocol::animation &anim) {
+	const Tile::List &board = game_state->tiles;
+	if(anim.tile() >= board.size() || (anim.has_target() && anim.target() >= board.size())) {
+		std::cerr << "Recieved animation with invalid tile index" << std::endl;
+		return;
+	}
+	Tile *tile = board[anim.tile()];
+
+	switch(anim.type()) {
+	case protocol::CRUSH:
+		add_animator(new Animators::PawnCrush(tile));
+		break;
+	case protocol::POW:
+		add_animator(new Animators::PawnPow(tile));
+		break;
+	case protocol::BOOM:
+		add_animator(new Animators::PawnBoom(tile));
+		break;
+	case protocol::FALL:
+		add_animator(new Animators::PawnOhShitIFellDownAHole(tile));
+		break;
+	case protocol::TELEPORT: {
+		pawn_ptr pawn = tile->pawn;
+		if(!pawn) {
+			std::cerr << "Recieved invalid teleport animation. No such pawn " << tile->col << "," << tile->row << std::endl;
+			return;
+		}
+
+		// Beware! The teleport animation message is sent before the move message.
+		// This expects that the pawn will move soon after the animation starts playing.
+		// The target tile isn't used yet.
+		pawn->last_tile = pawn->cur_tile;
+		pawn->last_tile->render_pawn = pawn;
+		pawn->teleport_time = SDL_GetTicks();
+		break;
+	}
+	case protocol::PROD: {
+		if(!anim.has_target()) {
+			std::cerr << "Recieved invalid prod animation." << std::endl;
+			return;
+		}
+		Tile *target = board[anim.target()];
+		if(!tile->pawn || !target->pawn) {
+			std::cerr << "Recieved invalid prod animation. No such pawn" << std::endl;
+			return;
+		}
+
+		target->pawn->prod_time = SDL_GetTicks();
+		break;
+	}
+	case protocol::ELEVATION: {
+		if(!anim.has_delay_factor() || !anim.has_target_elevation()) {
+			std::cerr << "Recieved invalid elevation animation." << std::endl;
+			return;
+		}
+		Tile::List tiles;
+		tiles.reserve(anim.tiles_size());
+		for(int i = 0; i < anim.tiles_size(); ++i) {
+			if(anim.tiles(i) >= board.size()) {
+				std::cerr << "Recieved animation with invalid tile index" << std::endl;
+				return;
+			}
+			tiles.push_back(board[anim.tiles(i)]);
+		}
+		tile_animators.push_back(new TileAnimators::ElevationAnimator(tiles, tile, anim.delay_factor(),
+			anim.relative() ? TileAnimators::RELATIVE : TileAnimators::ABSOLUTE, anim.target_elevation()));
+		break;
+	}
+	case protocol::WORM: {
+		if(!anim.has_interval() || anim.tiles_size() == 0) {
+			std::cerr << "Recieved invalid worm animation." << std::endl;
+			return;
+		}
+		Tile::List path;
+		path.reserve(anim.tiles_size());
+		for(int i = 0; i < anim.tiles_size(); ++i) {
+			if(anim.tiles(i) >= board.size()) {
+				std::cerr << "Recieved animation with invalid tile index" << std::endl;
+				return;
+			}
+			path.push_back(board[anim.tiles(i)]);
+		}
+
+		// The worm's effects come after the animation, so the pawns it
+		// gets are still on the board.
+		pawn_ptr worm = tile->pawn;
+		std::set<Tile *> hit;
+		for(size_t i = 0; worm && i < path.size(); ++i) {
+			if(path[i]->pawn && path[i]->pawn->colour != worm->colour && hit.insert(path[i]).second) {
+				add_animator(new Animators::PawnBoom(path[i], i * anim.interval()));
+			}
+		}
+
+		tile_animators.push_back(new TileAnimators::WormAnimator(path, anim.interval()));
+		break;
+	}
+	default:
+		std::cerr << "Recieved unsupported animation " << anim.type() << std::endl;
+	}
+}
+
 void Client::DrawScreen() {
 	torus_frame = SDL_GetTicks() / 100 % (TORUS_FRAMES * 2);
 	if (torus_frame >= TORUS_FRAMES)
@@ -777,6 +937,10 @@ void Client::DrawScreen() {
 	SDL_Surface *line_tile = ImgStuff::GetImage("graphics/hextile.png", ImgStuff::TintValues(0,20,0));
 	SDL_Surface *smashed_line_tile = ImgStuff::GetImage("graphics/hextile-broken.png", ImgStuff::TintValues(0,20,0));
 	SDL_Surface *target_tile = ImgStuff::GetImage("graphics/hextile.png", ImgStuff::TintValues(100,0,0));
+	SDL_Surface *danger_tile = ImgStuff::GetImage("graphics/hextile.png", ImgStuff::TintValues(60,20,0));
+	SDL_Surface *smashed_danger_tile = ImgStuff::GetImage("graphics/hextile-broken.png", ImgStuff::TintValues(60,20,0));
+	SDL_Surface *threatened_tile = ImgStuff::GetImage("graphics/hextile.png", ImgStuff::TintValues(200,80,0));
+	SDL_Surface *smashed_threatened_tile = ImgStuff::GetImage("graphics/hextile-broken.png", ImgStuff::TintValues(200,80,0));
 	SDL_Surface *smashed_target_tile = ImgStuff::GetImage("graphics/hextile-broken.png", ImgStuff::TintValues(1000,0,0));
 	SDL_Surface *pickup = ImgStuff::GetImage("graphics/pickup.png");
 	SDL_Surface *mine = ImgStuff::GetImage("graphics/mines.png");
@@ -909,6 +1073,11 @@ void Client::DrawScreen() {
 		jump_tiles = hpawn->move_tiles();
 	}
 
+	bool danger = show_danger && my_colour < SPECTATE;
+	if(danger) {
+		threats.build(*game_state);
+	}
+
 	for(int z = -2; z <= 2; z++) {
 		for(Tile::List::iterator ti = game_state->tiles.begin(); ti != game_state->tiles.end(); ++ti) {
 			if((*ti)->height != z) {
@@ -944,6 +1113,11 @@ void Client::DrawScreen() {
 				tile_img = (*ti)->smashed ? smashed_jump_candidate_tile : jump_candidate_tile;
 			} else if((fog_of_war && my_colour != SPECTATE) && visible_tiles.find(*ti) == visible_tiles.end()) {
 				tile_img = (*ti)->smashed ? smashed_fow_tile : fow_tile;
+			} else if(danger && threats.enemy_count(ThreatMap::STOMP, *ti, my_colour) + threats.enemy_count(ThreatMap::RANGED, *ti, my_colour) &&
+				  (*ti)->pawn && (*ti)->pawn->colour == my_colour) {
+				tile_img = (*ti)->smashed ? smashed_threatened_tile : threatened_tile;
+			} else if(danger && threats.enemy_count(ThreatMap::ADJACENT, *ti, my_colour) + threats.enemy_count(ThreatMap::RANGED, *ti, my_colour)) {
+				tile_img = (*ti)->smashed ? smashed_danger_tile : danger_tile;
 			} else if(king_of_the_hill && (*ti)->hill) {
 				tile_img = (*ti)->smashed ? smashed_hill_tile : hill_tile;
 			} else if(htile && options.show_lines) {
@@ -1580,3 +1754,65 @@ void Client::draw_direction_menu(pawn_ptr pawn, int power_id)
 		rect.x += width;
 	}
 }
+
+int list_rooms(const std::string &host, uint16_t port)
+{
+	try {
+		boost::asio::io_service io_service;
+		boost::asio::ip::tcp::resolver resolver(io_service);
+		boost::asio::ip::tcp::resolver::query query(host, "");
+		boost::asio::ip::tcp::endpoint server = *resolver.resolve(query);
+		server.port(port);
+
+		boost::asio::ip::tcp::socket socket(io_service);
+		socket.connect(server);
+
+		protocol::message msg;
+		msg.set_msg(protocol::ROOMS);
+		send_buf frame(msg);
+		boost::asio::write(socket, boost::asio::buffer(frame.buf.get(), frame.size));
+
+		// The reply comes in CHUNKs when there are a lot of rooms.
+		ChunkAssembler chunks;
+		for(;;) {
+			uint32_t size;
+			boost::asio::read(socket, boost::asio::buffer(&size, sizeof(size)));
+			size = ntohl(size);
+			if(size > MAX_MSGSIZE) {
+				throw std::runtime_error("Oversized message");
+			}
+
+			std::vector<char> buf(size);
+			boost::asio::read(socket, boost::asio::buffer(buf));
+			if(!msg.ParseFromArray(buf.empty() ? NULL : &buf[0], size)) {
+				throw std::runtime_error("Invalid message recieved");
+			}
+
+			if(msg.msg() == protocol::CHUNK) {
+				protocol::message whole;
+				if(!chunks.add(msg, whole)) {
+					continue;
+				}
+				msg.Swap(&whole);
+			}
+
+			if(msg.msg() == protocol::QUIT) {
+				throw std::runtime_error("Server said: " + msg.quit_msg());
+			}
+			if(msg.msg() == protocol::ROOMS) {
+				break;
+			}
+		}
+
+		for(int i = 0; i < msg.rooms_size(); ++i) {
+			const protocol::room &r = msg.rooms(i);
+			printf("%-32s %-16s %2u players%s\n", r.name().c_str(), r.map_name().c_str(),
+				r.players(), r.in_game() ? ", in game" : "");
+		}
+	} catch(std::exception &e) {
+		std::cerr << "Can't list rooms on " << host << ": " << e.what() << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
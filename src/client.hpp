@@ -10,6 +10,7 @@
 #include <set>
 #include <boost/thread.hpp>
 #include <queue>
+#include <deque>
 
 #include "hexradius.hpp"
 #include "tile_anims.hpp"
@@ -17,6 +18,8 @@
 #include "gui.hpp"
 #include "animator.hpp"
 #include "pawn.hpp"
+#include "threatmap.hpp"
+#include "chunk.hpp"
 
 class GameState;
 
@@ -24,7 +27,8 @@ class Client {
 public:
 	bool quit;	// Game returned due to application quit
 
-	Client(std::string host, uint16_t port);
+	// Joins the named room on the server, or the default one if empty.
+	Client(std::string host, uint16_t port, std::string room = std::string());
 	~Client();
 
 	void run();
@@ -58,6 +62,8 @@ private:
 
 	boost::asio::io_service io_service;
 	boost::asio::ip::tcp::socket socket;
+	boost::asio::ip::tcp::endpoint server;
+	bool connected;
 	SDL_TimerID redraw_timer;
 	boost::thread network_thread;
 	boost::mutex the_mutex;
@@ -65,16 +71,28 @@ private:
 	uint32_t msgsize;
 	std::vector<char> msgbuf;
 
-	std::queue<protocol::message> recv_queue;
-	std::queue<send_buf> send_queue;
+	std::deque<protocol::message> recv_queue;
+	// Handled messages, parsed into again to reuse their memory.
+	std::deque<protocol::message> recv_spare;
+	// Messages too big for one frame arrive in chunks.
+	ChunkAssembler chunks;
+	std::deque<send_buf> send_queue;
+	// Frames at the front of send_queue being written, 0 if idle.
+	size_t write_batch;
 
 	PlayerColour my_colour;
 	uint16_t my_id, turn;
 	player_set players;
 	enum { CONNECTING, LOBBY, GAME } state;
 
+	std::string room_name;
 	std::string map_name;
 
+	// For getting back into the game if the connection drops, see
+	// protocol::message::session.
+	std::string session;
+	uint32_t last_seq;
+
 	int screen_w, screen_h;
 	unsigned int last_redraw;
 	/* Drag origin. */
@@ -87,6 +105,10 @@ private:
 	bool fog_of_war;
 	bool king_of_the_hill;
 
+	// Tint tiles enemies can attack, toggled with 'd'.
+	bool show_danger;
+	ThreatMap threats;
+
 	/* Pawn currently being dragged. */
 	pawn_ptr dpawn;
 	/* Pawn currently selected, for the purpose of power usage. */
@@ -120,8 +142,12 @@ private:
 
 	void net_thread_main();
 	void connect_callback(const boost::system::error_code& error);
+	// Connect again and ask for our place in the game back. Returns false
+	// if not in a game or the server can't be reached.
+	bool reconnect();
 
 	void WriteProto(const protocol::message &msg);
+	void StartWrite();
 	void WriteFinish(const boost::system::error_code& error);
 
 	void ReadSize(void);
@@ -131,6 +157,7 @@ private:
 	void handle_message(const protocol::message &msg);
 	void handle_message_lobby(const protocol::message &msg);
 	void handle_message_game(const protocol::message &msg);
+	void handle_animation(const protocol::animation &anim);
 
 	void DrawScreen(void);
 	void DrawPawn(pawn_ptr pawn, SDL_Rect rect, SDL_Rect base, const std::set<Tile *> &infravision_tiles, const std::set<Tile *> &visible_tiles);
@@ -154,4 +181,7 @@ private:
 	}
 };
 
+// Print the rooms on a server, for --list-rooms. Returns the exit status.
+int list_rooms(const std::string &host, uint16_t port);
+
 #endif /* !CLIENT_HPP */
@@ -0,0 +1,391 @@
+#include <assert.h>
+
+#include "evaluator.hpp"
+#include "gamestate.hpp"
+#include "powers.hpp"
+
+Evaluator::Evaluator() : board_hash(0), layout_hash(0)
+{
+	for(int c = 0; c < SPECTATE; ++c) {
+		score[c] = 0;
+	}
+}
+
+static int popcount(uint32_t x)
+{
+	int n = 0;
+	for(; x; x &= x - 1) {
+		++n;
+	}
+	return n;
+}
+
+void Evaluator::sync(GameState &state)
+{
+	tiles = state.tiles;
+	tile_index.clear();
+	undo_stack.clear();
+
+	std::map<std::pair<int,int>, int> coords;
+	for(size_t i = 0; i < tiles.size(); ++i) {
+		tile_index[tiles[i]] = i;
+		coords[std::make_pair(tiles[i]->col, tiles[i]->row)] = i;
+	}
+
+	// Same order as the tile_*_of functions in GameState:
+	// left, sw, se, right, ne, nw.
+	neighbours.assign(tiles.size() * 6, -1);
+	for(size_t i = 0; i < tiles.size(); ++i) {
+		int col = tiles[i]->col, row = tiles[i]->row;
+		int odd = row % 2;
+		std::pair<int,int> adj[6] = {
+			std::make_pair(col - 1, row),
+			std::make_pair(col - !odd, row + 1),
+			std::make_pair(col + odd, row + 1),
+			std::make_pair(col + 1, row),
+			std::make_pair(col + odd, row - 1),
+			std::make_pair(col - !odd, row - 1),
+		};
+		for(int d = 0; d < 6; ++d) {
+			std::map<std::pair<int,int>, int>::iterator n = coords.find(adj[d]);
+			if(n != coords.end()) {
+				neighbours[i * 6 + d] = n->second;
+			}
+		}
+	}
+
+	cells.resize(tiles.size());
+	contribution none = { 0, -1 };
+	contrib.assign(tiles.size(), none);
+	for(size_t i = 0; i < tiles.size(); ++i) {
+		load_cell(i);
+	}
+	board_hash = hash_from_scratch();
+	layout_hash = hash_layout();
+
+	for(int c = 0; c < SPECTATE; ++c) {
+		score[c] = 0;
+	}
+	for(size_t i = 0; i < tiles.size(); ++i) {
+		rescore(i);
+	}
+}
+
+int Evaluator::index_of(Tile *tile) const
+{
+	std::map<Tile *, int>::const_iterator i = tile_index.find(tile);
+	return i == tile_index.end() ? -1 : i->second;
+}
+
+void Evaluator::tile_changed(Tile *tile)
+{
+	int i = index_of(tile);
+	if(i == -1) {
+		return;
+	}
+
+	// Tile updates from the server invalidate any search in progress.
+	undo_stack.clear();
+
+	board_hash ^= cell_key(i, cells[i]);
+	load_cell(i);
+	board_hash ^= cell_key(i, cells[i]);
+	rescore_around(i);
+}
+
+// splitmix64 finaliser.
+static uint64_t mix64(uint64_t x)
+{
+	x += 0x9E3779B97F4A7C15ULL;
+	x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+	return x ^ (x >> 31);
+}
+
+/* Zobrist style key for a tile in a given state. Rather than a table of
+ * random numbers per tile and state, the tile index and cell are run
+ * through a 64-bit mixer, which gives the same independence.
+*/
+uint64_t Evaluator::cell_key(int i, const cell &c)
+{
+	uint64_t x = (uint64_t)(uint32_t)i << 32 |
+		(uint64_t)(uint8_t)c.height << 24 |
+		(uint64_t)(uint8_t)c.owner << 16 |
+		(uint64_t)(uint8_t)c.mine_colour << 8 |
+		(uint64_t)c.flags;
+
+	return mix64(mix64(x) ^ (uint32_t)c.material);
+}
+
+uint64_t Evaluator::hash_from_scratch() const
+{
+	uint64_t h = 0;
+	for(size_t i = 0; i < cells.size(); ++i) {
+		h ^= cell_key(i, cells[i]);
+	}
+	return h;
+}
+
+uint64_t Evaluator::hash_recoloured(const PlayerColour *colours) const
+{
+	uint64_t h = 0;
+	for(size_t i = 0; i < cells.size(); ++i) {
+		cell c = cells[i];
+		if(c.owner >= 0) c.owner = colours[(int)c.owner];
+		if(c.mine_colour >= 0) c.mine_colour = colours[(int)c.mine_colour];
+		h ^= cell_key(i, c);
+	}
+	return h;
+}
+
+uint64_t Evaluator::hash_layout() const
+{
+	uint64_t h = 0;
+	for(size_t i = 0; i < tiles.size(); ++i) {
+		h ^= mix64((uint64_t)(uint32_t)i << 32 |
+			(uint64_t)(uint16_t)tiles[i]->col << 16 |
+			(uint64_t)(uint16_t)tiles[i]->row);
+	}
+	return mix64(h);
+}
+
+int Evaluator::material_of(pawn_ptr pawn) const
+{
+	const eval_weights &w = options.eval;
+
+	int powers = 0;
+	for(Pawn::PowerList::const_iterator p = pawn->powers.begin(); p != pawn->powers.end(); ++p) {
+		powers += p->second;
+	}
+
+	return w.pawn +
+		w.power * powers +
+		w.range * pawn->range +
+		w.upgrade * popcount(pawn->flags & PWR_GOOD);
+}
+
+void Evaluator::load_cell(int i)
+{
+	Tile *tile = tiles[i];
+	cell &c = cells[i];
+
+	c.height = tile->height;
+	c.owner = -1;
+	c.mine_colour = tile->has_mine ? tile->mine_colour : -1;
+	c.flags = 0;
+	c.material = 0;
+
+	if(tile->has_power) c.flags |= CELL_ORB;
+	if(tile->hill) c.flags |= CELL_HILL;
+	if(tile->smashed || tile->has_black_hole) c.flags |= CELL_HOLE;
+	if(tile->has_mine) c.flags |= CELL_MINE;
+
+	if(tile->pawn && !tile->pawn->destroyed()) {
+		c.owner = tile->pawn->colour;
+		c.material = material_of(tile->pawn);
+		if(tile->pawn->flags & PWR_SHIELD) c.flags |= CELL_SHIELD;
+		if(tile->pawn->flags & PWR_CLIMB) c.flags |= CELL_CLIMB;
+	}
+}
+
+int Evaluator::score_cell(int i) const
+{
+	const eval_weights &w = options.eval;
+	const cell &c = cells[i];
+
+	if(c.owner < 0) {
+		return 0;
+	}
+
+	int s = c.material + w.height * c.height;
+
+	if(c.flags & CELL_HILL) {
+		s += w.hill;
+	}
+
+	for(int d = 0; d < 6; ++d) {
+		int n = neighbours[i * 6 + d];
+		if(n == -1) {
+			continue;
+		}
+
+		const cell &nc = cells[n];
+
+		if(nc.flags & CELL_ORB) {
+			s += w.orb;
+		}
+
+		// An adjacent enemy that can climb onto this tile threatens a stomp.
+		if(nc.owner >= 0 && nc.owner != c.owner && !(c.flags & CELL_SHIELD) &&
+		   (c.height <= nc.height + 1 || (nc.flags & CELL_CLIMB))) {
+			s -= w.threat;
+		}
+	}
+
+	return s;
+}
+
+void Evaluator::rescore(int i)
+{
+	contribution &c = contrib[i];
+
+	if(c.colour >= 0) {
+		score[c.colour] -= c.value;
+	}
+
+	c.value = score_cell(i);
+	c.colour = cells[i].owner;
+
+	if(c.colour >= 0) {
+		score[c.colour] += c.value;
+	}
+}
+
+void Evaluator::rescore_around(int i)
+{
+	rescore(i);
+	for(int d = 0; d < 6; ++d) {
+		int n = neighbours[i * 6 + d];
+		if(n != -1) {
+			rescore(n);
+		}
+	}
+}
+
+static int relative_score(const int *score, PlayerColour colour)
+{
+	// Compare against the strongest opponent.
+	bool have_other = false;
+	int best_other = 0;
+	for(int c = 0; c < SPECTATE; ++c) {
+		if(c == colour) continue;
+		if(!have_other || score[c] > best_other) {
+			best_other = score[c];
+			have_other = true;
+		}
+	}
+
+	return score[colour] - best_other;
+}
+
+int Evaluator::evaluate(PlayerColour colour) const
+{
+	assert(colour < SPECTATE);
+	return relative_score(score, colour);
+}
+
+int Evaluator::evaluate_from_scratch(PlayerColour colour) const
+{
+	assert(colour < SPECTATE);
+
+	int totals[SPECTATE] = { 0 };
+	for(size_t i = 0; i < cells.size(); ++i) {
+		if(cells[i].owner >= 0) {
+			totals[(int)cells[i].owner] += score_cell(i);
+		}
+	}
+
+	return relative_score(totals, colour);
+}
+
+int Evaluator::pawn_count() const
+{
+	int n = 0;
+	for(size_t i = 0; i < cells.size(); ++i) {
+		if(cells[i].owner >= 0) {
+			++n;
+		}
+	}
+	return n;
+}
+
+void Evaluator::moves(PlayerColour colour, std::vector<move> &out) const
+{
+	for(size_t i = 0; i < cells.size(); ++i) {
+		const cell &c = cells[i];
+		if(c.owner != colour) {
+			continue;
+		}
+
+		for(int d = 0; d < 6; ++d) {
+			int n = neighbours[i * 6 + d];
+			if(n == -1) {
+				continue;
+			}
+
+			const cell &nc = cells[n];
+
+			if(nc.flags & CELL_HOLE) continue;
+			if(nc.height > c.height + 1 && !(c.flags & CELL_CLIMB)) continue;
+			if(nc.owner == colour) continue;
+			if(nc.owner >= 0 && (nc.flags & CELL_SHIELD)) continue;
+
+			out.push_back(move(i, n));
+		}
+	}
+}
+
+void Evaluator::make_move(const move &m)
+{
+	const eval_weights &w = options.eval;
+	const uint8_t pawn_flags = CELL_SHIELD | CELL_CLIMB;
+
+	undo_entry u = { m.from, m.to, cells[m.from], cells[m.to], board_hash };
+	undo_stack.push_back(u);
+
+	cell &from = cells[m.from];
+	cell &to = cells[m.to];
+	cell pawn = from;
+
+	board_hash ^= cell_key(m.from, from) ^ cell_key(m.to, to);
+
+	from.owner = -1;
+	from.material = 0;
+	from.flags &= ~pawn_flags;
+
+	// Anything already on the target tile gets stomped.
+	to.owner = pawn.owner;
+	to.material = pawn.material;
+	to.flags = (to.flags & ~pawn_flags) | (pawn.flags & pawn_flags);
+
+	if(to.flags & CELL_ORB) {
+		to.flags &= ~CELL_ORB;
+		to.material += w.power;
+	}
+
+	if((to.flags & CELL_HOLE) && !(to.flags & CELL_CLIMB)) {
+		to.owner = -1;
+		to.material = 0;
+		to.flags &= ~pawn_flags;
+	}else if((to.flags & CELL_MINE) && to.mine_colour != to.owner && !(to.flags & CELL_CLIMB)) {
+		to.flags &= ~CELL_MINE;
+		if(to.flags & CELL_SHIELD) {
+			to.flags &= ~CELL_SHIELD;
+			to.material -= w.upgrade;
+		}else{
+			to.owner = -1;
+			to.material = 0;
+			to.flags &= ~pawn_flags;
+		}
+	}
+
+	board_hash ^= cell_key(m.from, from) ^ cell_key(m.to, to);
+
+	rescore_around(m.from);
+	rescore_around(m.to);
+}
+
+void Evaluator::undo_move()
+{
+	assert(!undo_stack.empty());
+
+	undo_entry u = undo_stack.back();
+	undo_stack.pop_back();
+
+	cells[u.from] = u.old_from;
+	cells[u.to] = u.old_to;
+	board_hash = u.old_hash;
+
+	rescore_around(u.from);
+	rescore_around(u.to);
+}
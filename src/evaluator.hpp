@@ -0,0 +1,122 @@
+#ifndef EVALUATOR_HPP
+#define EVALUATOR_HPP
+
+#include <vector>
+#include <map>
+#include <stdint.h>
+
+#include "hexradius.hpp"
+#include "tile.hpp"
+
+class GameState;
+
+/* Board evaluation for the AI.
+ *
+ * The evaluator keeps a compact copy of the board and a per-tile score
+ * contribution for the pawn standing on each tile. A tile's contribution
+ * only depends on the tile itself and its six neighbours, so a change to
+ * one tile only requires the tile and its neighbours to be rescored.
+ *
+ * The server calls tile_changed() from the same places that send tile and
+ * pawn updates to clients, the AI uses make_move()/undo_move() to look at
+ * positions without touching the real game state.
+*/
+class Evaluator {
+public:
+	struct move {
+		int from, to;
+
+		move(int f, int t) : from(f), to(t) {}
+	};
+
+	Evaluator();
+
+	// Rebuild everything from the game state.
+	void sync(GameState &state);
+	// Re-read a single tile from the game state.
+	void tile_changed(Tile *tile);
+
+	// Index of a tile, or -1 if the tile is unknown.
+	int index_of(Tile *tile) const;
+	Tile *tile_of(int index) const { return tiles[index]; }
+
+	// Hash of the compact board, kept up to date by every change.
+	uint64_t hash() const { return board_hash; }
+	// Same as hash(), but computed from scratch.
+	uint64_t hash_from_scratch() const;
+	// Hash of the board with every colour c replaced by colours[c].
+	uint64_t hash_recoloured(const PlayerColour *colours) const;
+	// Hash of where the tiles are, which hash() doesn't cover.
+	uint64_t layout() const { return layout_hash; }
+
+	// Score of the board from colour's point of view.
+	int evaluate(PlayerColour colour) const;
+	// Same as evaluate(), but rescores every tile. Used to check the
+	// incremental scores and as a benchmark baseline.
+	int evaluate_from_scratch(PlayerColour colour) const;
+
+	// Number of pawns on the compact board.
+	int pawn_count() const;
+
+	// Simple moves (one step to an adjacent tile) available to a colour.
+	void moves(PlayerColour colour, std::vector<move> &out) const;
+
+	// Apply a simple move to the compact board only.
+	void make_move(const move &m);
+	void undo_move();
+
+private:
+	enum {
+		CELL_ORB    = 1<<0,
+		CELL_HILL   = 1<<1,
+		CELL_HOLE   = 1<<2, // Smashed tile or black hole.
+		CELL_MINE   = 1<<3,
+		CELL_SHIELD = 1<<4, // The pawn on this tile is shielded.
+		CELL_CLIMB  = 1<<5, // The pawn on this tile is hovering.
+	};
+
+	struct cell {
+		int8_t height;
+		int8_t owner; // Pawn colour, or -1 if there is no pawn.
+		int8_t mine_colour;
+		uint8_t flags;
+		int material;
+	};
+
+	struct undo_entry {
+		int from, to;
+		cell old_from, old_to;
+		uint64_t old_hash;
+	};
+
+	std::vector<Tile *> tiles;
+	std::map<Tile *, int> tile_index;
+
+	std::vector<int> neighbours; // 6 per tile, -1 if off the board.
+	std::vector<cell> cells;
+
+	// Score each tile currently adds to the total of the colour that
+	// owned it when it was last scored.
+	struct contribution {
+		int value;
+		int colour;
+	};
+	std::vector<contribution> contrib;
+	int score[SPECTATE];
+
+	// XOR of cell_key() over every tile.
+	uint64_t board_hash;
+	uint64_t layout_hash;
+
+	std::vector<undo_entry> undo_stack;
+
+	static uint64_t cell_key(int i, const cell &c);
+	uint64_t hash_layout() const;
+	void load_cell(int i);
+	int material_of(pawn_ptr pawn) const;
+	int score_cell(int i) const;
+	void rescore(int i);
+	void rescore_around(int i);
+};
+
+#endif /* !EVALUATOR_HPP */
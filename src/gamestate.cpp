@@ -111,9 +111,12 @@ Tile::List GameState::radial_tiles(Tile *t, int range)
 
 		for(std::set< std::pair<int,int> >::iterator ci = coords.begin(); ci != coords.end(); ++ci)
 		{
-			int c_min   = ci->first  - 1 + (ci->second % 2) * 1;
-			int c_max   = ci->first  + (ci->second % 2) * 1;
-			int c_extra = ci->first  + (ci->second % 2 ? -1 : 1);
+			// Coordinates above the board have negative rows, where % would
+			// give the wrong parity.
+			int odd     = ci->second & 1;
+			int c_min   = ci->first  - 1 + odd;
+			int c_max   = ci->first  + odd;
+			int c_extra = ci->first  + (odd ? -1 : 1);
 			int r_min   = ci->second - 1;
 			int r_max   = ci->second + 1;
 
@@ -221,6 +224,51 @@ Tile::List GameState::linear_tiles(Tile *t, int range) {
 	return result;
 }
 
+bool GameState::power_area(pawn_ptr pawn, unsigned int direction, Tile::List &area) {
+	switch(direction) {
+	case Powers::Power::undirected:
+		area.clear();
+		break;
+	case Powers::Power::east_west:
+		area = pawn->RowTiles();
+		break;
+	case Powers::Power::northeast_southwest:
+		area = pawn->fs_tiles();
+		break;
+	case Powers::Power::northwest_southeast:
+		area = pawn->bs_tiles();
+		break;
+	case Powers::Power::radial:
+		area = pawn->RadialTiles();
+		break;
+	case Powers::Power::east:
+		area = Tile::List(1, tile_right_of(pawn->cur_tile));
+		break;
+	case Powers::Power::west:
+		area = Tile::List(1, tile_left_of(pawn->cur_tile));
+		break;
+	case Powers::Power::northeast:
+		area = Tile::List(1, tile_ne_of(pawn->cur_tile));
+		break;
+	case Powers::Power::southwest:
+		area = Tile::List(1, tile_sw_of(pawn->cur_tile));
+		break;
+	case Powers::Power::northwest:
+		area = Tile::List(1, tile_nw_of(pawn->cur_tile));
+		break;
+	case Powers::Power::southeast:
+		area = Tile::List(1, tile_se_of(pawn->cur_tile));
+		break;
+	case Powers::Power::point:
+		area = Tile::List(1, pawn->cur_tile);
+		break;
+	default:
+		return false;
+	}
+
+	return true;
+}
+
 pawn_ptr GameState::pawn_at(int column, int row)
 {
 	Tile *tile = tile_at(column, row);
@@ -320,9 +368,162 @@ void GameState::serialize(protocol::message &msg) const {
 	}
 }
 
+// Tile bits in packed_board.features.
+enum {
+	PACKED_POWER       = 1<<0,
+	PACKED_SMASHED     = 1<<1,
+	PACKED_MINE        = 1<<2,
+	PACKED_LANDING_PAD = 1<<3,
+	PACKED_BLACK_HOLE  = 1<<4,
+	PACKED_EYE         = 1<<5,
+	PACKED_HILL        = 1<<6,
+};
+
+/* Tiles are written in order, each with its position as a delta from the
+ * previous tile's, which is one or two bytes on row by row maps. Colours
+ * of mines, landing pads and eyes share a word per tile, 4 bits each.
+ * Arrays that would be all zeros are left empty.
+*/
+void GameState::serialize_packed(protocol::message &msg) const {
+	protocol::packed_board *b = msg.mutable_board();
+	b->set_version(PACKED_BOARD_VERSION);
+
+	bool colours = false, black_holes = false, wraps = false;
+	for(Tile::List::const_iterator t = tiles.begin(); t != tiles.end(); t++) {
+		colours |= (*t)->has_mine || (*t)->has_landing_pad || (*t)->has_eye;
+		black_holes |= (*t)->has_black_hole;
+		wraps |= (*t)->wrap != 0;
+	}
+
+	int col = 0, row = 0;
+	for(Tile::List::const_iterator t = tiles.begin(); t != tiles.end(); t++) {
+		const Tile *tile = *t;
+
+		b->add_col_deltas(tile->col - col);
+		b->add_row_deltas(tile->row - row);
+		col = tile->col;
+		row = tile->row;
+
+		b->add_heights(tile->height);
+		b->add_features(
+			(tile->has_power ? PACKED_POWER : 0) |
+			(tile->smashed ? PACKED_SMASHED : 0) |
+			(tile->has_mine ? PACKED_MINE : 0) |
+			(tile->has_landing_pad ? PACKED_LANDING_PAD : 0) |
+			(tile->has_black_hole ? PACKED_BLACK_HOLE : 0) |
+			(tile->has_eye ? PACKED_EYE : 0) |
+			(tile->hill ? PACKED_HILL : 0));
+
+		if(colours) {
+			b->add_colours(
+				(tile->has_mine ? tile->mine_colour : 0) |
+				(tile->has_landing_pad ? tile->landing_pad_colour : 0) << 4 |
+				(tile->has_eye ? tile->eye_colour : 0) << 8);
+		}
+		if(black_holes) {
+			b->add_black_hole_powers(tile->has_black_hole ? tile->black_hole_power : 0);
+		}
+		if(wraps) {
+			b->add_wraps(tile->wrap);
+		}
+
+		if(tile->pawn) {
+			const pawn_ptr &pawn = tile->pawn;
+			b->add_pawn_tiles(t - tiles.begin());
+			b->add_pawn_colours(pawn->colour);
+			b->add_pawn_ranges(pawn->range);
+			b->add_pawn_flags(pawn->flags);
+			b->add_pawn_power_counts(pawn->powers.size());
+			for(Pawn::PowerList::const_iterator p = pawn->powers.begin(); p != pawn->powers.end(); ++p) {
+				b->add_powers(p->first);
+				b->add_powers(p->second);
+			}
+		}
+	}
+}
+
+void GameState::deserialize_packed(const protocol::packed_board &b) {
+	if(b.version() != PACKED_BOARD_VERSION) {
+		throw std::runtime_error("Unsupported packed board version");
+	}
+
+	int n = b.col_deltas_size();
+	if(b.row_deltas_size() != n || b.heights_size() != n || b.features_size() != n ||
+	   (b.colours_size() && b.colours_size() != n) ||
+	   (b.black_hole_powers_size() && b.black_hole_powers_size() != n) ||
+	   (b.wraps_size() && b.wraps_size() != n)) {
+		throw std::runtime_error("Packed board arrays differ in length");
+	}
+
+	int pawns = b.pawn_tiles_size();
+	if(b.pawn_colours_size() != pawns || b.pawn_ranges_size() != pawns ||
+	   b.pawn_flags_size() != pawns || b.pawn_power_counts_size() != pawns) {
+		throw std::runtime_error("Packed board pawn arrays differ in length");
+	}
+
+	int col = 0, row = 0;
+	for(int i = 0; i < n; i++) {
+		col += b.col_deltas(i);
+		row += b.row_deltas(i);
+
+		Tile *tile = new Tile(col, row, b.heights(i));
+		tiles.push_back(tile);
+
+		uint32_t f = b.features(i);
+		tile->has_power = f & PACKED_POWER;
+		tile->smashed = f & PACKED_SMASHED;
+		tile->has_mine = f & PACKED_MINE;
+		tile->has_landing_pad = f & PACKED_LANDING_PAD;
+		tile->has_black_hole = f & PACKED_BLACK_HOLE;
+		tile->has_eye = f & PACKED_EYE;
+		tile->hill = f & PACKED_HILL;
+
+		if(b.colours_size()) {
+			tile->mine_colour = PlayerColour(b.colours(i) & 0xF);
+			tile->landing_pad_colour = PlayerColour((b.colours(i) >> 4) & 0xF);
+			tile->eye_colour = PlayerColour((b.colours(i) >> 8) & 0xF);
+		}
+		if(b.black_hole_powers_size()) {
+			tile->black_hole_power = b.black_hole_powers(i);
+		}
+		if(b.wraps_size()) {
+			tile->wrap = b.wraps(i);
+		}
+	}
+
+	int power = 0;
+	for(int i = 0; i < pawns; i++) {
+		PlayerColour c = (PlayerColour)b.pawn_colours(i);
+		if(b.pawn_tiles(i) >= (uint32_t)n || c < BLUE || c > ORANGE) {
+			throw std::runtime_error("Bad pawn in packed board");
+		}
+
+		Tile *tile = tiles[b.pawn_tiles(i)];
+		if(tile->pawn) {
+			throw std::runtime_error("Multiple pawns on a tile in packed board");
+		}
+
+		tile->pawn = pawn_ptr(new Pawn(c, this, tile));
+		tile->pawn->range = b.pawn_ranges(i);
+		tile->pawn->flags = b.pawn_flags(i);
+
+		for(uint32_t p = 0; p < b.pawn_power_counts(i); p++, power += 2) {
+			if(power + 1 >= b.powers_size()) {
+				throw std::runtime_error("Packed board power list too short");
+			}
+			tile->pawn->powers.insert(std::make_pair(b.powers(power), b.powers(power + 1)));
+		}
+	}
+}
+
 void GameState::deserialize(const protocol::message &msg) {
 	tiles.clear();
 
+	if(msg.has_board()) {
+		deserialize_packed(msg.board());
+		return;
+	}
+
 	for(int i = 0; i < msg.tiles_size(); i++) {
 		Tile *tile = new Tile(msg.tiles(i).col(), msg.tiles(i).row(), msg.tiles(i).height());
 		tiles.push_back(tile);
@@ -351,6 +552,8 @@ void GameState::deserialize(const protocol::message &msg) {
 		}
 
 		tile->pawn = pawn_ptr(new Pawn(c, this, tile));
+		if(msg.pawns(i).has_range()) tile->pawn->range = msg.pawns(i).range();
+		if(msg.pawns(i).has_flags()) tile->pawn->flags = msg.pawns(i).flags();
 	}
 }
 
@@ -395,6 +598,30 @@ void GameState::load_file(const std::string &filename) {
 	deserialize(msg);
 }
 
+void GameState::copy(const GameState &from) {
+	for(Tile::List::iterator i = tiles.begin(); i != tiles.end(); ++i) {
+		delete *i;
+	}
+	tiles.clear();
+	tiles.reserve(from.tiles.size());
+
+	for(Tile::List::const_iterator t = from.tiles.begin(); t != from.tiles.end(); ++t) {
+		Tile *tile = new Tile(**t);
+		tiles.push_back(tile);
+
+		tile->render_pawn.reset();
+		if(!(*t)->pawn) {
+			continue;
+		}
+
+		const Pawn &p = *(*t)->pawn;
+		tile->pawn = pawn_ptr(new Pawn(p.colour, this, tile));
+		tile->pawn->range = p.range;
+		tile->pawn->flags = p.flags;
+		tile->pawn->powers = p.powers;
+	}
+}
+
 void GameState::save_file(const std::string &filename) const
 {
 	FILE *fh = fopen(filename.c_str(), "wb");
@@ -410,7 +637,7 @@ void GameState::save_file(const std::string &filename) const
 
 	protocol::message msg;
 	msg.set_msg(protocol::MAP_DEFINITION);
-	serialize(msg);
+	serialize_packed(msg);
 	std::string pb;
 	msg.SerializeToString(&pb);
 
@@ -435,110 +662,109 @@ void GameState::save_file(const std::string &filename) const
 	}
 }
 
-ServerGameState::ServerGameState(Server &server) : server(server) {}
+ServerGameState::ServerGameState(Room &room) : seed(0), room(room) {}
+
+uint32_t ServerGameState::tile_index(Tile *tile) const {
+	int i = evaluator.index_of(tile);
+	assert(i != -1);
+	return i;
+}
 
 void ServerGameState::add_animator(TileAnimators::Animator *ani) {
-	protocol::message msg = ani->serialize();
+	protocol::message *msg = room.new_message(protocol::ANIMATION);
+	ani->serialize(*msg->mutable_animation(), *this);
 	delete ani;
-	server.WriteAll(msg);
+	room.WriteAll(*msg);
 }
 
-void ServerGameState::add_animator(const char *name, Tile *tile) {
-	protocol::message msg;
-	msg.set_msg(protocol::PARTICLE_ANIMATION);
-	msg.set_animation_name(name);
-	protocol::key_value *tile_col = msg.add_misc();
-	tile_col->set_key("tile-col");
-	tile_col->set_int_value(tile->col);
-	protocol::key_value *tile_row = msg.add_misc();
-	tile_row->set_key("tile-row");
-	tile_row->set_int_value(tile->row);
-	server.WriteAll(msg);
+void ServerGameState::add_animator(protocol::animation_type type, Tile *tile) {
+	protocol::message *msg = room.new_message(protocol::ANIMATION);
+	protocol::animation *a = msg->mutable_animation();
+	a->set_type(type);
+	a->set_tile(tile_index(tile));
+	room.WriteAll(*msg);
 }
 
 void ServerGameState::teleport_hack(pawn_ptr pawn)
 {
-	Tile::List targets = RandomTiles(tiles, 1, false, false, false, false);
+	Tile::List targets = RandomTiles(rng, tiles, 1, false, false, false, false);
 	assert(!targets.empty());
 	Tile *target = *targets.begin();
 
 	// Play the teleport animation, then move the pawn.
 	{
-		protocol::message msg;
-		msg.set_msg(protocol::PAWN_ANIMATION);
-		msg.add_pawns();
-		msg.mutable_pawns(0)->set_col(pawn->cur_tile->col);
-		msg.mutable_pawns(0)->set_row(pawn->cur_tile->row);
-		msg.mutable_pawns(0)->set_new_col(target->col);
-		msg.mutable_pawns(0)->set_new_row(target->row);
-		msg.set_animation_name("teleport");
-		server.WriteAll(msg);
+		protocol::message *msg = room.new_message(protocol::ANIMATION);
+		protocol::animation *a = msg->mutable_animation();
+		a->set_type(protocol::TELEPORT);
+		a->set_tile(tile_index(pawn->cur_tile));
+		a->set_target(tile_index(target));
+		room.WriteAll(*msg);
 	}
 
 	move_pawn_to(pawn, target);
 }
 
 void ServerGameState::add_power_notification(pawn_ptr pawn, int power) {
-	for(Server::client_set::iterator i = server.clients.begin(); i != server.clients.end(); i++) {
-		boost::shared_ptr<Server::base_client> client = *i;
+	for(Room::client_set::iterator i = room.clients.begin(); i != room.clients.end(); i++) {
+		boost::shared_ptr<Room::base_client> client = *i;
 		if(client->colour == NOINIT) continue;
-		protocol::message msg;
-		msg.set_msg(protocol::ADD_POWER_NOTIFICATION);
-		msg.add_pawns();
-		msg.mutable_pawns(0)->set_col(pawn->cur_tile->col);
-		msg.mutable_pawns(0)->set_row(pawn->cur_tile->row);
+		protocol::message *msg = room.new_message(protocol::ADD_POWER_NOTIFICATION);
+		protocol::pawn *p = msg->add_pawns();
+		p->set_col(pawn->cur_tile->col);
+		p->set_row(pawn->cur_tile->row);
 		if(client->colour == SPECTATE || client->colour == pawn->colour) {
-			msg.mutable_pawns(0)->set_use_power(power);
+			p->set_use_power(power);
 		}
-		client->Write(msg);
+		client->Write(*msg);
 	}
 }
 
 void ServerGameState::use_power_notification(pawn_ptr pawn, int power, unsigned int direction) {
-	for(Server::client_set::iterator i = server.clients.begin(); i != server.clients.end(); i++) {
-		boost::shared_ptr<Server::base_client> client = *i;
+	for(Room::client_set::iterator i = room.clients.begin(); i != room.clients.end(); i++) {
+		boost::shared_ptr<Room::base_client> client = *i;
 		if(client->colour == NOINIT) continue;
-		protocol::message msg;
-		msg.set_msg(protocol::USE_POWER_NOTIFICATION);
-		msg.add_pawns();
-		msg.mutable_pawns(0)->set_col(pawn->cur_tile->col);
-		msg.mutable_pawns(0)->set_row(pawn->cur_tile->row);
-		msg.mutable_pawns(0)->set_use_power(power);
-		msg.set_power_direction(direction);
-		client->Write(msg);
+		protocol::message *msg = room.new_message(protocol::USE_POWER_NOTIFICATION);
+		protocol::pawn *p = msg->add_pawns();
+		p->set_col(pawn->cur_tile->col);
+		p->set_row(pawn->cur_tile->row);
+		p->set_use_power(power);
+		msg->set_power_direction(direction);
+		client->Write(*msg);
 	}
 }
 
 void ServerGameState::grant_upgrade(pawn_ptr pawn, uint32_t upgrade) {
 	assert((pawn->flags & upgrade) == 0);
 	pawn->flags |= upgrade;
-	server.update_one_pawn(pawn);
+	room.update_one_pawn(pawn);
 }
 
 void ServerGameState::set_tile_height(Tile *tile, int height) {
 	tile->SetHeight(height);
-	server.update_one_tile(tile);
+	room.update_one_tile(tile);
 }
 
 void ServerGameState::destroy_pawn(pawn_ptr target, Pawn::destroy_type reason, pawn_ptr)
 {
-	protocol::message msg;
-	msg.set_msg(protocol::DESTROY);
-	msg.add_pawns();
-	msg.mutable_pawns(0)->set_col(target->cur_tile->col);
-	msg.mutable_pawns(0)->set_row(target->cur_tile->row);
-	server.WriteAll(msg);
+	protocol::message *msg = room.new_message(protocol::DESTROY);
+	protocol::pawn *p = msg->add_pawns();
+	p->set_col(target->cur_tile->col);
+	p->set_row(target->cur_tile->row);
+	room.WriteAll(*msg);
+
+	Tile *tile = target->cur_tile;
 	target->destroy(reason);
+	evaluator.tile_changed(tile);
 }
 
 void ServerGameState::update_pawn(pawn_ptr pawn)
 {
-	server.update_one_pawn(pawn);
+	room.update_one_pawn(pawn);
 }
 
 void ServerGameState::update_tile(Tile *tile)
 {
-	server.update_one_tile(tile);
+	room.update_one_tile(tile);
 }
 
 void ServerGameState::move_pawn_to(pawn_ptr pawn, Tile *target)
@@ -551,62 +777,55 @@ void ServerGameState::move_pawn_to(pawn_ptr pawn, Tile *target)
 				Tile::List adjacent = target->pawn->RadialTiles();
 				for(Tile::List::iterator t = adjacent.begin(); t != adjacent.end(); t++) {
 					if((*t)->pawn) {
-						(*t)->pawn->destroy(Pawn::PWR_DESTROY);
+						destroy_pawn((*t)->pawn, Pawn::PWR_DESTROY, pawn);
 					}
 				}
 				return;
 			}
 			
-			add_animator("crush", target);
+			add_animator(protocol::CRUSH, target);
 			destroy_pawn(target->pawn, Pawn::STOMP, pawn);
 		}
 
 		// Notify clients of the move.
-		protocol::message msg;
-		msg.set_msg(protocol::FORCE_MOVE);
-		msg.add_pawns();
-		msg.mutable_pawns(0)->set_col(pawn->cur_tile->col);
-		msg.mutable_pawns(0)->set_row(pawn->cur_tile->row);
-		msg.mutable_pawns(0)->set_new_col(target->col);
-		msg.mutable_pawns(0)->set_new_row(target->row);
-		server.WriteAll(msg);
+		protocol::message *msg = room.new_message(protocol::FORCE_MOVE);
+		protocol::pawn *p = msg->add_pawns();
+		p->set_col(pawn->cur_tile->col);
+		p->set_row(pawn->cur_tile->row);
+		p->set_new_col(target->col);
+		p->set_new_row(target->row);
+		room.WriteAll(*msg);
 	}
 
 	bool hp = target->has_power;
+	Tile *source = pawn->cur_tile;
 
 	// Move the pawn on our end. This also performs various
 	// tile-related effects.
 	pawn->force_move(target, this);
 
+	evaluator.tile_changed(source);
+	evaluator.tile_changed(target);
+
 	if(hp) {
-		server.update_one_tile(target);
+		room.update_one_tile(target);
 		if(!pawn->destroyed()) {
-			server.update_one_pawn(pawn);
+			room.update_one_pawn(pawn);
 		}
 	}
 }
 
 void ServerGameState::run_worm_stuff(pawn_ptr pawn, int range)
 {
-	server.worm_pawn = pawn;
-	server.worm_tile = pawn->cur_tile;
-	server.worm_range = range;
-
-	server.doing_worm_stuff = true;
-	server.worm_timer.expires_from_now(boost::posix_time::milliseconds(0));
-	server.worm_timer.async_wait(boost::bind(&Server::worm_tick, &server, boost::asio::placeholders::error));
+	room.run_worm(pawn, range);
 }
 
 void ServerGameState::play_prod_animation(pawn_ptr pawn, pawn_ptr target)
 {
-	protocol::message msg;
-	msg.set_msg(protocol::PAWN_ANIMATION);
-	msg.add_pawns();
-	msg.mutable_pawns(0)->set_col(pawn->cur_tile->col);
-	msg.mutable_pawns(0)->set_row(pawn->cur_tile->row);
-	msg.add_pawns();
-	msg.mutable_pawns(1)->set_col(target->cur_tile->col);
-	msg.mutable_pawns(1)->set_row(target->cur_tile->row);
-	msg.set_animation_name("prod");
-	server.WriteAll(msg);
+	protocol::message *msg = room.new_message(protocol::ANIMATION);
+	protocol::animation *a = msg->mutable_animation();
+	a->set_type(protocol::PROD);
+	a->set_tile(tile_index(pawn->cur_tile));
+	a->set_target(tile_index(target->cur_tile));
+	room.WriteAll(*msg);
 }
@@ -6,6 +6,12 @@
 #include "hexradius.hpp"
 #include "tile.hpp"
 #include "pawn.hpp"
+#include "evaluator.hpp"
+#include "actions.hpp"
+#include "threatmap.hpp"
+
+// Version of protocol::packed_board written by serialize_packed.
+const uint32_t PACKED_BOARD_VERSION = 1;
 
 namespace TileAnimators { class Animator; }
 namespace Animators { class Generic; }
@@ -49,6 +55,10 @@ public:
 	Tile::List fs_tiles(Tile *t, int range);
 	Tile::List linear_tiles(Tile *t, int range);
 
+	// Tiles affected by a pawn using a power in the given direction.
+	// Returns false for targeted or unknown directions.
+	bool power_area(pawn_ptr pawn, unsigned int direction, Tile::List &area);
+
 	/** Return the pawn at given board column & row,
 	 * or null if there is no pawn at that location. */
 	pawn_ptr pawn_at(int column, int row);
@@ -70,21 +80,30 @@ public:
 	// to client colours.
 	void recolour(const std::map<PlayerColour, PlayerColour> &colours);
 
-	// Serialize to protobuf message.
+	// Serialize to protobuf message, one protocol::tile per tile.
 	void serialize(protocol::message &msg) const;
-	// Deserialize from protobuf message.
+	// Serialize to msg.board, much smaller and faster to parse.
+	void serialize_packed(protocol::message &msg) const;
+	// Deserialize from protobuf message, in either form.
 	void deserialize(const protocol::message &msg);
 
 	// Save to a file.
 	void save_file(const std::string &filename) const;
 	// Load state from a file.
 	void load_file(const std::string &filename);
+	// Replace the board with a copy of another.
+	void copy(const GameState &from);
+
+private:
+	void deserialize_packed(const protocol::packed_board &board);
 };
 
 class ServerGameState : public GameState {
 public:
-	ServerGameState(Server &server);
-	void add_animator(const char *name, Tile *tile);
+	ServerGameState(Room &room);
+	// Index of a tile in tiles, as used by animation messages.
+	uint32_t tile_index(Tile *tile) const;
+	void add_animator(protocol::animation_type type, Tile *tile);
 	void add_animator(TileAnimators::Animator *animator);
 	void teleport_hack(pawn_ptr pawn);
 	void grant_upgrade(pawn_ptr pawn, uint32_t upgrade);
@@ -99,8 +118,20 @@ public:
 	void run_worm_stuff(pawn_ptr pawn, int range);
 	// Pawn got proded.
 	void play_prod_animation(pawn_ptr pawn, pawn_ptr target);
+
+	// AI board evaluation, kept up to date as the state changes.
+	Evaluator evaluator;
+	// Power use candidates for the AI.
+	ActionEnumerator actions;
+	// Attacks on each tile, rebuilt each AI turn.
+	ThreatMap threats;
+
+	// Every random choice the rules make comes from rng, seeded with seed
+	// when the game starts.
+	uint32_t seed;
+	game_rng rng;
 private:
-	Server &server;
+	Room &room;
 };
 
 #endif
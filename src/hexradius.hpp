@@ -17,10 +17,17 @@
 #include <boost/shared_ptr.hpp>
 #include <boost/enable_shared_from_this.hpp>
 #include <boost/utility.hpp>
+#include <boost/random/mersenne_twister.hpp>
 
 #include "hexradius.pb.h"
 
 const unsigned int MAX_MSGSIZE = 8192;
+// Room left in a frame for what send_buf adds to a message (its seq).
+const unsigned int FRAME_HEADROOM = 16;
+// Messages that don't fit in a frame are split into CHUNK messages with
+// this much data each, up to MAX_CHUNKED_SIZE in total.
+const unsigned int CHUNK_SIZE = MAX_MSGSIZE - 64;
+const unsigned int MAX_CHUNKED_SIZE = 4 * 1024 * 1024;
 const uint16_t DEFAULT_PORT = 9012;
 
 const int BOARD_OFFSET = 10;
@@ -29,6 +36,9 @@ const unsigned int TORUS_FRAMES = 11;
 const unsigned int FRAME_RATE = 30;
 const unsigned int FRAME_DELAY = 1000 / FRAME_RATE;
 
+// Milliseconds between the steps of a worm animation.
+const unsigned int WORM_INTERVAL = 250;
+
 const unsigned int TILE_WIDTH = 50;
 const unsigned int TILE_HEIGHT = 51;
 const unsigned int TILE_WOFF = 50;
@@ -39,6 +49,30 @@ const unsigned int RESIGN_BUTTON_WIDTH = 64;
 const unsigned int RESIGN_BUTTON_HEIGHT = 16;
 
 const uint16_t ADMIN_ID = 0;
+// Id given to anyone watching a room from outside it.
+const uint16_t WATCHER_ID = 0xFFFF;
+
+// Most queued frames handed to a single async_write, and most bytes
+// (unless a single frame is bigger).
+const unsigned int MAX_WRITE_FRAMES = 64;
+const unsigned int MAX_WRITE_BYTES = 65536;
+
+// Times the client tries to get back into a game after losing the
+// connection, a second apart.
+const unsigned int RECONNECT_TRIES = 10;
+
+// Most rooms one server hosts at once.
+const unsigned int MAX_ROOMS = 1000;
+// Longest room name, so a list of every room stays a sensible size.
+const unsigned int MAX_ROOM_NAME = 32;
+
+// Initial block of the arena outbound messages are built on, big enough
+// for most actions not to allocate at all.
+const unsigned int ARENA_BLOCK_SIZE = 32768;
+
+// Random numbers for the rules of one game, seeded per game so that a
+// replay can repeat them. See ServerGameState::rng.
+typedef boost::random::mt19937 game_rng;
 
 extern const char *team_names[];
 extern const SDL_Colour team_colours[];
@@ -53,16 +87,56 @@ enum PlayerColour { BLUE, RED, GREEN, YELLOW, PURPLE, ORANGE, SPECTATE, NOINIT }
 
 class Pawn;
 class Server;
+class Room;
 class Client;
 class GameState;
 class ServerGameState;
 
 typedef boost::shared_ptr<Pawn> pawn_ptr;
 
+// Weights of the terms in the AI's board evaluation.
+struct eval_weights {
+	int pawn;    // Each pawn.
+	int power;   // Each power held.
+	int range;   // Each level of range.
+	int upgrade; // Each good upgrade (shield, hover, etc).
+	int threat;  // Each adjacent enemy able to stomp a pawn.
+	int height;  // Each level of elevation under a pawn.
+	int hill;    // Each pawn standing on a hill.
+	int orb;     // Each orb adjacent to a pawn.
+
+	eval_weights();
+};
+
 struct options {
 	std::string username;
 	bool show_lines;
 
+	eval_weights eval;
+
+	int ai_depth;            // Search depth in plies.
+	int ai_threads;          // Search threads.
+	unsigned int ai_hash_mb; // Transposition table size, shared by every game.
+
+	// Limits on what the server queues for a client that isn't reading.
+	unsigned int send_queue_kb;
+	unsigned int send_queue_frames;
+	unsigned int send_queue_grace; // Seconds a client may stay over them.
+
+	unsigned int server_threads; // Threads running rooms, 0 for one per core.
+
+	// Seconds between writing server metrics to metrics_file, 0 to not
+	// collect them at all.
+	unsigned int metrics_interval;
+	std::string metrics_file;
+
+	std::string replay_dir; // Where the server logs games, empty to not.
+
+	// Seconds the server holds the place of a player who lost the
+	// connection mid-game, and frames kept for them to catch up from.
+	unsigned int resume_grace;
+	unsigned int resume_frames;
+
 	options();
 
 	void load(std::string filename);
@@ -77,7 +151,12 @@ struct send_buf {
 	buf_ptr buf;
 	uint32_t size;
 
-	send_buf(const protocol::message &message);
+	// Sequence number in the frame, 0 if none.
+	uint32_t seq;
+
+	send_buf(const protocol::message &message, uint32_t seq = 0);
+	// A frame as read off the wire, size included.
+	send_buf(const buf_ptr &buf, uint32_t size) : buf(buf), size(size), seq(0) {}
 };
 
 /* Exception-throwing versions of some SDL functions. */
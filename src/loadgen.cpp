@@ -0,0 +1,726 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <arpa/inet.h>
+#include <algorithm>
+#include <deque>
+#include <fstream>
+#include <sstream>
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
+#include "loadgen.hpp"
+#include "network.hpp"
+#include "gamestate.hpp"
+#include "actions.hpp"
+#include "powers.hpp"
+#include "chunk.hpp"
+
+using boost::asio::ip::tcp;
+
+// Most threads the bots share, they spend most of their time waiting.
+static const unsigned int LOADGEN_THREADS = 4;
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double thread_cpu()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double process_cpu()
+{
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+// User and system time of another process, or -1 if it can't be read.
+static double other_cpu(int pid)
+{
+	std::ostringstream path;
+	path << "/proc/" << pid << "/stat";
+
+	std::ifstream stat(path.str().c_str());
+	std::string line;
+	if(!std::getline(stat, line) || line.rfind(')') == std::string::npos) {
+		return -1;
+	}
+
+	// Fields from the state (3rd) on, utime and stime are the 14th and 15th.
+	std::istringstream fields(line.substr(line.rfind(')') + 1));
+	std::string skip;
+	unsigned long utime, stime;
+	for(int i = 3; i < 14; ++i) {
+		fields >> skip;
+	}
+	if(!(fields >> utime >> stime)) {
+		return -1;
+	}
+
+	return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+/* One synthetic player. The bots share a small pool of threads running one
+ * io_service, each with its own strand. A bot keeps its own copy of the
+ * board from the messages it gets and answers its turns with random legal
+ * moves and power uses. If the server still rejects its actions, the bot
+ * takes its seat back with its session to get a fresh copy of the board.
+*/
+class loadgen_bot {
+public:
+	// Counters, only read once the io_service has stopped.
+	std::vector<double> latencies;
+	unsigned long messages, actions, badmoves, resyncs;
+	unsigned long games; // Counted by the admin of each room.
+	bool started;        // Got a BEGIN at least once.
+
+	// Started once this bot has created the room.
+	std::vector<loadgen_bot*> followers;
+
+	loadgen_bot(boost::asio::io_service &io, const tcp::endpoint &server, const std::string &room, unsigned int expected, double deadline) :
+		messages(0), actions(0), badmoves(0), resyncs(0), games(0), started(false),
+		socket(io), strand(io), server(server), room(room), expected(expected), deadline(deadline), stopped(false), link(0),
+		game_state(NULL), actions_cache(NULL), my_id(0), my_colour(SPECTATE), players(0), begun(false),
+		sent_at(0), last_was_use(false), used_power(false), tries(0), want_action(false) {}
+
+	~loadgen_bot() {
+		delete actions_cache;
+		delete game_state;
+	}
+
+	void start() {
+		strand.post(boost::bind(&loadgen_bot::connect, this));
+	}
+
+	// Close the connection after the deadline, outstanding I/O is aborted.
+	void stop() {
+		strand.post(boost::bind(&loadgen_bot::close, this));
+	}
+
+private:
+	tcp::socket socket;
+	boost::asio::io_service::strand strand;
+	tcp::endpoint server;
+	std::string room;
+	unsigned int expected;
+	double deadline;
+	bool stopped;
+	unsigned int link; // Bumped on each reconnect, handlers of older sockets give up.
+
+	uint32_t msgsize;
+	std::vector<char> msgbuf;
+	std::deque<std::string> send_queue;
+
+	GameState *game_state;
+	ActionEnumerator *actions_cache; // Areas are cached by tile, so one per board.
+	ChunkAssembler chunks;
+
+	std::string session;
+	uint16_t my_id;
+	PlayerColour my_colour;
+	unsigned int players;
+	bool begun;
+
+	double sent_at;  // When the MOVE or USE awaiting an answer was sent.
+	bool last_was_use;
+	bool used_power; // One power use per turn, so turns always end.
+	unsigned int tries;
+	bool want_action;
+
+	void connect() {
+		// Its room didn't start before the deadline.
+		if(stopped) {
+			return;
+		}
+
+		socket.async_connect(server, strand.wrap(boost::bind(&loadgen_bot::connected, this, link, boost::asio::placeholders::error)));
+	}
+
+	void connected(unsigned int l, const boost::system::error_code &error) {
+		if(l != link) {
+			return;
+		}
+		if(error) {
+			fail("Connect error: " + error.message());
+			return;
+		}
+
+		// Without a seq the server sends the whole board again.
+		protocol::message init;
+		init.set_msg(protocol::INIT);
+		init.set_player_name("loadgen");
+		init.set_room(room);
+		if(!session.empty()) {
+			init.set_session(session);
+		}
+		send(init);
+
+		read_size();
+	}
+
+	// Drop the connection and take the seat back, for a board the server
+	// doesn't agree with.
+	void resync() {
+		++resyncs;
+		++link;
+
+		boost::system::error_code ec;
+		socket.close(ec);
+
+		send_queue.clear();
+		chunks = ChunkAssembler();
+		sent_at = 0;
+
+		connect();
+	}
+
+	void close() {
+		stopped = true;
+
+		boost::system::error_code ec;
+		socket.close(ec);
+	}
+
+	void fail(const std::string &error) {
+		if(!stopped && now() < deadline) {
+			fprintf(stderr, "loadgen: %s: %s\n", room.c_str(), error.c_str());
+		}
+		close();
+
+		// Let the rest of the room have a go without us.
+		start_followers();
+	}
+
+	void start_followers() {
+		for(size_t i = 0; i < followers.size(); ++i) {
+			followers[i]->start();
+		}
+		followers.clear();
+	}
+
+	void send(const protocol::message &msg) {
+		std::string pb;
+		msg.SerializeToString(&pb);
+
+		// One write, like the real client, so Nagle doesn't hold back the
+		// payload behind the size.
+		uint32_t size = htonl(pb.size());
+		pb.insert(0, (const char*)&size, sizeof(size));
+
+		send_queue.push_back(std::string());
+		send_queue.back().swap(pb);
+		if(send_queue.size() == 1) {
+			write_next();
+		}
+	}
+
+	void write_next() {
+		async_write(socket, boost::asio::buffer(send_queue.front()),
+			    strand.wrap(boost::bind(&loadgen_bot::write_finish, this, link, boost::asio::placeholders::error)));
+	}
+
+	void write_finish(unsigned int l, const boost::system::error_code &error) {
+		if(l != link) {
+			return;
+		}
+		if(error) {
+			fail("Write error: " + error.message());
+			return;
+		}
+
+		send_queue.pop_front();
+		if(!send_queue.empty()) {
+			write_next();
+		}
+	}
+
+	void read_size() {
+		async_read(socket, boost::asio::buffer(&msgsize, sizeof(msgsize)),
+			   strand.wrap(boost::bind(&loadgen_bot::read_message, this, link, boost::asio::placeholders::error)));
+	}
+
+	void read_message(unsigned int l, const boost::system::error_code &error) {
+		if(l != link) {
+			return;
+		}
+		if(error) {
+			fail("Read error: " + error.message());
+			return;
+		}
+
+		msgsize = ntohl(msgsize);
+		if(msgsize > MAX_MSGSIZE) {
+			fail("Oversized frame");
+			return;
+		}
+
+		msgbuf.resize(msgsize);
+		async_read(socket, boost::asio::buffer(msgbuf),
+			   strand.wrap(boost::bind(&loadgen_bot::read_finish, this, link, boost::asio::placeholders::error)));
+	}
+
+	void read_finish(unsigned int l, const boost::system::error_code &error) {
+		if(l != link) {
+			return;
+		}
+		if(error) {
+			fail("Read error: " + error.message());
+			return;
+		}
+
+		try {
+			protocol::message msg;
+			if(!msg.ParseFromArray(msgbuf.empty() ? NULL : &msgbuf[0], msgbuf.size())) {
+				throw std::runtime_error("Invalid message");
+			}
+
+			handle(msg);
+
+			if(want_action) {
+				want_action = false;
+				act();
+			}
+		} catch(std::exception &e) {
+			fail(e.what());
+			return;
+		}
+
+		// A resync has started reading the new connection already.
+		if(l == link) {
+			read_size();
+		}
+	}
+
+	void send_basic(protocol::msgtype type) {
+		protocol::message msg;
+		msg.set_msg(type);
+		send(msg);
+	}
+
+	void begin() {
+		if(expected && players >= expected && !begun) {
+			begun = true;
+			send_basic(protocol::BEGIN);
+		}
+	}
+
+	void handle(const protocol::message &msg) {
+		++messages;
+
+		switch(msg.msg()) {
+		case protocol::BATCH:
+			--messages;
+			for(int i = 0; i < msg.batch_size(); ++i) {
+				handle(msg.batch(i));
+			}
+			break;
+
+		case protocol::CHUNK: {
+			protocol::message whole;
+			if(chunks.add(msg, whole)) {
+				--messages;
+				handle(whole);
+			}
+			break;
+		}
+
+		case protocol::QUIT:
+			throw std::runtime_error("Disconnected: " + msg.quit_msg());
+
+		case protocol::GINFO:
+			// The room exists now, the others can join it.
+			start_followers();
+
+			my_id = msg.player_id();
+			if(msg.has_session()) {
+				session = msg.session();
+			}
+			players = msg.players_size();
+			for(int i = 0; i < msg.players_size(); ++i) {
+				if(msg.players(i).id() == my_id) {
+					my_colour = (PlayerColour)msg.players(i).colour();
+				}
+			}
+
+			// Only the admin may start the game.
+			if(my_id != ADMIN_ID) {
+				expected = 0;
+			}
+			begin();
+			break;
+
+		case protocol::PJOIN:
+			++players;
+			begin();
+			break;
+
+		case protocol::PQUIT:
+			--players;
+
+			// The server takes the team off the board without telling us.
+			if(game_state && msg.players_size() == 1) {
+				game_state->destroy_team_pawns((PlayerColour)msg.players(0).colour());
+			}
+			break;
+
+		case protocol::CCOLOUR:
+			if(msg.players_size() == 1 && msg.players(0).id() == my_id) {
+				my_colour = (PlayerColour)msg.players(0).colour();
+			}
+			break;
+
+		case protocol::BEGIN:
+			delete actions_cache;
+			delete game_state;
+			game_state = new GameState;
+			game_state->deserialize(msg);
+			actions_cache = new ActionEnumerator;
+			started = true;
+			break;
+
+		case protocol::GOVER:
+			delete actions_cache;
+			delete game_state;
+			actions_cache = NULL;
+			game_state = NULL;
+			if(my_id == ADMIN_ID) {
+				++games;
+			}
+
+			begun = false;
+			begin();
+			break;
+
+		case protocol::TURN:
+			if(msg.player_id() == my_id && game_state) {
+				used_power = false;
+				tries = 0;
+				want_action = true;
+			}
+			break;
+
+		case protocol::OK:
+		case protocol::BADMOVE:
+			if(sent_at) {
+				latencies.push_back(now() - sent_at);
+				sent_at = 0;
+			}
+
+			if(msg.msg() == protocol::BADMOVE) {
+				++badmoves;
+				want_action = true;
+			}else if(last_was_use) {
+				// Using a power doesn't end the turn.
+				want_action = true;
+			}
+			break;
+
+		case protocol::MOVE:
+		case protocol::FORCE_MOVE:
+			if(game_state && msg.pawns_size() == 1) {
+				pawn_ptr pawn = game_state->pawn_at(msg.pawns(0).col(), msg.pawns(0).row());
+				Tile *tile = game_state->tile_at(msg.pawns(0).new_col(), msg.pawns(0).new_row());
+				if(pawn && tile && !tile->pawn) {
+					tile->pawn.swap(pawn->cur_tile->pawn);
+					pawn->cur_tile = tile;
+				}
+			}
+			break;
+
+		case protocol::DESTROY:
+			if(game_state && msg.pawns_size() == 1) {
+				pawn_ptr pawn = game_state->pawn_at(msg.pawns(0).col(), msg.pawns(0).row());
+				if(pawn) {
+					pawn->destroy((Pawn::destroy_type)(-1));
+				}
+			}
+			break;
+
+		case protocol::UPDATE:
+			if(game_state) {
+				update(msg);
+			}
+			break;
+
+		default:
+			break;
+		}
+	}
+
+	void update(const protocol::message &msg) {
+		for(int i = 0; i < msg.tiles_size(); ++i) {
+			Tile *tile = game_state->tile_at(msg.tiles(i).col(), msg.tiles(i).row());
+			if(tile) {
+				tile->update_from_proto(msg.tiles(i));
+			}
+		}
+
+		for(int i = 0; i < msg.pawns_size(); ++i) {
+			const protocol::pawn &p = msg.pawns(i);
+
+			pawn_ptr pawn = game_state->pawn_at(p.col(), p.row());
+			if(!pawn) {
+				continue;
+			}
+
+			if(p.has_flags()) pawn->flags = p.flags();
+			if(p.has_range()) pawn->range = p.range();
+			if(p.has_colour()) pawn->colour = PlayerColour(p.colour());
+			if(!p.all_powers() && p.powers_size() == 0) {
+				continue;
+			}
+
+			pawn->powers.clear();
+			for(int j = 0; j < p.powers_size(); ++j) {
+				if(p.powers(j).index() < Powers::powers.size() && p.powers(j).num() > 0) {
+					pawn->powers.insert(std::make_pair((int)p.powers(j).index(), (int)p.powers(j).num()));
+				}
+			}
+		}
+	}
+
+	// Send a random usable power, returns false if there isn't one.
+	bool use_power() {
+		std::vector<pawn_ptr> pawns = game_state->player_pawns(my_colour);
+
+		std::vector<ActionEnumerator::action> uses;
+		for(std::vector<pawn_ptr>::iterator p = pawns.begin(); p != pawns.end(); ++p) {
+			// Confused pawns don't get to pick a direction.
+			if(!((*p)->flags & PWR_CONFUSED)) {
+				actions_cache->enumerate(*p, game_state, uses);
+			}
+		}
+		if(uses.empty()) {
+			return false;
+		}
+
+		const ActionEnumerator::action &use = uses[rand() % uses.size()];
+
+		protocol::message msg;
+		msg.set_msg(protocol::USE);
+		msg.add_pawns()->set_col(use.pawn->cur_tile->col);
+		msg.mutable_pawns(0)->set_row(use.pawn->cur_tile->row);
+		msg.mutable_pawns(0)->set_use_power(use.power);
+		msg.set_power_direction(use.direction);
+		if(use.target) {
+			msg.add_tiles()->set_col(use.target->col);
+			msg.mutable_tiles(0)->set_row(use.target->row);
+		}
+
+		last_was_use = true;
+		sent(msg);
+
+		return true;
+	}
+
+	void act() {
+		if(!game_state) {
+			return;
+		}
+
+		// Legal moves keep getting rejected, our board must be wrong.
+		if(++tries > 8) {
+			resync();
+			return;
+		}
+
+		if(!used_power && rand() % 4 == 0) {
+			used_power = true;
+			if(use_power()) {
+				return;
+			}
+		}
+
+		std::vector<pawn_ptr> pawns = game_state->player_pawns(my_colour);
+
+		std::vector<std::pair<pawn_ptr, Tile*> > moves;
+		for(std::vector<pawn_ptr>::iterator p = pawns.begin(); p != pawns.end(); ++p) {
+			Tile::List tiles = (*p)->move_tiles();
+			for(Tile::List::iterator t = tiles.begin(); t != tiles.end(); ++t) {
+				if(*t && *t != (*p)->cur_tile && (*p)->can_move(*t, game_state)) {
+					moves.push_back(std::make_pair(*p, *t));
+				}
+			}
+		}
+
+		// Nowhere to go and the protocol has no way to pass, give up like
+		// the AI does.
+		if(moves.empty()) {
+			last_was_use = false;
+			send_basic(protocol::RESIGN);
+			return;
+		}
+
+		const std::pair<pawn_ptr, Tile*> &m = moves[rand() % moves.size()];
+
+		protocol::message msg;
+		msg.set_msg(protocol::MOVE);
+		msg.add_pawns()->set_col(m.first->cur_tile->col);
+		msg.mutable_pawns(0)->set_row(m.first->cur_tile->row);
+		msg.mutable_pawns(0)->set_new_col(m.second->col);
+		msg.mutable_pawns(0)->set_new_row(m.second->row);
+
+		last_was_use = false;
+		sent(msg);
+	}
+
+	// Send a MOVE or USE and start timing it.
+	void sent(const protocol::message &msg) {
+		++actions;
+		sent_at = now();
+		send(msg);
+	}
+};
+
+// A thread of the bots' pool, cpu gets the CPU time it used.
+static void run_bots(boost::asio::io_service &io, double *cpu)
+{
+	double start_cpu = thread_cpu();
+	io.run();
+	*cpu = thread_cpu() - start_cpu;
+}
+
+static double percentile(const std::vector<double> &sorted, double p)
+{
+	if(sorted.empty()) {
+		return 0;
+	}
+	return sorted[std::min(sorted.size() - 1, (size_t)(sorted.size() * p))];
+}
+
+int run_loadgen(const loadgen_config &config)
+{
+	if(!config.clients || !config.players) {
+		fprintf(stderr, "loadgen: need at least one client and one player per room\n");
+		return 1;
+	}
+
+	Server *server = NULL;
+	if(!config.scenario.empty()) {
+		try {
+			server = new Server(config.port, config.scenario);
+		} catch(std::exception &e) {
+			fprintf(stderr, "loadgen: can't host %s: %s\n", config.scenario.c_str(), e.what());
+			return 1;
+		}
+	}
+
+	unsigned int rooms = (config.clients + config.players - 1) / config.players;
+
+	printf("loadgen: %u clients in %u rooms on %s:%u for %u seconds\n",
+	       config.clients, rooms, config.host.c_str(), (unsigned int)config.port, config.seconds);
+
+	double start = now();
+	double deadline = start + config.seconds;
+	double start_cpu = server ? process_cpu() : other_cpu(config.server_pid);
+
+	tcp::endpoint endpoint;
+	try {
+		endpoint = tcp::endpoint(boost::asio::ip::address::from_string(config.host), config.port);
+	} catch(std::exception &e) {
+		fprintf(stderr, "loadgen: bad address %s: %s\n", config.host.c_str(), e.what());
+		delete server;
+		return 1;
+	}
+
+	boost::asio::io_service io;
+	std::vector<boost::shared_ptr<loadgen_bot> > bots;
+
+	for(unsigned int i = 0; i < config.clients; ++i) {
+		unsigned int r = i / config.players;
+
+		std::ostringstream room;
+		room << "loadgen-" << getpid() << "-" << r;
+
+		// The last room gets whoever is left over.
+		unsigned int expected = std::min(config.players, config.clients - r * config.players);
+
+		bots.push_back(boost::shared_ptr<loadgen_bot>(new loadgen_bot(io, endpoint, room.str(), expected, deadline)));
+
+		// The first client of each room creates it, the rest join once it
+		// has been told it is in.
+		if(i % config.players == 0) {
+			bots.back()->start();
+		}else{
+			bots[r * config.players]->followers.push_back(bots.back().get());
+		}
+	}
+
+	unsigned int nthreads = std::max(1u, std::min(LOADGEN_THREADS, boost::thread::hardware_concurrency()));
+	std::vector<double> thread_cpus(nthreads);
+	boost::thread_group threads;
+	for(unsigned int i = 0; i < nthreads; ++i) {
+		threads.create_thread(boost::bind(&run_bots, boost::ref(io), &thread_cpus[i]));
+	}
+
+	boost::this_thread::sleep(boost::posix_time::milliseconds((long)((deadline - now()) * 1000)));
+	for(size_t i = 0; i < bots.size(); ++i) {
+		bots[i]->stop();
+	}
+	threads.join_all();
+
+	double elapsed = now() - start;
+	double server_cpu = (server ? process_cpu() : other_cpu(config.server_pid)) - start_cpu;
+
+	std::vector<double> latencies;
+	unsigned long messages = 0, actions = 0, badmoves = 0, resyncs = 0, games = 0;
+	unsigned int idle_rooms = 0;
+	for(size_t i = 0; i < bots.size(); ++i) {
+		latencies.insert(latencies.end(), bots[i]->latencies.begin(), bots[i]->latencies.end());
+		messages += bots[i]->messages;
+		actions += bots[i]->actions;
+		badmoves += bots[i]->badmoves;
+		resyncs += bots[i]->resyncs;
+		games += bots[i]->games;
+
+		if(i % config.players == 0 && !bots[i]->started) {
+			++idle_rooms;
+		}
+	}
+
+	double bot_cpu = 0;
+	for(size_t i = 0; i < thread_cpus.size(); ++i) {
+		bot_cpu += thread_cpus[i];
+	}
+	std::sort(latencies.begin(), latencies.end());
+
+	// The server shares the process, leave out what the bots used.
+	if(server) {
+		server_cpu -= bot_cpu;
+	}
+
+	printf("MOVE/USE -> OK   %lu actions, %lu BADMOVE, %lu resyncs, p50 %.3f ms, p99 %.3f ms, max %.3f ms\n",
+	       actions, badmoves, resyncs, percentile(latencies, 0.5) * 1000, percentile(latencies, 0.99) * 1000,
+	       latencies.empty() ? 0.0 : latencies.back() * 1000);
+	printf("received         %lu messages, %.0f msgs/s, %lu games finished\n",
+	       messages, messages / elapsed, games);
+
+	if(start_cpu >= 0 && server_cpu >= 0) {
+		printf("server CPU       %.2f s, %.1f%% of one core%s\n", server_cpu, server_cpu / elapsed * 100,
+		       server ? " (approximate: process total minus bot threads)" : "");
+	}else{
+		printf("server CPU       unknown, pass the server's pid or host the scenario\n");
+	}
+
+	delete server;
+
+	// The server ignores a BEGIN it can't start, so this is the only sign.
+	if(idle_rooms) {
+		fprintf(stderr, "loadgen: %u of %u rooms never started a game, does the map have %u teams?\n",
+		        idle_rooms, rooms, config.players);
+		return 1;
+	}
+
+	return 0;
+}
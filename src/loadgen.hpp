@@ -0,0 +1,31 @@
+#ifndef LOADGEN_HPP
+#define LOADGEN_HPP
+
+#include <string>
+#include <stdint.h>
+
+struct loadgen_config {
+	std::string host;
+	uint16_t port;
+
+	// Scenario to host a server for in this process, empty to use the
+	// server at host:port.
+	std::string scenario;
+
+	unsigned int clients;
+	unsigned int players;  // Clients per room.
+	unsigned int seconds;
+
+	// Process to report the CPU time of when the server isn't ours.
+	int server_pid;
+
+	loadgen_config() : port(0), clients(0), players(2), seconds(30), server_pid(0) {}
+};
+
+/* Play random games with synthetic clients speaking the normal protocol
+ * and report MOVE/USE to OK latency, message rates and server CPU time.
+ * Returns the process exit status.
+*/
+int run_loadgen(const loadgen_config &config);
+
+#endif /* !LOADGEN_HPP */
@@ -1,5 +1,6 @@
 #include <iostream>
 #include <stdlib.h>
+#include <signal.h>
 #include <SDL/SDL.h>
 #include <assert.h>
 #include <vector>
@@ -9,6 +10,11 @@
 #include <SDL/SDL_ttf.h>
 #include <math.h>
 #include <boost/program_options.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/wire_format_lite.h>
 
 #ifdef _WIN32
 /* Including windows.h here makes it error when ASIO includes winsock.h since
@@ -27,6 +33,11 @@
 #include "menu.hpp"
 #include "gui.hpp"
 #include "powers.hpp"
+#include "bench.hpp"
+#include "book.hpp"
+#include "loadgen.hpp"
+#include "replay.hpp"
+#include "relay.hpp"
 
 namespace po = boost::program_options;
 
@@ -51,14 +62,33 @@ int main(int argc, char **argv) {
 	options.save("options.txt");
 
 	uint16_t port;
-	std::string hostname, scenario;
+	std::string hostname, room, scenario, server_map, bench, gen_book, replay, relay;
+	loadgen_config loadgen;
+	unsigned int replay_speed, replay_turn, replay_checkpoints;
+	uint16_t relay_server_port;
 
 	po::options_description desc("Command line options");
 	desc.add_options()
 			("help", "Display this message")
 			("connect,c", po::value<std::string>(&hostname), "Connect to server")
+			("room,r", po::value<std::string>(&room), "Room to join on the server, created if it doesn't exist")
+			("list-rooms", "List the rooms on the --connect server and exit")
 			("host,h", po::value<std::string>(&scenario), "Host game with supplied scenario")
+			("server", po::value<std::string>(&server_map), "Host rooms with the supplied default scenario without a window, until interrupted")
 			("port,p", po::value<uint16_t>(&port)->default_value(DEFAULT_PORT), std::string("Set TCP port (default is " + to_string(DEFAULT_PORT) + ")").c_str())
+			("bench", po::value<std::string>(&bench), "Run the named benchmark over every scenario and exit")
+			("gen-book", po::value<std::string>(&gen_book), "Generate the AI move book for a scenario and exit")
+			("loadgen", po::value<unsigned int>(&loadgen.clients), "Load test the server given by --connect, or one hosting the --host scenario, with this many synthetic clients and exit")
+			("loadgen-players", po::value<unsigned int>(&loadgen.players)->default_value(2), "Synthetic clients per room")
+			("loadgen-seconds", po::value<unsigned int>(&loadgen.seconds)->default_value(30), "Length of the load test")
+			("loadgen-pid", po::value<int>(&loadgen.server_pid), "Server process to report the CPU time of")
+			("replay", po::value<std::string>(&replay), "Watch a game log")
+			("replay-speed", po::value<unsigned int>(&replay_speed)->default_value(1), "Times faster than the game was played, 0 for as fast as possible")
+			("replay-turn", po::value<unsigned int>(&replay_turn)->default_value(0), "Turn to start watching from")
+			("replay-bench", "Play the --replay log headless as fast as possible, check it plays back the same and exit")
+			("replay-checkpoints", po::value<unsigned int>(&replay_checkpoints)->default_value(10), "Turns between checkpoints with --replay-bench")
+			("relay", po::value<std::string>(&relay), "Pass the named room on the --connect server on to spectators connecting to --port, until the server closes it")
+			("relay-server-port", po::value<uint16_t>(&relay_server_port)->default_value(DEFAULT_PORT), "Port of the server to --relay from")
 	;
 
 	po::variables_map vm;
@@ -77,6 +107,62 @@ int main(int argc, char **argv) {
 		return 0;
 	}
 
+	if(vm.count("bench")) {
+		return run_benchmark(bench);
+	}
+
+	if(vm.count("gen-book")) {
+		try {
+			boost::filesystem::create_directories("book");
+			MoveBook::generate("scenario/" + gen_book, "book/" + gen_book + ".book");
+		} catch(std::exception &e) {
+			std::cerr << e.what() << std::endl;
+			return 1;
+		}
+		return 0;
+	}
+
+	if(vm.count("replay-bench")) {
+		return run_replay(replay, replay_turn, replay_checkpoints);
+	}
+
+	if(vm.count("loadgen")) {
+		loadgen.host = vm.count("connect") ? hostname : "127.0.0.1";
+		loadgen.port = port;
+		loadgen.scenario = scenario;
+		return run_loadgen(loadgen);
+	}
+
+	if(vm.count("list-rooms")) {
+		return list_rooms(vm.count("connect") ? hostname : "127.0.0.1", port);
+	}
+
+	if(vm.count("relay")) {
+		try {
+			Relay r(vm.count("connect") ? hostname : "127.0.0.1", relay_server_port, relay, port);
+			r.run();
+		} catch(std::exception &e) {
+			std::cerr << e.what() << std::endl;
+			return 1;
+		}
+		return 0;
+	}
+
+	if(vm.count("server")) {
+		try {
+			Server server(port, server_map);
+
+			boost::asio::io_service signal_io;
+			boost::asio::signal_set signals(signal_io, SIGINT, SIGTERM);
+			signals.async_wait(boost::bind(&boost::asio::io_service::stop, &signal_io));
+			signal_io.run();
+		} catch(std::exception &e) {
+			std::cerr << e.what() << std::endl;
+			return 1;
+		}
+		return 0;
+	}
+
 	if(SDL_Init(SDL_INIT_VIDEO | SDL_INIT_TIMER) != 0) {
 		throw std::runtime_error(std::string("SDL error: ") + SDL_GetError());
 	}
@@ -91,14 +177,20 @@ int main(int argc, char **argv) {
 
 	ImgStuff::set_mode(MENU_WIDTH, MENU_HEIGHT);
 
-	if(vm.count("host")) {
+	if(vm.count("replay")) {
+		ReplayServer server(replay, port, replay_speed, replay_turn);
+
+		Client client("127.0.0.1", port);
+
+		client.run();
+	}else if(vm.count("host")) {
 		Server server(port, scenario);
 
 		Client client("127.0.0.1", port);
 
 		client.run();
 	}else if(vm.count("connect")) {
-		Client client(hostname, port);
+		Client client(hostname, port, room);
 
 		client.run();
 	}else{
@@ -126,6 +218,54 @@ options::options() {
 	username = user ? user : "Unnamed player";
 
 	show_lines = true;
+
+	ai_depth = 3;
+	ai_threads = 1;
+	ai_hash_mb = 64;
+
+	send_queue_kb = 4096;
+	send_queue_frames = 8192;
+	send_queue_grace = 10;
+
+	server_threads = 0;
+
+	metrics_interval = 0;
+	metrics_file = "metrics.txt";
+
+	replay_dir = "replays";
+
+	resume_grace = 60;
+	resume_frames = 512;
+}
+
+eval_weights::eval_weights() :
+	pawn(100), power(15), range(10), upgrade(10),
+	threat(40), height(5), hill(20), orb(8)
+{}
+
+static struct {
+	const char *name;
+	int eval_weights::*weight;
+} eval_weight_names[] = {
+	{"eval_pawn",    &eval_weights::pawn},
+	{"eval_power",   &eval_weights::power},
+	{"eval_range",   &eval_weights::range},
+	{"eval_upgrade", &eval_weights::upgrade},
+	{"eval_threat",  &eval_weights::threat},
+	{"eval_height",  &eval_weights::height},
+	{"eval_hill",    &eval_weights::hill},
+	{"eval_orb",     &eval_weights::orb},
+};
+
+static int *find_eval_weight(eval_weights &eval, const std::string &name)
+{
+	for(unsigned int i = 0; i < sizeof eval_weight_names / sizeof eval_weight_names[0]; ++i) {
+		if(name == eval_weight_names[i].name) {
+			return &(eval.*(eval_weight_names[i].weight));
+		}
+	}
+
+	return NULL;
 }
 
 void options::load(std::string filename) {
@@ -156,6 +296,32 @@ void options::load(std::string filename) {
 			username = val;
 		}else if(name == "show_lines") {
 			show_lines = (val == "true" ? 1 : 0);
+		}else if(name == "ai_depth") {
+			ai_depth = atoi(val.c_str());
+		}else if(name == "ai_threads") {
+			ai_threads = atoi(val.c_str());
+		}else if(name == "ai_hash_mb") {
+			ai_hash_mb = atoi(val.c_str());
+		}else if(name == "send_queue_kb") {
+			send_queue_kb = atoi(val.c_str());
+		}else if(name == "send_queue_frames") {
+			send_queue_frames = atoi(val.c_str());
+		}else if(name == "send_queue_grace") {
+			send_queue_grace = atoi(val.c_str());
+		}else if(name == "server_threads") {
+			server_threads = atoi(val.c_str());
+		}else if(name == "metrics_interval") {
+			metrics_interval = atoi(val.c_str());
+		}else if(name == "metrics_file") {
+			metrics_file = val;
+		}else if(name == "replay_dir") {
+			replay_dir = val;
+		}else if(name == "resume_grace") {
+			resume_grace = atoi(val.c_str());
+		}else if(name == "resume_frames") {
+			resume_frames = atoi(val.c_str());
+		}else if(int *weight = find_eval_weight(eval, name)) {
+			*weight = atoi(val.c_str());
 		}else{
 			std::cerr << "Unknown option: " << name << std::endl;
 		}
@@ -172,12 +338,46 @@ void options::save(std::string filename) {
 
 	file << "username=" << username << std::endl;
 	file << "show_lines=" << (show_lines ? "true" : "false") << std::endl;
+
+	file << "ai_depth=" << ai_depth << std::endl;
+	file << "ai_threads=" << ai_threads << std::endl;
+	file << "ai_hash_mb=" << ai_hash_mb << std::endl;
+
+	file << "send_queue_kb=" << send_queue_kb << std::endl;
+	file << "send_queue_frames=" << send_queue_frames << std::endl;
+	file << "send_queue_grace=" << send_queue_grace << std::endl;
+
+	file << "server_threads=" << server_threads << std::endl;
+
+	file << "metrics_interval=" << metrics_interval << std::endl;
+	file << "metrics_file=" << metrics_file << std::endl;
+
+	file << "replay_dir=" << replay_dir << std::endl;
+
+	file << "resume_grace=" << resume_grace << std::endl;
+	file << "resume_frames=" << resume_frames << std::endl;
+
+	for(unsigned int i = 0; i < sizeof eval_weight_names / sizeof eval_weight_names[0]; ++i) {
+		file << eval_weight_names[i].name << "=" << eval.*(eval_weight_names[i].weight) << std::endl;
+	}
 }
 
-send_buf::send_buf(const protocol::message &message) : buf() {
+send_buf::send_buf(const protocol::message &message, uint32_t seq) : buf(), seq(seq) {
 	std::string pb;
 	message.SerializeToString(&pb);
 
+	// Fields may come in any order, so seq is added to the end rather than
+	// set on what may be a message shared with other frames.
+	if(seq) {
+		uint8_t field[10];
+		uint8_t *end = google::protobuf::io::CodedOutputStream::WriteTagToArray(
+			google::protobuf::internal::WireFormatLite::MakeTag(protocol::message::kSeqFieldNumber,
+				google::protobuf::internal::WireFormatLite::WIRETYPE_VARINT), field);
+		end = google::protobuf::io::CodedOutputStream::WriteVarint32ToArray(seq, end);
+
+		pb.append((const char *)field, end - field);
+	}
+
 	uint32_t psize = htonl(pb.size());
 	buf = buf_ptr(new char[size = (pb.size()+sizeof(psize))]);
 
@@ -0,0 +1,181 @@
+#include <stdio.h>
+#include <algorithm>
+#include <fstream>
+#include <boost/filesystem.hpp>
+
+#include "metrics.hpp"
+#include "hexradius.pb.h"
+
+bool Metrics::enabled = false;
+
+// Every metric, in the order they were constructed. Only added to during
+// static initialisation.
+static std::vector<Metrics::Counter *> &counters()
+{
+	static std::vector<Metrics::Counter *> list;
+	return list;
+}
+
+static std::vector<Metrics::Histogram *> &histograms()
+{
+	static std::vector<Metrics::Histogram *> list;
+	return list;
+}
+
+Metrics::Counter::Counter(const char *name) : counter_name(name), count(0)
+{
+	counters().push_back(this);
+}
+
+Metrics::Histogram::Histogram(const std::string &name, const char *unit) :
+	histogram_name(name), histogram_unit(unit), total(0), value_sum(0), value_max(0)
+{
+	for(unsigned int i = 0; i < BUCKETS; ++i) {
+		buckets[i] = 0;
+	}
+
+	histograms().push_back(this);
+}
+
+unsigned int Metrics::Histogram::bucket_of(uint64_t value)
+{
+	if(value > 0xFFFFFFFFULL) {
+		value = 0xFFFFFFFFULL;
+	}
+	if(value < SUB_BUCKETS) {
+		return value;
+	}
+
+	unsigned int exponent = 63 - __builtin_clzll(value);
+	unsigned int sub = (value >> (exponent - 3)) & (SUB_BUCKETS - 1);
+
+	return (exponent - 2) * SUB_BUCKETS + sub;
+}
+
+uint64_t Metrics::Histogram::bucket_limit(unsigned int bucket)
+{
+	if(bucket < SUB_BUCKETS) {
+		return bucket;
+	}
+
+	unsigned int exponent = bucket / SUB_BUCKETS + 2;
+	uint64_t lowest = (uint64_t)(SUB_BUCKETS + bucket % SUB_BUCKETS) << (exponent - 3);
+
+	return lowest + ((uint64_t)1 << (exponent - 3)) - 1;
+}
+
+void Metrics::Histogram::record(uint64_t value)
+{
+	if(!enabled) {
+		return;
+	}
+
+	buckets[bucket_of(value)].fetch_add(1, boost::memory_order_relaxed);
+	total.fetch_add(1, boost::memory_order_relaxed);
+	value_sum.fetch_add(value, boost::memory_order_relaxed);
+
+	uint64_t old_max = value_max.load(boost::memory_order_relaxed);
+	while(value > old_max && !value_max.compare_exchange_weak(old_max, value, boost::memory_order_relaxed)) {}
+}
+
+uint64_t Metrics::Histogram::percentile(double p) const
+{
+	unsigned long n = count();
+	if(!n) {
+		return 0;
+	}
+
+	// Rank of the value wanted, counting from 1.
+	unsigned long rank = (unsigned long)(p * n);
+	if(rank < 1) {
+		rank = 1;
+	}
+
+	unsigned long seen = 0;
+	for(unsigned int i = 0; i < BUCKETS; ++i) {
+		seen += buckets[i].load(boost::memory_order_relaxed);
+		if(seen >= rank) {
+			return std::min(bucket_limit(i), max());
+		}
+	}
+
+	return max();
+}
+
+Metrics::MessageHistograms::MessageHistograms(const char *prefix, const char *unit) :
+	histograms(protocol::msgtype_MAX + 1, (Histogram *)NULL), other(std::string(prefix) + ".other", unit)
+{
+	for(int type = 0; type <= protocol::msgtype_MAX; ++type) {
+		if(protocol::msgtype_IsValid(type)) {
+			histograms[type] = new Histogram(std::string(prefix) + "." + protocol::msgtype_Name((protocol::msgtype)type), unit);
+		}
+	}
+}
+
+Metrics::Histogram &Metrics::MessageHistograms::operator[](int type)
+{
+	if(type < 0 || type > protocol::msgtype_MAX || !histograms[type]) {
+		return other;
+	}
+	return *histograms[type];
+}
+
+Metrics::Timer::~Timer()
+{
+	if(!running) {
+		return;
+	}
+
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	int64_t ns = (int64_t)(end.tv_sec - start.tv_sec) * 1000000000 + (end.tv_nsec - start.tv_nsec);
+	histogram.record(ns / 1000);
+}
+
+/* One line per metric:
+ *
+ * counter NAME VALUE
+ * histogram NAME UNIT count N sum S p50 X p90 X p99 X max X
+*/
+void Metrics::dump(std::ostream &out)
+{
+	out << "# hexradius metrics " << time(NULL) << std::endl;
+
+	std::vector<Counter *> &c = counters();
+	for(std::vector<Counter *>::iterator i = c.begin(); i != c.end(); ++i) {
+		out << "counter " << (*i)->name() << " " << (*i)->value() << std::endl;
+	}
+
+	std::vector<Histogram *> &h = histograms();
+	for(std::vector<Histogram *>::iterator i = h.begin(); i != h.end(); ++i) {
+		out << "histogram " << (*i)->name() << " " << (*i)->unit()
+			<< " count " << (*i)->count()
+			<< " sum " << (*i)->sum()
+			<< " p50 " << (*i)->percentile(0.5)
+			<< " p90 " << (*i)->percentile(0.9)
+			<< " p99 " << (*i)->percentile(0.99)
+			<< " max " << (*i)->max() << std::endl;
+	}
+}
+
+void Metrics::dump(const std::string &filename)
+{
+	std::string tmp = filename + ".tmp";
+
+	{
+		std::ofstream file(tmp.c_str());
+		if(!file) {
+			fprintf(stderr, "Can't write metrics to %s\n", tmp.c_str());
+			return;
+		}
+
+		dump(file);
+	}
+
+	boost::system::error_code ec;
+	boost::filesystem::rename(tmp, filename, ec);
+	if(ec) {
+		fprintf(stderr, "Can't write metrics to %s: %s\n", filename.c_str(), ec.message().c_str());
+	}
+}
@@ -0,0 +1,116 @@
+#ifndef METRICS_HPP
+#define METRICS_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include <ostream>
+#include <boost/atomic.hpp>
+
+/* Server counters and histograms.
+ *
+ * Metrics are static objects which register themselves by name when
+ * constructed. Recording one is a relaxed atomic add, or just a test of
+ * Metrics::enabled while metrics are turned off.
+ *
+ * Histograms are log-linear like HDR histograms: values below 8 get a
+ * bucket each, above that every power of two is split into 8 buckets,
+ * so a reported value is never more than 12.5% off.
+*/
+namespace Metrics {
+	extern bool enabled;
+
+	class Counter {
+	public:
+		Counter(const char *name);
+
+		void add(unsigned long n = 1) {
+			if(enabled) {
+				count.fetch_add(n, boost::memory_order_relaxed);
+			}
+		}
+
+		const char *name() const { return counter_name; }
+		unsigned long value() const { return count.load(boost::memory_order_relaxed); }
+
+	private:
+		const char *counter_name;
+		boost::atomic<unsigned long> count;
+	};
+
+	class Histogram {
+	public:
+		Histogram(const std::string &name, const char *unit);
+
+		void record(uint64_t value);
+
+		const std::string &name() const { return histogram_name; }
+		const char *unit() const { return histogram_unit; }
+
+		unsigned long count() const { return total.load(boost::memory_order_relaxed); }
+		uint64_t sum() const { return value_sum.load(boost::memory_order_relaxed); }
+		uint64_t max() const { return value_max.load(boost::memory_order_relaxed); }
+
+		// Upper bound of the bucket holding the pth fraction of values.
+		uint64_t percentile(double p) const;
+
+	private:
+		enum {
+			SUB_BUCKETS = 8,
+			// Values are clamped to 32 bits, over an hour in microseconds.
+			BUCKETS = (32 - 2) * SUB_BUCKETS,
+		};
+
+		std::string histogram_name;
+		const char *histogram_unit;
+
+		boost::atomic<unsigned long> buckets[BUCKETS];
+		boost::atomic<unsigned long> total;
+		boost::atomic<uint64_t> value_sum;
+		boost::atomic<uint64_t> value_max;
+
+		static unsigned int bucket_of(uint64_t value);
+		static uint64_t bucket_limit(unsigned int bucket);
+	};
+
+	/* One histogram per message type, named prefix.TYPE. Types that
+	 * aren't in the protocol share prefix.other.
+	*/
+	class MessageHistograms {
+	public:
+		MessageHistograms(const char *prefix, const char *unit = "us");
+
+		Histogram &operator[](int type);
+
+	private:
+		std::vector<Histogram *> histograms;
+		Histogram other;
+	};
+
+	// Records the time from construction to destruction in microseconds.
+	class Timer {
+	public:
+		Timer(Histogram &h) : histogram(h), running(enabled) {
+			if(running) {
+				clock_gettime(CLOCK_MONOTONIC, &start);
+			}
+		}
+
+		~Timer();
+
+	private:
+		Histogram &histogram;
+		bool running;
+		struct timespec start;
+	};
+
+	// Write every metric as text, one per line.
+	void dump(std::ostream &out);
+
+	// Dump to a file, replacing it in one go.
+	void dump(const std::string &filename);
+}
+
+#endif /* !METRICS_HPP */
@@ -1,18 +1,28 @@
 #include <stdint.h>
+#include <algorithm>
 #include <boost/asio.hpp>
 #include <boost/bind.hpp>
 #include <stdexcept>
 #include <iostream>
+#include <fstream>
 #include <boost/shared_ptr.hpp>
+#include <boost/scoped_ptr.hpp>
 #include <boost/foreach.hpp>
 
 #include "network.hpp"
 #include "hexradius.pb.h"
 #include "powers.hpp"
+#include "search.hpp"
+#include "ttable.hpp"
+#include "book.hpp"
+#include "chunk.hpp"
 #include "gamestate.hpp"
 #include "fontstuff.hpp"
 #include "animator.hpp"
 #include "tile_anims.hpp"
+#include "metrics.hpp"
+#include "replay.hpp"
+#include "scenario.hpp"
 
 #define KING_OF_THE_HILL_LIMIT 50
 
@@ -26,23 +36,61 @@ static tile_coord_fn tile_coord_fns[] = {
 	&GameState::tile_nw_of,
 };
 
-Server::Server(uint16_t port, const std::string &s) :
-	game_state(0), acceptor(io_service), worm_timer(io_service)
+static google::protobuf::ArenaOptions arena_options(std::vector<char> &block)
 {
-	map_name = s;
-	game_state = new ServerGameState(*this);
-	game_state->load_file("scenario/" + s);
-
-	idcounter = 0;
-
-	turn = clients.end();
-	state = LOBBY;
+	google::protobuf::ArenaOptions options;
+	options.initial_block = &block[0];
+	options.initial_block_size = block.size();
+	return options;
+}
 
-	pspawn_turns = 1;
-	pspawn_num = 1;
+// Room joined by an INIT without a room name.
+static const char *DEFAULT_ROOM = "default";
+
+static Metrics::Counter accepts("accepts");
+static Metrics::Counter accept_errors("accept_errors");
+static Metrics::Counter messages_in("messages_in");
+static Metrics::Counter bytes_in("bytes_in");
+static Metrics::Histogram parse_time("parse", "us");
+static Metrics::MessageHistograms lobby_handlers("lobby");
+static Metrics::MessageHistograms game_handlers("game");
+static Metrics::Histogram next_turn_time("NextTurn", "us");
+static Metrics::Histogram spawn_powers_time("SpawnPowers", "us");
+static Metrics::Histogram black_hole_time("black_hole_suck", "us");
+static Metrics::Histogram writeall_fanout("WriteAll.fanout", "clients");
+static Metrics::Histogram queue_frames("send_queue.frames", "frames");
+static Metrics::Histogram queue_bytes("send_queue.bytes", "bytes");
+// Deepest each client's send queue got, recorded when it goes away.
+static Metrics::Histogram queue_high_frames("send_queue.high_water.frames", "frames");
+static Metrics::Histogram queue_high_bytes("send_queue.high_water.bytes", "bytes");
+static Metrics::Counter frames_coalesced("frames_coalesced");
+static Metrics::Counter queue_full_disconnects("queue_full_disconnects");
+// Size of each message serialised, and of each frame queued to a client.
+static Metrics::MessageHistograms serialised_bytes("serialised", "bytes");
+static Metrics::MessageHistograms sent_bytes("sent", "bytes");
+static Metrics::Counter socket_writes("socket_writes");
+static Metrics::Counter frames_written("frames_written");
+static Metrics::Histogram ai_nodes("ai.nodes", "nodes");
+static Metrics::Counter ai_table_probes("ai_table_probes");
+static Metrics::Counter ai_table_hits("ai_table_hits");
+
+/* One transposition table for the AI in every room, made on the first
+ * search so a server without AI players doesn't pay for it. Keys include
+ * the board layout and the side to move, so games can share it.
+*/
+static boost::scoped_ptr<TranspositionTable> ai_table;
+static boost::once_flag ai_table_once = BOOST_ONCE_INIT;
+
+static void make_ai_table()
+{
+	ai_table.reset(new TranspositionTable(options.ai_hash_mb));
+}
 
-	fog_of_war = false;
-	king_of_the_hill = false;
+Server::Server(uint16_t port, const std::string &s) :
+	acceptor(io_service), metrics_timer(io_service), default_map(s)
+{
+	// Fail now rather than on the first INIT if the map is no good.
+	rooms[DEFAULT_ROOM].reset(new Room(io_service, this, DEFAULT_ROOM, default_map));
 
 	boost::asio::ip::tcp::endpoint endpoint(boost::asio::ip::tcp::v4(), port);
 
@@ -53,250 +101,1334 @@ Server::Server(uint16_t port, const std::string &s) :
 
 	StartAccept();
 
-	worker = boost::thread(boost::bind(&Server::worker_main, this));
+	if(options.metrics_interval) {
+		Metrics::enabled = true;
+		metrics_timer.expires_from_now(boost::posix_time::seconds(options.metrics_interval));
+		metrics_timer.async_wait(boost::bind(&Server::dump_metrics, this, boost::asio::placeholders::error));
+	}
+
+	unsigned int threads = options.server_threads;
+	if(!threads) {
+		threads = std::max(boost::thread::hardware_concurrency(), 1U);
+	}
+	for(unsigned int i = 0; i < threads; ++i) {
+		workers.create_thread(boost::bind(&Server::worker_main, this));
+	}
 }
 
 Server::~Server() {
 	io_service.stop();
 
-	std::cout << "Waiting for server thread to exit..." << std::endl;
-	worker.join();
+	std::cout << "Waiting for server threads to exit..." << std::endl;
+	workers.join_all();
 
-	delete game_state;
+	for(room_map::iterator r = rooms.begin(); r != rooms.end(); ++r) {
+		r->second->close();
+	}
+
+	if(Metrics::enabled) {
+		Metrics::dump(options.metrics_file);
+	}
 }
 
 void Server::worker_main() {
 	io_service.run();
 }
 
+void Server::dump_metrics(const boost::system::error_code &error) {
+	if(error) {
+		return;
+	}
+
+	Metrics::dump(options.metrics_file);
+
+	metrics_timer.expires_from_now(boost::posix_time::seconds(options.metrics_interval));
+	metrics_timer.async_wait(boost::bind(&Server::dump_metrics, this, boost::asio::placeholders::error));
+}
+
 void Server::StartAccept(void) {
-	boost::shared_ptr<Server::Client> client(new Server::Client(io_service, *this));
+	boost::shared_ptr<Room::Client> client(new Room::Client(io_service, *this));
 
 	acceptor.async_accept(client->socket, boost::bind(&Server::HandleAccept, this, client, boost::asio::placeholders::error));
 }
 
-void Server::HandleAccept(Server::Client::ptr client, const boost::system::error_code& err) {
+void Server::HandleAccept(Room::Client::ptr client, const boost::system::error_code& err) {
 	if(err) {
 		if(err.value() == boost::asio::error::operation_aborted) {
 			return;
 		}
 
+		accept_errors.add();
+
 		throw std::runtime_error("Accept error: " + err.message());
 	}
 
+	accepts.add();
+
 	StartAccept();
 
-	if(state == GAME) {
-		protocol::message qmsg;
-		qmsg.set_msg(protocol::QUIT);
-		qmsg.set_quit_msg("Game already in progress");
+	client->BeginRead();
+}
+
+/* Runs on whichever thread read the message. A client that hasn't joined a
+ * room has at most one read or write outstanding, so nothing else touches
+ * it meanwhile.
+*/
+bool Server::HandleMessage(Room::Client::ptr client, const protocol::message &msg) {
+	if(msg.msg() == protocol::ROOMS) {
+		protocol::message reply;
+		reply.set_msg(protocol::ROOMS);
+		{
+			boost::unique_lock<boost::mutex> lock(rooms_mutex);
+			for(room_map::iterator r = rooms.begin(); r != rooms.end(); ++r) {
+				r->second->describe(*reply.add_rooms());
+			}
+		}
+
+		// A full server's list doesn't fit in one frame. Read the next
+		// message once the last of it has been sent.
+		std::vector<protocol::message> chunks;
+		chunk_message(reply, chunks);
+		for(size_t i = 0; i + 1 < chunks.size(); ++i) {
+			client->Write(chunks[i]);
+		}
+		client->Write(chunks.back(), &Room::Client::FinishRoomList);
+		return false;
+	}
+
+	if(msg.msg() == protocol::WATCH) {
+		boost::shared_ptr<Room> room;
+		{
+			boost::unique_lock<boost::mutex> lock(rooms_mutex);
+			room_map::iterator r = rooms.find(msg.has_room() ? msg.room() : DEFAULT_ROOM);
+			if(r != rooms.end()) {
+				room = r->second;
+			}
+		}
+
+		if(!room) {
+			client->Quit("No such room");
+			return false;
+		}
+
+		room->strand.dispatch(boost::bind(&Server::WatchRoom, this, room, client));
+		return false;
+	}
+
+	if(msg.msg() != protocol::INIT) {
+		client->Quit("Expected INIT");
+		return false;
+	}
+
+	if(msg.has_session()) {
+		boost::shared_ptr<Room> room;
+		{
+			boost::unique_lock<boost::mutex> lock(rooms_mutex);
+			room_map::iterator r = rooms.find(msg.has_room() ? msg.room() : DEFAULT_ROOM);
+			if(r != rooms.end()) {
+				room = r->second;
+			}
+		}
+
+		if(!room) {
+			client->Quit("No such session");
+			return false;
+		}
+
+		room->strand.dispatch(boost::bind(&Server::ResumeRoom, this, room, client, msg));
+		return false;
+	}
+
+	std::string name = msg.has_room() ? msg.room() : DEFAULT_ROOM;
+	if(name.size() > MAX_ROOM_NAME) {
+		client->Quit("Room name too long");
+		return false;
+	}
+
+	boost::shared_ptr<Room> room;
+	bool full;
+
+	{
+		boost::unique_lock<boost::mutex> lock(rooms_mutex);
+
+		room_map::iterator r = rooms.find(name);
+		if(r != rooms.end()) {
+			room = r->second;
+		}
+		full = rooms.size() >= MAX_ROOMS;
+	}
+
+	if(!room) {
+		if(full) {
+			client->Quit("Too many rooms");
+			return false;
+		}
+
+		// Loading the scenario can mean reading it from disk, so the room
+		// is made without holding up everyone else looking for theirs.
+		boost::shared_ptr<Room> created;
+		try {
+			created.reset(new Room(io_service, this, name, msg.has_map_name() ? msg.map_name() : default_map));
+		} catch(std::exception &e) {
+			std::cerr << "Failed to create room '" << name << "': " << e.what() << std::endl;
+			client->Quit("Failed to create room");
+			return false;
+		}
+
+		boost::unique_lock<boost::mutex> lock(rooms_mutex);
+
+		// Someone else may have made it, or filled the last slot, meanwhile.
+		room_map::iterator r = rooms.find(name);
+		if(r != rooms.end()) {
+			room = r->second;
+		}else if(rooms.size() < MAX_ROOMS) {
+			room = created;
+			rooms.insert(std::make_pair(name, room));
+		}else{
+			lock.unlock();
+			client->Quit("Too many rooms");
+			return false;
+		}
+	}
+
+	room->strand.dispatch(boost::bind(&Server::JoinRoom, this, room, client, msg));
+	return false;
+}
+
+void Server::JoinRoom(boost::shared_ptr<Room> room, Room::Client::ptr client, const protocol::message &init) {
+	if(room->closed) {
+		// Dropped before the client got in, try again with a new one.
+		if(HandleMessage(client, init)) {
+			client->BeginRead();
+		}
+		return;
+	}
+
+	if(room->state == Room::GAME) {
+		client->Quit("Game already in progress");
+		return;
+	}
+
+	room->join(client);
+	if(room->HandleMessage(client, init)) {
+		client->BeginRead();
+	}
+}
+
+void Server::WatchRoom(boost::shared_ptr<Room> room, Room::Client::ptr client) {
+	if(room->closed) {
+		client->Quit("No such room");
+		return;
+	}
 
-		client->Write(qmsg, &Server::Client::FinishQuit);
+	room->subscribe(client);
+	client->BeginRead();
+}
+
+void Server::ResumeRoom(boost::shared_ptr<Room> room, Room::Client::ptr client, const protocol::message &init) {
+	if(room->closed || !room->resume(client, init)) {
+		client->Quit("No such session");
+		return;
+	}
+
+	client->BeginRead();
+}
 
+void Server::close_room(boost::shared_ptr<Room> room) {
+	if(room->closed || !room->empty()) {
 		return;
 	}
 
-	std::pair<client_set::iterator,bool> ir;
+	{
+		boost::unique_lock<boost::mutex> lock(rooms_mutex);
+
+		room_map::iterator r = rooms.find(room->name);
+		if(r != rooms.end() && r->second == room) {
+			rooms.erase(r);
+		}
+	}
+
+	room->close();
+}
+
+Room::Room(boost::asio::io_service &io_service, Server *host, const std::string &name, const std::string &s) :
+	game_state(0), host(host), name(name), io_service(io_service), strand(io_service),
+	closed(false),
+	arena_block(ARENA_BLOCK_SIZE), arena(arena_options(arena_block))
+{
+	map_name = s;
+	game_state = new ServerGameState(*this);
+	try {
+		Scenarios::load(*game_state, s);
+	} catch(...) {
+		// The name comes from the client, don't leak a board for every bad one.
+		delete game_state;
+		throw;
+	}
+
+	idcounter = 0;
+	seq = 0;
+
+	batch_depth = 0;
+
+	turn = clients.end();
+	state = LOBBY;
+
+	pspawn_turns = 1;
+	pspawn_num = 1;
+
+	fog_of_war = false;
+	king_of_the_hill = false;
+
+	update_info();
+}
+
+Room::~Room() {
+	delete game_state;
+}
 
+void Room::join(Room::Client::ptr client) {
+	client->room = shared_from_this();
+
+	// WATCHER_ID belongs to subscribers.
 	do {
 		client->id = idcounter++;
-		ir = clients.insert(client);
-	} while(!ir.second);
+	} while(client->id == WATCHER_ID || !clients.insert(client).second);
 
-	client->BeginRead();
+	update_info();
+}
+
+bool Room::empty() const {
+	for(client_set::const_iterator c = clients.begin(); c != clients.end(); ++c) {
+		if(dynamic_cast<Client *>(c->get())) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/* The AI players hold a reference to the room, the room goes away once
+ * they have let go.
+*/
+void Room::close() {
+	closed = true;
+
+	replay.reset();
+
+	std::vector<Client::ptr> s(subscribers);
+	for(std::vector<Client::ptr>::iterator i = s.begin(); i != s.end(); ++i) {
+		(*i)->Quit("Room closed");
+	}
+
+	for(client_set::iterator c = clients.begin(); c != clients.end(); ++c) {
+		if(Client *client = dynamic_cast<Client *>(c->get())) {
+			client->resume_timer.cancel();
+		}
+	}
+
+	state = LOBBY;
+	clients.clear();
+	turn = clients.end();
+}
+
+void Room::start_replay(uint64_t board_hash) {
+	if(!host || options.replay_dir.empty()) {
+		return;
+	}
+
+	protocol::replay_record header;
+	header.set_map_name(map_name);
+	header.set_scenario_hash(board_hash);
+	header.set_seed(game_state->seed);
+	header.set_fog_of_war(fog_of_war);
+	header.set_king_of_the_hill(king_of_the_hill);
+	header.set_start_time(time(NULL));
+
+	for(client_set::iterator c = clients.begin(); c != clients.end(); ++c) {
+		protocol::player *p = header.add_players();
+		p->set_id((*c)->id);
+		p->set_name((*c)->playername);
+		p->set_colour((protocol::colour)(*c)->colour);
+	}
+
+	// The room name comes from a client, keep it out of the path.
+	std::string safe_name;
+	for(size_t i = 0; i < name.size() && i < 64; ++i) {
+		safe_name += isalnum((unsigned char)name[i]) || name[i] == '-' || name[i] == '_' ? name[i] : '_';
+	}
+
+	time_t now = time(NULL);
+	struct tm tm;
+	char when[32], seed[16];
+	strftime(when, sizeof(when), "%Y%m%d-%H%M%S", localtime_r(&now, &tm));
+	snprintf(seed, sizeof(seed), "%08x", game_state->seed);
+
+	std::string filename = options.replay_dir + "/" + safe_name + "-" + when + "-" + seed + ".hrr";
+	replay.reset(new ReplayLog(host->replays, filename, header));
+}
+
+void Room::update_info() {
+	int players = 0;
+	for(client_set::const_iterator c = clients.begin(); c != clients.end(); ++c) {
+		if(dynamic_cast<Client *>(c->get())) {
+			++players;
+		}
+	}
+
+	boost::unique_lock<boost::mutex> lock(info_mutex);
+	info.set_name(name);
+	info.set_map_name(map_name);
+	info.set_players(players);
+	info.set_in_game(state == GAME);
+}
+
+void Room::describe(protocol::room &r) const {
+	boost::unique_lock<boost::mutex> lock(info_mutex);
+	r.CopyFrom(info);
+}
+
+void Room::snapshot(std::vector<protocol::message> &out, uint16_t viewer) const {
+	protocol::message ginfo;
+	ginfo.set_msg(protocol::GINFO);
+	ginfo.set_player_id(viewer);
+	ginfo.set_map_name(map_name);
+	ginfo.set_room(name);
+	ginfo.set_fog_of_war(fog_of_war);
+	ginfo.set_king_of_the_hill(king_of_the_hill);
+
+	protocol::message scores;
+	scores.set_msg(protocol::SCORE_UPDATE);
+
+	bool listed = false;
+	for(client_set::const_iterator c = clients.begin(); c != clients.end(); ++c) {
+		protocol::player *p = ginfo.add_players();
+		p->set_id((*c)->id);
+		p->set_name((*c)->playername);
+		p->set_colour((protocol::colour)(*c)->colour);
+
+		p = scores.add_players();
+		p->set_id((*c)->id);
+		p->set_score((*c)->score);
+
+		listed |= (*c)->id == viewer;
+	}
+
+	if(!listed) {
+		protocol::player *p = ginfo.add_players();
+		p->set_id(viewer);
+		p->set_name("Spectator");
+		p->set_colour(protocol::SPECTATE);
+	}
+
+	out.push_back(ginfo);
+
+	if(state != GAME) {
+		return;
+	}
+
+	protocol::message begin;
+	begin.set_msg(protocol::BEGIN);
+	game_state->serialize_packed(begin);
+	chunk_message(begin, out);
+
+	if(king_of_the_hill) {
+		out.push_back(scores);
+	}
+
+	if(turn != clients.end()) {
+		protocol::message tmsg;
+		tmsg.set_msg(protocol::TURN);
+		tmsg.set_player_id((*turn)->id);
+		out.push_back(tmsg);
+	}
+}
+
+void Room::subscribe(Client::ptr client) {
+	client->room = shared_from_this();
+	client->id = WATCHER_ID;
+	client->colour = SPECTATE;
+
+	subscribers.push_back(client);
+
+	send_snapshot(client);
+}
+
+void Room::send_snapshot(Client::ptr client) {
+	std::vector<protocol::message> msgs;
+	snapshot(msgs, WATCHER_ID);
+
+	// Not batched, so the relay can tell the snapshot from what follows.
+	for(std::vector<protocol::message>::iterator m = msgs.begin(); m != msgs.end(); ++m) {
+		m->set_snapshot(true);
+		client->Write(*m, serialise(*m));
+	}
+}
+
+bool Room::unsubscribe(base_client *client) {
+	for(std::vector<Client::ptr>::iterator s = subscribers.begin(); s != subscribers.end(); ++s) {
+		if(s->get() == client) {
+			subscribers.erase(s);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+std::string Room::new_session() {
+	std::string session(16, '\0');
+
+	std::ifstream random("/dev/urandom", std::ios::binary);
+	if(!random.read(&session[0], session.size())) {
+		for(size_t i = 0; i < session.size(); ++i) {
+			session[i] = rand();
+		}
+	}
+
+	return session;
+}
+
+bool Room::resume(Client::ptr client, const protocol::message &init) {
+	if(state != GAME) {
+		return false;
+	}
+
+	client_iterator seat = clients.begin();
+	for(; seat != clients.end(); ++seat) {
+		Client *c = dynamic_cast<Client *>(seat->get());
+		if(c && !c->qcalled && !c->session.empty() && c->session == init.session()) {
+			break;
+		}
+	}
+
+	if(seat == clients.end()) {
+		return false;
+	}
+
+	Client::ptr old = boost::static_pointer_cast<Client>(*seat);
+
+	// The old connection might not have noticed it is gone yet.
+	old->qcalled = true;
+	old->resume_timer.cancel();
+
+	boost::system::error_code ec;
+	old->socket.close(ec);
+
+	client->room = shared_from_this();
+	client->id = old->id;
+	client->playername = old->playername;
+	client->colour = old->colour;
+	client->score = old->score;
+	client->session = old->session;
+	client->sent.swap(old->sent);
+	client->sent_floor = old->sent_floor;
+
+	bool their_turn = turn == seat;
+	clients.erase(seat);
+	client_iterator now = clients.insert(client).first;
+	if(their_turn) {
+		turn = now;
+	}
+
+	fprintf(stderr, "%s is back\n", client->playername.c_str());
+
+	if(init.has_seq() && init.seq() >= client->sent_floor) {
+		for(std::deque<send_buf>::iterator f = client->sent.begin(); f != client->sent.end(); ++f) {
+			if(f->seq > init.seq()) {
+				client->Send(*f, &Client::FinishWrite);
+			}
+		}
+	}else{
+		std::vector<protocol::message> msgs;
+		snapshot(msgs, client->id);
+		msgs[0].set_session(client->session);
+
+		for(std::vector<protocol::message>::iterator m = msgs.begin(); m != msgs.end(); ++m) {
+			client->Write(*m, serialise(*m));
+		}
+	}
+
+	return true;
+}
+
+Room::base_client::~base_client()
+{
 }
 
-Server::base_client::~base_client()
+void Room::base_client::ai_think()
 {
 }
 
-void Server::base_client::ai_think()
+void Room::base_client::Write(const protocol::message &)
+{
+}
+
+void Room::base_client::Write(const protocol::message &msg, const send_buf &)
+{
+	Write(msg);
+}
+
+void Room::Client::BeginRead() {
+	boost::asio::mutable_buffers_1 buf = boost::asio::buffer(&msgsize, sizeof(uint32_t));
+
+	if(room) {
+		async_read(socket, buf, room->strand.wrap(boost::bind(&Room::Client::BeginRead2, this, boost::asio::placeholders::error, shared_from_this())));
+	}else{
+		async_read(socket, buf, boost::bind(&Room::Client::BeginRead2, this, boost::asio::placeholders::error, shared_from_this()));
+	}
+}
+
+void Room::Client::BeginRead2(const boost::system::error_code& error, ptr /*cptr*/) {
+	if(qcalled) {
+		return;
+	}
+
+	if(error) {
+		Disconnect("Read error: " + error.message());
+		return;
+	}
+
+	msgsize = ntohl(msgsize);
+
+	if(msgsize > MAX_MSGSIZE) {
+		Quit("Oversized message");
+		return;
+	}
+
+	msgbuf.resize(msgsize);
+	boost::asio::mutable_buffers_1 buf = boost::asio::buffer(&(msgbuf[0]), msgsize);
+
+	if(room) {
+		async_read(socket, buf, room->strand.wrap(boost::bind(&Room::Client::FinishRead, this, boost::asio::placeholders::error, shared_from_this())));
+	}else{
+		async_read(socket, buf, boost::bind(&Room::Client::FinishRead, this, boost::asio::placeholders::error, shared_from_this()));
+	}
+}
+
+void Room::Client::FinishRead(const boost::system::error_code& error, ptr /*cptr*/) {
+	if(qcalled) {
+		return;
+	}
+
+	if(error) {
+		Disconnect("Read error: " + error.message());
+		return;
+	}
+
+	messages_in.add();
+	bytes_in.add(msgsize);
+
+	bool parsed;
+	{
+		Metrics::Timer timer(parse_time);
+		parsed = msgin.ParseFromArray(msgsize ? &msgbuf[0] : NULL, msgsize);
+	}
+
+	if(!parsed) {
+		Quit("Invalid message recieved");
+		return;
+	}
+
+	if(room ? room->HandleMessage(shared_from_this(), msgin) : host.HandleMessage(shared_from_this(), msgin)) {
+		BeginRead();
+	}
+}
+
+bool Room::HandleMessage(Room::Client::ptr client, const protocol::message &msg) {
+	if(client->id == WATCHER_ID) {
+		// Subscribers can only ask to start over.
+		if(msg.msg() == protocol::WATCH) {
+			send_snapshot(client);
+		}
+		return true;
+	}
+
+	// Everything sent while handling a message goes out as one batch.
+	batch_scope scope(*this);
+
+	if(msg.msg() == protocol::CHAT) {
+		protocol::message chat;
+		chat.set_msg(protocol::CHAT);
+		chat.set_msgtext(msg.msgtext());
+		chat.set_player_id(client->id);
+
+		WriteAll(chat);
+
+		return true;
+	}
+
+	if(state == LOBBY) {
+		return handle_msg_lobby(client, msg);
+	}else{
+		return handle_msg_game(client, msg);
+	}
+}
+
+void Room::Client::Write(const protocol::message &msg) {
+	if(room && room->batch_write(msg, this)) {
+		return;
+	}
+
+	Write(msg, room ? room->serialise(msg) : send_buf(msg), &Client::FinishWrite);
+}
+
+void Room::Client::Write(const protocol::message &msg, const send_buf &frame) {
+	Write(msg, frame, &Client::FinishWrite);
+}
+
+void Room::Client::Write(const protocol::message &msg, write_cb callback) {
+	Write(msg, room ? room->serialise(msg) : send_buf(msg), callback);
+}
+
+void Room::Client::Write(const protocol::message &msg, const send_buf &frame, write_cb callback) {
+	// Kept for a resume even when it can't be sent now.
+	if(frame.seq) {
+		remember(frame);
+	}
+	if(detached || queue_full) {
+		return;
+	}
+
+	sent_bytes[msg.msg()].record(frame.size);
+
+	Send(frame, callback);
+}
+
+void Room::Client::Send(const send_buf &frame, write_cb callback) {
+	send_queue.push_back(server_send_buf(frame, callback));
+	queued_bytes += frame.size;
+
+	max_queued_bytes = std::max(max_queued_bytes, queued_bytes);
+	max_queued_frames = std::max(max_queued_frames, send_queue.size());
+
+	queue_frames.record(send_queue.size());
+	queue_bytes.record(queued_bytes);
+
+	if(over_limit()) {
+		check_queue();
+	}
+
+	if(!write_batch) {
+		StartWrite();
+	}
+}
+
+bool Room::Client::over_limit(unsigned int factor) const {
+	return queued_bytes > (size_t)options.send_queue_kb * 1024 * factor ||
+		send_queue.size() > (size_t)options.send_queue_frames * factor;
+}
+
+void Room::Client::check_queue() {
+	time_t now = time(NULL);
+
+	// Coalescing unpacks the whole queue, so only do it once each time
+	// the client falls behind.
+	if(!over_limit_since) {
+		over_limit_since = now;
+		coalesce();
+		if(!over_limit()) {
+			return;
+		}
+	}
+
+	if(over_limit(2) || now - over_limit_since > (time_t)options.send_queue_grace) {
+		// Dropping the client can remove it from the set being written to,
+		// which might be happening right now.
+		queue_full = true;
+		if(room) {
+			room->strand.post(boost::bind(&Room::Client::QueueFull, this, shared_from_this()));
+		}else{
+			host.io_service.post(boost::bind(&Room::Client::QueueFull, this, shared_from_this()));
+		}
+	}
+}
+
+void Room::Client::QueueFull(ptr /*cptr*/) {
+	if(qcalled) {
+		return;
+	}
+
+	queue_full_disconnects.add();
+	fprintf(stderr, "Disconnecting %s, send queue at %u frames, %u bytes (most %u frames, %u bytes)\n",
+		playername.c_str(), (unsigned int)send_queue.size(), (unsigned int)queued_bytes,
+		(unsigned int)max_queued_frames, (unsigned int)max_queued_bytes);
+
+	// A slow link isn't a resignation, hold the seat like any other drop.
+	Disconnect("Send queue full", false);
+
+	boost::system::error_code ec;
+	socket.close(ec);
+}
+
+Room::Client::~Client() {
+	queue_high_frames.record(max_queued_frames);
+	queue_high_bytes.record(max_queued_bytes);
+}
+
+void Room::Client::remember(const send_buf &frame) {
+	sent.push_back(frame);
+
+	while(sent.size() > options.resume_frames) {
+		sent_floor = sent.front().seq;
+		sent.pop_front();
+	}
+}
+
+void Room::Client::Disconnect(const std::string &msg, bool send_to_client) {
+	if(!room || room->state != GAME || session.empty() || !options.resume_grace) {
+		Quit(msg, send_to_client);
+		return;
+	}
+
+	if(detached) {
+		return;
+	}
+
+	fprintf(stderr, "Holding the place of %s for %u seconds (%s)\n",
+		playername.c_str(), options.resume_grace, msg.c_str());
+
+	detached = true;
+
+	boost::system::error_code ec;
+	socket.close(ec);
+
+	resume_timer.expires_from_now(boost::posix_time::seconds(options.resume_grace));
+	resume_timer.async_wait(room->strand.wrap(boost::bind(&Room::Client::ResumeTimeout, this, boost::asio::placeholders::error, shared_from_this())));
+}
+
+void Room::Client::ResumeTimeout(const boost::system::error_code& error, ptr /*cptr*/) {
+	if(error || qcalled) {
+		return;
+	}
+
+	Quit("Connection lost", false);
+}
+
+void Room::base_client::WriteBasic(protocol::msgtype type) {
+	Write(*room->new_message(type));
+}
+
+/* Hand as much of the queue as allowed to a single write. A frame with its
+ * own callback (FinishQuit) ends the batch, and its callback is the one
+ * called when the batch completes.
+*/
+void Room::Client::StartWrite() {
+	std::vector<boost::asio::const_buffer> buffers;
+	write_cb callback = &Client::FinishWrite;
+	size_t bytes = 0;
+
+	for(std::deque<server_send_buf>::iterator i = send_queue.begin(); i != send_queue.end(); ++i) {
+		if(!buffers.empty() && (buffers.size() == MAX_WRITE_FRAMES || bytes + i->size > MAX_WRITE_BYTES)) {
+			break;
+		}
+
+		buffers.push_back(boost::asio::buffer(i->buf.get(), i->size));
+		bytes += i->size;
+
+		if(i->callback != &Client::FinishWrite) {
+			callback = i->callback;
+			break;
+		}
+	}
+
+	write_batch = buffers.size();
+	socket_writes.add();
+	frames_written.add(write_batch);
+
+	if(room) {
+		async_write(socket, buffers, room->strand.wrap(boost::bind(callback, this, boost::asio::placeholders::error, shared_from_this())));
+	}else{
+		async_write(socket, buffers, boost::bind(callback, this, boost::asio::placeholders::error, shared_from_this()));
+	}
+}
+
+void Room::Client::FinishWrite(const boost::system::error_code& error, ptr /*cptr*/) {
+	for(size_t i = 0; i < write_batch; ++i) {
+		queued_bytes -= send_queue[i].size;
+	}
+	send_queue.erase(send_queue.begin(), send_queue.begin() + write_batch);
+	write_batch = 0;
+
+	if(over_limit_since && !over_limit()) {
+		over_limit_since = 0;
+	}
+
+	if(qcalled) {
+		return;
+	}
+
+	if(error) {
+		Disconnect("Write error: " + error.message(), false);
+		return;
+	}
+
+	if(!send_queue.empty()) {
+		StartWrite();
+	}
+}
+
+void Room::StartGame(uint32_t seed) {
+	if(king_of_the_hill && game_state->hill_tiles().empty()) {
+		fprintf(stderr, "No hills on this map!\n");
+		return;
+	}
+
+	for(client_iterator c(clients.begin()); c != clients.end(); ++c) {
+		(*c)->score = 0;
+	}
+
+	std::set<PlayerColour> available_colours = game_state->colours();
+	std::set<PlayerColour> player_colours;
+
+	BOOST_FOREACH(boost::shared_ptr<base_client> c, clients) {
+		if(c->colour == SPECTATE) continue;
+		player_colours.insert(c->colour);
+	}
+
+	if(player_colours.size() <= 1) {
+		fprintf(stderr, "Too few players. Need at least two.\n");
+		return;
+	}
+
+	if(available_colours.size() < player_colours.size()) {
+		fprintf(stderr, "Too many teams for this map. This is a %u team map.\n", (unsigned int)available_colours.size());
+		return;
+	}
+
+	// Identifies the map in the game log, so taken before recolouring.
+	uint64_t board_hash;
+	{
+		protocol::message loaded;
+		game_state->serialize_packed(loaded);
+		board_hash = scenario_hash(loaded.board());
+	}
+
+	game_state->seed = seed;
+	game_state->rng.seed(seed);
+
+	pspawn_turns = 1;
+	pspawn_num = 1;
+
+	std::map<PlayerColour, PlayerColour> colour_map;
+	for(std::set<PlayerColour>::iterator i(available_colours.begin()), j(player_colours.begin());
+	    j != player_colours.end();
+	    ++i, ++j) {
+		colour_map.insert(std::make_pair(*i, *j));
+	}
+
+	// Remove unused teams before recolouring.
+	for(std::set<PlayerColour>::iterator i(available_colours.begin()); i != available_colours.end(); ++i) {
+		if(colour_map.find(*i) == colour_map.end()) {
+			game_state->destroy_team_pawns(*i);
+		}
+	}
+
+	game_state->recolour(colour_map);
+	game_state->evaluator.sync(*game_state);
+
+	for(int c = 0; c < SPECTATE; ++c) {
+		book_colours[c] = (PlayerColour)c;
+	}
+	for(std::map<PlayerColour, PlayerColour>::iterator i = colour_map.begin(); i != colour_map.end(); ++i) {
+		book_colours[i->second] = i->first;
+	}
+
+	try {
+		book = MoveBook::open("book/" + map_name + ".book");
+	} catch(std::exception &e) {
+		std::cerr << "Failed to load move book: " << e.what() << std::endl;
+		book.reset();
+	}
+
+	protocol::message begin;
+	begin.set_msg(protocol::BEGIN);
+	game_state->serialize_packed(begin);
+
+	// Clients get every field of every tile and pawn, updates from here on
+	// only need what changes.
+	for(Tile::List::iterator t = game_state->tiles.begin(); t != game_state->tiles.end(); ++t) {
+		(*t)->mark_sent();
+		if((*t)->pawn) {
+			(*t)->pawn->mark_sent();
+		}
+	}
+
+	// Large maps don't fit in one frame.
+	std::vector<protocol::message> chunks;
+	chunk_message(begin, chunks);
+	for(size_t i = 0; i < chunks.size(); ++i) {
+		WriteAll(chunks[i]);
+	}
+
+	state = GAME;
+	update_info();
+
+	start_replay(board_hash);
+
+	turn = clients.begin();
+	for(int i = game_state->rng() % clients.size(); i != 0; --i) {
+		++turn;
+	}
+
+	NextTurn();
+}
+
+void Room::WriteAll(const protocol::message &msg, Room::base_client *exempt) {
+	if(Metrics::enabled) {
+		unsigned int fanout = subscribers.size();
+		for(client_set::iterator i = clients.begin(); i != clients.end(); i++) {
+			if((*i).get() != exempt && (*i)->colour != NOINIT) {
+				fanout++;
+			}
+		}
+		writeall_fanout.record(fanout);
+	}
+
+	if(batch_write(msg, NULL, exempt)) {
+		return;
+	}
+
+	send_buf frame(serialise(msg));
+
+	for(client_set::iterator i = clients.begin(); i != clients.end(); i++) {
+		if((*i).get() != exempt && (*i)->colour != NOINIT) {
+			(*i)->Write(msg, frame);
+		}
+	}
+	for(std::vector<Client::ptr>::iterator s = subscribers.begin(); s != subscribers.end(); ++s) {
+		(*s)->Write(msg, frame);
+	}
+}
+
+void Room::begin_batch() {
+	batch_depth++;
+}
+
+// Merge the tiles and pawns of one UPDATE into another. Later fields
+// replace earlier ones, a complete power list replaces the old one.
+static void merge_updates(protocol::message &into, const protocol::message &from)
 {
+	for(int i = 0; i < from.tiles_size(); ++i) {
+		const protocol::tile &t = from.tiles(i);
+		int j = 0;
+		while(j < into.tiles_size() && (into.tiles(j).col() != t.col() || into.tiles(j).row() != t.row())) {
+			++j;
+		}
+
+		if(j < into.tiles_size()) {
+			into.mutable_tiles(j)->MergeFrom(t);
+		}else{
+			into.add_tiles()->CopyFrom(t);
+		}
+	}
+
+	for(int i = 0; i < from.pawns_size(); ++i) {
+		const protocol::pawn &p = from.pawns(i);
+		int j = 0;
+		while(j < into.pawns_size() && (into.pawns(j).col() != p.col() || into.pawns(j).row() != p.row())) {
+			++j;
+		}
+
+		if(j < into.pawns_size()) {
+			if(p.all_powers()) {
+				into.mutable_pawns(j)->clear_powers();
+			}
+			into.mutable_pawns(j)->MergeFrom(p);
+		}else{
+			into.add_pawns()->CopyFrom(p);
+		}
+	}
 }
 
-void Server::base_client::Write(const protocol::message &)
+// Merge the players of one SCORE_UPDATE into another.
+static void merge_scores(protocol::message &into, const protocol::message &from)
 {
-}
+	for(int i = 0; i < from.players_size(); ++i) {
+		const protocol::player &p = from.players(i);
+		int j = 0;
+		while(j < into.players_size() && into.players(j).id() != p.id()) {
+			++j;
+		}
 
-void Server::Client::BeginRead() {
-	async_read(socket, boost::asio::buffer(&msgsize, sizeof(uint32_t)), boost::bind(&Server::Client::BeginRead2, this, boost::asio::placeholders::error, shared_from_this()));
+		if(j < into.players_size()) {
+			into.mutable_players(j)->MergeFrom(p);
+		}else{
+			into.add_players()->CopyFrom(p);
+		}
+	}
 }
 
-void Server::Client::BeginRead2(const boost::system::error_code& error, ptr /*cptr*/) {
-	if(qcalled) {
-		return;
+/* Unpack the frames that aren't being written yet, merge consecutive
+ * UPDATEs and SCORE_UPDATEs, and pack the result back into as few frames
+ * as will fit. The client ends up in the same state without seeing each
+ * step on the way. Frames with their own callback (QUIT) are left alone,
+ * along with anything queued after them.
+*/
+void Room::Client::coalesce() {
+	std::deque<server_send_buf>::iterator begin = send_queue.begin() + write_batch, end = begin;
+	while(end != send_queue.end() && end->callback == &Client::FinishWrite) {
+		++end;
 	}
 
-	if(error) {
-		Quit("Read error: " + error.message());
+	if(end - begin < 2) {
 		return;
 	}
 
-	msgsize = ntohl(msgsize);
+	protocol::message all, msg;
+	size_t frames = 0;
+	for(std::deque<server_send_buf>::iterator f = begin; f != end; ++f, ++frames) {
+		if(!msg.ParseFromArray(f->buf.get() + sizeof(uint32_t), f->size - sizeof(uint32_t))) {
+			return;
+		}
 
-	if(msgsize > MAX_MSGSIZE) {
-		Quit("Oversized message");
-		return;
+		int n = msg.msg() == protocol::BATCH ? msg.batch_size() : 1;
+		for(int i = 0; i < n; ++i) {
+			protocol::message *m = msg.msg() == protocol::BATCH ? msg.mutable_batch(i) : &msg;
+			protocol::message *last = all.batch_size() ? all.mutable_batch(all.batch_size() - 1) : NULL;
+
+			if(last && last->msg() == protocol::UPDATE && m->msg() == protocol::UPDATE) {
+				merge_updates(*last, *m);
+			}else if(last && last->msg() == protocol::SCORE_UPDATE && m->msg() == protocol::SCORE_UPDATE) {
+				merge_scores(*last, *m);
+			}else{
+				all.add_batch()->Swap(m);
+			}
+		}
 	}
 
-	msgbuf.resize(msgsize);
-	async_read(socket, boost::asio::buffer(&(msgbuf[0]), msgsize), boost::bind(&Server::Client::FinishRead, this, boost::asio::placeholders::error, shared_from_this()));
-}
+	// Only the last frame gets a seq, as a frame can't be sent again once
+	// its contents are spread over others. A client that doesn't get that
+	// far needs a snapshot to come back.
+	uint32_t last_seq = (end - 1)->seq;
 
-void Server::Client::FinishRead(const boost::system::error_code& error, ptr /*cptr*/) {
-	if(qcalled) {
-		return;
-	}
+	std::vector<server_send_buf> packed;
+	protocol::message group;
+	group.set_msg(protocol::BATCH);
+	size_t bytes = 0;
+	for(int i = 0; i <= all.batch_size(); ++i) {
+		size_t size = i < all.batch_size() ? all.batch(i).ByteSizeLong() + 4 : 0;
 
-	if(error) {
-		Quit("Read error: " + error.message());
-		return;
-	}
+		// Merging made a message too big for a frame, leave the queue as it is.
+		if(size > MAX_MSGSIZE - FRAME_HEADROOM) {
+			return;
+		}
 
-	std::string msgstring(msgbuf.begin(), msgbuf.end());
+		if(group.batch_size() && (i == all.batch_size() || bytes + size > MAX_MSGSIZE - FRAME_HEADROOM)) {
+			const protocol::message &m = group.batch_size() == 1 ? group.batch(0) : group;
+			packed.push_back(server_send_buf(send_buf(m, i == all.batch_size() ? last_seq : 0), &Client::FinishWrite));
+			group.clear_batch();
+			bytes = 0;
+		}
 
-	protocol::message msg;
-	if(!msg.ParseFromString(msgstring)) {
-		Quit("Invalid message recieved");
-		return;
+		if(i < all.batch_size()) {
+			group.add_batch()->Swap(all.mutable_batch(i));
+			bytes += size;
+		}
 	}
 
-	if(server.HandleMessage(shared_from_this(), msg)) {
-		BeginRead();
+	if(packed.size() >= frames) {
+		return;
 	}
-}
-
-bool Server::HandleMessage(Server::Client::ptr client, const protocol::message &msg) {
-	if(msg.msg() == protocol::CHAT) {
-		protocol::message chat;
-		chat.set_msgtext(msg.msgtext());
-		chat.set_player_id(client->id);
 
-		WriteAll(chat);
+	sent_floor = std::max(sent_floor, last_seq);
 
-		return true;
+	for(std::deque<server_send_buf>::iterator f = begin; f != end; ++f) {
+		queued_bytes -= f->size;
 	}
-
-	if(state == LOBBY) {
-		return handle_msg_lobby(client, msg);
-	}else{
-		return handle_msg_game(client, msg);
+	for(size_t i = 0; i < packed.size(); ++i) {
+		queued_bytes += packed[i].size;
 	}
-}
-
-void Server::Client::Write(const protocol::message &msg) {
-	Write(msg, &Client::FinishWrite);
-}
 
-void Server::Client::Write(const protocol::message &msg, write_cb callback) {
-	send_queue.push(server_send_buf(msg));
-	send_queue.back().callback = callback;
+	frames_coalesced.add(frames - packed.size());
 
-	if(send_queue.size() == 1) {
-		async_write(socket, boost::asio::buffer(send_queue.front().buf.get(), send_queue.front().size), boost::bind(send_queue.front().callback, this, boost::asio::placeholders::error, shared_from_this()));
-	}
+	begin = send_queue.erase(begin, end);
+	send_queue.insert(begin, packed.begin(), packed.end());
 }
 
-void Server::base_client::WriteBasic(protocol::msgtype type) {
-	protocol::message msg;
-	msg.set_msg(type);
-
-	Write(msg);
+protocol::message *Room::new_message(protocol::msgtype type) {
+	protocol::message *msg = google::protobuf::Arena::CreateMessage<protocol::message>(&arena);
+	msg->set_msg(type);
+	return msg;
 }
 
-void Server::Client::FinishWrite(const boost::system::error_code& error, ptr /*cptr*/) {
-	send_queue.pop();
-
-	if(qcalled) {
-		return;
+bool Room::batch_write(const protocol::message &msg, base_client *to, base_client *exempt) {
+	if(!batch_depth) {
+		return false;
 	}
 
-	if(error) {
-		Quit("Write error: " + error.message(), false);
-		return;
+	if(msg.msg() == protocol::UPDATE && !batch.empty()) {
+		batch_entry &last = batch.back();
+		if(last.msg->msg() == protocol::UPDATE && last.to == to && last.exempt == exempt) {
+			merge_updates(*last.msg, msg);
+			return true;
+		}
 	}
 
-	if(!send_queue.empty()) {
-		async_write(socket, boost::asio::buffer(send_queue.front().buf.get(), send_queue.front().size), boost::bind(send_queue.front().callback, this, boost::asio::placeholders::error, shared_from_this()));
+	batch_entry e;
+	if(msg.GetArena() == &arena) {
+		// Built for this batch and not touched again by the caller.
+		e.msg = const_cast<protocol::message *>(&msg);
+	}else{
+		e.msg = google::protobuf::Arena::CreateMessage<protocol::message>(&arena);
+		e.msg->CopyFrom(msg);
 	}
+	e.to = to;
+	e.exempt = exempt;
+	batch.push_back(e);
+
+	return true;
 }
 
-void Server::StartGame(void) {
-	if(king_of_the_hill && game_state->hill_tiles().empty()) {
-		fprintf(stderr, "No hills on this map!\n");
+// A message to send at the end of a batch and its frame, serialised when
+// first needed.
+struct batch_frame {
+	protocol::message *msg;
+	bool oversized; // A lone entry too big for a frame, sent in CHUNKs.
+	std::vector<send_buf> frames;
+
+	batch_frame(protocol::message *msg, bool oversized = false) : msg(msg), oversized(oversized) {}
+};
+
+/* Each client gets the entries addressed to it. Most entries go to every
+ * client, so clients that get the same set of entries share the same
+ * frames. Entries are split over several BATCH messages if they don't
+ * fit in one frame, and a lone entry is sent as it is, in CHUNKs if it is
+ * too big for a frame by itself (a large merged UPDATE).
+ *
+ * The BATCH messages point at the entries rather than copying them, which
+ * is fine as everything is on the arena and freed together.
+*/
+void Room::end_batch() {
+	assert(batch_depth > 0);
+	if(--batch_depth) {
 		return;
 	}
 
-	for(client_iterator c(clients.begin()); c != clients.end(); ++c) {
-		(*c)->score = 0;
+	std::vector<batch_entry> entries;
+	entries.swap(batch);
+
+	std::vector<size_t> sizes(entries.size());
+	for(size_t i = 0; i < entries.size(); ++i) {
+		// Tag and length in the BATCH message.
+		sizes[i] = entries[i].msg->ByteSizeLong() + 4;
 	}
 
-	std::set<PlayerColour> available_colours = game_state->colours();
-	std::set<PlayerColour> player_colours;
+	typedef std::map<std::vector<bool>, std::vector<batch_frame> > frame_map;
+	frame_map frames;
 
-	BOOST_FOREACH(boost::shared_ptr<base_client> c, clients) {
-		if(c->colour == SPECTATE) continue;
-		player_colours.insert(c->colour);
+	// Subscribers last, they get what every spectator gets.
+	std::vector<base_client *> recipients;
+	for(client_set::iterator c = clients.begin(); c != clients.end(); ++c) {
+		recipients.push_back(c->get());
 	}
-
-	if(player_colours.size() <= 1) {
-		fprintf(stderr, "Too few players. Need at least two.\n");
-		return;
+	for(std::vector<Client::ptr>::iterator s = subscribers.begin(); s != subscribers.end(); ++s) {
+		recipients.push_back(s->get());
 	}
 
-	if(available_colours.size() < player_colours.size()) {
-		fprintf(stderr, "Too many teams for this map. This is a %u team map.\n", (unsigned int)available_colours.size());
-		return;
-	}
+	for(std::vector<base_client *>::iterator c = recipients.begin(); c != recipients.end(); ++c) {
+		base_client *client = *c;
 
-	std::map<PlayerColour, PlayerColour> colour_map;
-	for(std::set<PlayerColour>::iterator i(available_colours.begin()), j(player_colours.begin());
-	    j != player_colours.end();
-	    ++i, ++j) {
-		colour_map.insert(std::make_pair(*i, *j));
-	}
+		std::vector<bool> wanted(entries.size());
+		bool any = false;
+		for(size_t i = 0; i < entries.size(); ++i) {
+			const batch_entry &e = entries[i];
+			wanted[i] = e.to ? e.to == client : (e.exempt != client && client->colour != NOINIT);
+			any |= wanted[i];
+		}
 
-	// Remove unused teams before recolouring.
-	for(std::set<PlayerColour>::iterator i(available_colours.begin()); i != available_colours.end(); ++i) {
-		if(colour_map.find(*i) == colour_map.end()) {
-			game_state->destroy_team_pawns(*i);
+		if(!any) {
+			continue;
 		}
-	}
 
-	game_state->recolour(colour_map);
+		frame_map::iterator f = frames.find(wanted);
+		if(f == frames.end()) {
+			f = frames.insert(std::make_pair(wanted, std::vector<batch_frame>())).first;
 
-	doing_worm_stuff = false;
+			std::vector<size_t> group;
+			size_t bytes = 0;
+			for(size_t i = 0; i <= entries.size(); ++i) {
+				if(i < entries.size() && !wanted[i]) {
+					continue;
+				}
 
-	protocol::message begin;
-	begin.set_msg(protocol::BEGIN);
-	game_state->serialize(begin);
-	WriteAll(begin);
+				if(!group.empty() && (i == entries.size() || bytes + sizes[i] > MAX_MSGSIZE - FRAME_HEADROOM)) {
+					if(group.size() == 1) {
+						f->second.push_back(batch_frame(entries[group[0]].msg, bytes > MAX_MSGSIZE - FRAME_HEADROOM));
+					}else{
+						protocol::message *msg = new_message(protocol::BATCH);
+						for(size_t g = 0; g < group.size(); ++g) {
+							msg->mutable_batch()->UnsafeArenaAddAllocated(entries[group[g]].msg);
+						}
+						f->second.push_back(batch_frame(msg));
+					}
 
-	state = GAME;
+					group.clear();
+					bytes = 0;
+				}
 
-	turn = clients.begin();
-	for(int i = rand() % clients.size(); i != 0; --i) {
-		++turn;
+				if(i < entries.size()) {
+					group.push_back(i);
+					bytes += sizes[i];
+				}
+			}
+		}
+
+		for(std::vector<batch_frame>::iterator b = f->second.begin(); b != f->second.end(); ++b) {
+			// AI players take the message as it is, don't serialise for them.
+			if(!dynamic_cast<Client *>(client)) {
+				client->Write(*b->msg);
+				continue;
+			}
+
+			if(b->frames.empty()) {
+				if(b->oversized) {
+					std::vector<protocol::message> chunks;
+					chunk_message(*b->msg, chunks);
+					for(size_t c = 0; c < chunks.size(); ++c) {
+						b->frames.push_back(serialise(chunks[c]));
+					}
+				}else{
+					b->frames.push_back(serialise(*b->msg));
+				}
+			}
+			for(std::vector<send_buf>::iterator fr = b->frames.begin(); fr != b->frames.end(); ++fr) {
+				client->Write(*b->msg, *fr);
+			}
+		}
 	}
 
-	NextTurn();
+	arena.Reset();
 }
 
-void Server::WriteAll(const protocol::message &msg, Server::base_client *exempt) {
-	for(client_set::iterator i = clients.begin(); i != clients.end(); i++) {
-		if((*i).get() != exempt && (*i)->colour != NOINIT) {
-			(*i)->Write(msg);
-		}
+send_buf Room::serialise(const protocol::message &msg) {
+	// 0 is no seq.
+	if(!++seq) {
+		++seq;
 	}
+
+	send_buf frame(msg, seq);
+	serialised_bytes[msg.msg()].record(frame.size);
+
+	return frame;
 }
 
-void Server::base_client::Quit(const std::string &msg, bool send_to_client) {
+void Room::base_client::Quit(const std::string &msg, bool send_to_client) {
 	if(qcalled) {
 		return;
 	}
 
 	qcalled = true;
 
+	if(!room || room->unsubscribe(this)) {
+		if(send_to_client) {
+			send_quit_message(msg);
+		}
+		return;
+	}
+
+	batch_scope scope(*room);
+
 	if(colour != NOINIT) {
 		protocol::message qmsg;
 		qmsg.set_msg(protocol::PQUIT);
@@ -306,15 +1438,22 @@ void Server::base_client::Quit(const std::string &msg, bool send_to_client) {
 		qmsg.mutable_players(0)->set_id(id);
 		qmsg.set_quit_msg(msg);
 
-		server.WriteAll(qmsg, this);
+		room->WriteAll(qmsg, this);
 	}
 
-	if(server.state == GAME) {
-		server.game_state->destroy_team_pawns(colour);
+	if(room->state == GAME) {
+		if(room->replay) {
+			protocol::message quit;
+			quit.set_msg(protocol::PQUIT);
+			room->replay->action(id, quit);
+		}
+
+		room->game_state->destroy_team_pawns(colour);
+		room->game_state->evaluator.sync(*room->game_state);
 	}
 
-	if(&**(server.turn) == this) {
-		server.NextTurn();
+	if(room->turn != room->clients.end() && &**(room->turn) == this) {
+		room->NextTurn();
 	}
 
 	if(send_to_client) {
@@ -322,32 +1461,47 @@ void Server::base_client::Quit(const std::string &msg, bool send_to_client) {
 	}
 
 	// Ehhh.
-	for(client_iterator i(server.clients.begin()); i != server.clients.end(); ++i) {
+	for(client_iterator i(room->clients.begin()); i != room->clients.end(); ++i) {
 		if(&**i == this) {
-			server.clients.erase(i);
+			room->clients.erase(i);
 			break;
 		}
 	}
+	room->update_info();
 
-	server.CheckForGameOver();
+	room->CheckForGameOver();
+
+	if(room->empty() && room->host) {
+		room->strand.post(boost::bind(&Server::close_room, room->host, room));
+	}
 }
 
-void Server::base_client::send_quit_message(const std::string &/*msg*/)
+void Room::base_client::send_quit_message(const std::string &/*msg*/)
 {
 }
 
-void Server::Client::send_quit_message(const std::string &msg)
+void Room::Client::send_quit_message(const std::string &msg)
 {
 	protocol::message pmsg;
 	pmsg.set_msg(protocol::QUIT);
 	pmsg.set_quit_msg(msg);
 
-	Write(pmsg, &Server::Client::FinishQuit);
+	Write(pmsg, &Room::Client::FinishQuit);
+}
+
+void Room::Client::FinishQuit(const boost::system::error_code &, ptr /*cptr*/) {}
+
+void Room::Client::FinishRoomList(const boost::system::error_code& error, ptr cptr) {
+	FinishWrite(error, cptr);
+
+	if(!qcalled) {
+		BeginRead();
+	}
 }
 
-void Server::Client::FinishQuit(const boost::system::error_code &, ptr /*cptr*/) {}
+void Room::NextTurn() {
+	Metrics::Timer timer(next_turn_time);
 
-void Server::NextTurn() {
 	client_set::iterator last = turn;
 
 	black_hole_suck();
@@ -396,10 +1550,10 @@ void Server::NextTurn() {
 
 	WriteAll(tmsg);
 
-	io_service.post(boost::bind(&base_client::ai_think, *turn));
+	strand.post(boost::bind(&base_client::ai_think, *turn));
 }
 
-bool Server::CheckForGameOver() {
+bool Room::CheckForGameOver() {
 	if(state == LOBBY) {
 		return true;
 	}
@@ -421,15 +1575,13 @@ bool Server::CheckForGameOver() {
 	}
 
 	if (alive <= 1) {
-		worm_timer.cancel();
-		doing_worm_stuff = false;
-
 		// Reload the map!
 		delete game_state;
 		game_state = new ServerGameState(*this);
-		game_state->load_file("scenario/" + map_name);
+		Scenarios::load(*game_state, map_name);
 
 		state = LOBBY;
+		update_info();
 
 		protocol::message gover;
 		gover.set_msg(protocol::GOVER);
@@ -439,6 +1591,11 @@ bool Server::CheckForGameOver() {
 
 		turn = clients.end();
 
+		if(replay) {
+			replay->action(gover.player_id(), gover);
+			replay.reset();
+		}
+
 		WriteAll(gover);
 
 		return true;
@@ -448,48 +1605,54 @@ bool Server::CheckForGameOver() {
 	}
 }
 
-void Server::SpawnPowers() {
-	Tile::List stiles = RandomTiles(game_state->tiles, pspawn_num, true, true, false, false);
+void Room::SpawnPowers() {
+	Metrics::Timer timer(spawn_powers_time);
+
+	Tile::List stiles = RandomTiles(game_state->rng, game_state->tiles, pspawn_num, true, true, false, false);
 
 	protocol::message msg;
 	msg.set_msg(protocol::UPDATE);
 
 	for(Tile::List::iterator t = stiles.begin(); t != stiles.end(); t++) {
 		if((*t)->smashed) continue;
-		(*t)->power = Powers::RandomPower(fog_of_war);
+		(*t)->power = Powers::RandomPower(game_state->rng, fog_of_war);
 		(*t)->has_power = true;
+		game_state->evaluator.tile_changed(*t);
 
-		msg.add_tiles();
-		(*t)->CopyToProto(msg.mutable_tiles(msg.tiles_size()-1));
+		(*t)->CopyToProto(msg.add_tiles(), (*t)->dirty());
 	}
 
-	pspawn_turns = (rand() % 6)+1;
-	pspawn_num = (rand() % 4)+1;
+	pspawn_turns = (game_state->rng() % 6)+1;
+	pspawn_num = (game_state->rng() % 4)+1;
 
 	WriteAll(msg);
 }
 
-void Server::black_hole_suck() {
-	std::set<Tile *> black_holes;
-	std::set<pawn_ptr> pawns;
+void Room::black_hole_suck() {
+	Metrics::Timer timer(black_hole_time);
+
+	// Kept in board order rather than pointer order, so the random
+	// numbers go to the same pawns when the game is replayed.
+	std::vector<Tile *> black_holes;
+	std::vector<pawn_ptr> pawns;
 
 	// Find all pawn and all black holes.
 	for(Tile::List::iterator t = game_state->tiles.begin(); t != game_state->tiles.end(); ++t) {
 		if((*t)->pawn) {
-			pawns.insert((*t)->pawn);
+			pawns.push_back((*t)->pawn);
 		}
 		if((*t)->has_black_hole) {
-			black_holes.insert(*t);
+			black_holes.push_back(*t);
 		}
 	}
 
 	// Draw pawns towards each black hole.
 	// Chance is inversely proportional to the square of the euclidean distance
 	// and increased by the black hole's power.
-	for(std::set<Tile *>::iterator bh = black_holes.begin(); bh != black_holes.end(); ++bh) {
+	for(std::vector<Tile *>::iterator bh = black_holes.begin(); bh != black_holes.end(); ++bh) {
 		float bx = (*bh)->col + (((*bh)->row % 2) * 0.5f);
 		float by = (*bh)->row * 0.5f;
-		for(std::set<pawn_ptr>::iterator p = pawns.begin(); p != pawns.end(); ++p) {
+		for(std::vector<pawn_ptr>::iterator p = pawns.begin(); p != pawns.end(); ++p) {
 			if((*p)->destroyed()) {
 				continue;
 			}
@@ -498,7 +1661,7 @@ void Server::black_hole_suck() {
 			float dx = bx - px, dy = by - py;
 			float distance = sqrt(dx * dx + dy * dy);
 			float chance = (*bh)->black_hole_power / (distance * distance);
-			if(rand() % 100 < (chance * 100)) {
+			if(game_state->rng() % 100 < (chance * 100)) {
 				// OM NOM NOM.
 				black_hole_suck_pawn(*bh, *p);
 			}
@@ -514,7 +1677,7 @@ static bool can_pull_on_to(Tile *tile, pawn_ptr pawn) {
 	return true;
 }
 
-void Server::black_hole_suck_pawn(Tile *tile, pawn_ptr pawn) {
+void Room::black_hole_suck_pawn(Tile *tile, pawn_ptr pawn) {
 	Tile *target;
 
 	float bx = tile->col + ((tile->row % 2) * 0.5f);
@@ -554,9 +1717,9 @@ static const char *ai_names[] = {
 	0
 };
 
-void Server::add_ai_player()
+void Room::add_ai_player()
 {
-	boost::shared_ptr<base_client> client(new ai_client(*this));
+	boost::shared_ptr<base_client> client(new ai_client(shared_from_this()));
 
 	// Pick unused name.
 	std::set<std::string> names;
@@ -594,12 +1757,10 @@ void Server::add_ai_player()
 	while(colour_id--) ++colour_itr;
 	client->colour = *colour_itr;
 
-	std::pair<client_set::iterator,bool> ir;
-
+	// WATCHER_ID belongs to subscribers.
 	do {
 		client->id = idcounter++;
-		ir = clients.insert(client);
-	} while(!ir.second);
+	} while(client->id == WATCHER_ID || !clients.insert(client).second);
 
 	protocol::message pjoin;
 
@@ -613,43 +1774,160 @@ void Server::add_ai_player()
 	WriteAll(pjoin, client.get());
 }
 
-void Server::ai_client::ai_think()
+// Rough value of using a power: the enemy material it removes.
+static int power_value(const ActionEnumerator::action &a, PlayerColour colour)
+{
+	const Powers::Power &power = Powers::powers[a.power];
+	if(!(power.preconditions & (Powers::AREA_PAWN | Powers::AREA_ENEMY_PAWN))) {
+		return 0;
+	}
+
+	// Powers that only need a pawn hit friends too.
+	bool enemies_only = power.preconditions & Powers::AREA_ENEMY_PAWN;
+
+	int value = 0;
+	for(Tile::List::const_iterator i = a.area->begin(); i != a.area->end(); ++i) {
+		if(!*i || !(*i)->pawn) {
+			continue;
+		}
+		if((*i)->pawn->colour != colour) {
+			value += options.eval.pawn;
+		}else if(!enemies_only) {
+			value -= options.eval.pawn;
+		}
+	}
+
+	return value;
+}
+
+void Room::ai_client::ai_think()
 {
-	std::vector<pawn_ptr> my_pawns = server.game_state->player_pawns(colour);
+	// The game may have ended since this was posted.
+	if(room->state != GAME || room->turn == room->clients.end() || &**room->turn != this) {
+		return;
+	}
+
+	Evaluator &evaluator = room->game_state->evaluator;
+
+	std::vector<pawn_ptr> my_pawns = room->game_state->player_pawns(colour);
 	std::random_shuffle(my_pawns.begin(), my_pawns.end());
 
-	pawn_ptr threatened_pawn;
-	Tile *threat_target;
-	pawn_ptr move_pawn;
-	Tile *move_target;
+	// Search every legal step and take the best one.
+	std::vector<pawn_ptr> root_pawns;
+	std::vector<Tile *> root_targets;
+	std::vector<Evaluator::move> root;
 	for(std::vector<pawn_ptr>::iterator itr(my_pawns.begin()); itr != my_pawns.end(); ++itr) {
 		pawn_ptr pawn = *itr;
 		assert(pawn);
 		for(int i = 0; i < 6; ++i) {
-			Tile *tile = (server.game_state->*(tile_coord_fns[i]))(pawn->cur_tile);
-			// Should move away from pawns above on cliffs.
-			if(tile && pawn->can_move(tile, server.game_state) && tile->pawn && tile->pawn->colour != pawn->colour) {
-				threatened_pawn = pawn;
-				threat_target = tile;
+			Tile *tile = (room->game_state->*(tile_coord_fns[i]))(pawn->cur_tile);
+			if(!tile || !pawn->can_move(tile, room->game_state)) {
+				continue;
+			}
+
+			Evaluator::move m(evaluator.index_of(pawn->cur_tile), evaluator.index_of(tile));
+			assert(m.from != -1 && m.to != -1);
+
+			root_pawns.push_back(pawn);
+			root_targets.push_back(tile);
+			root.push_back(m);
+		}
+	}
+
+	// Look the position up in the book before searching.
+	Search::result result;
+	result.best = -1;
+	if(room->book) {
+		uint64_t key = Search::position_key(evaluator.hash_recoloured(room->book_colours), room->book_colours[colour]);
+		MoveBook::entry e;
+		if(room->book->lookup(key, e)) {
+			for(size_t i = 0; i < root.size(); ++i) {
+				if(root[i].from == e.from && root[i].to == e.to) {
+					result.best = i;
+					result.scores.assign(root.size(), -1000000);
+					result.scores[i] = e.score;
+					result.nodes = 0;
+					break;
+				}
+			}
+		}
+	}
+
+	if(result.best == -1) {
+		boost::call_once(ai_table_once, &make_ai_table);
+		result = Search::search(evaluator, colour, root, options.ai_depth, options.ai_threads, ai_table.get());
+
+		ai_nodes.record(result.nodes);
+		ai_table_probes.add(result.probes);
+		ai_table_hits.add(result.hits);
+	}
+
+	// The search only sees stomps, so also prefer stepping out of reach
+	// of enemy powers rather than into it.
+	ThreatMap &threats = room->game_state->threats;
+	threats.build(*room->game_state);
+	for(size_t i = 0; i < root.size(); ++i) {
+		int from = threats.enemy_count(ThreatMap::RANGED, root_pawns[i]->cur_tile, colour);
+		int to = threats.enemy_count(ThreatMap::RANGED, root_targets[i], colour);
+		result.scores[i] += options.eval.threat * (from - to);
+	}
+	for(size_t i = 0; i < root.size(); ++i) {
+		if(result.scores[i] > result.scores[result.best]) {
+			result.best = i;
+		}
+	}
+
+	pawn_ptr move_pawn;
+	Tile *move_target = NULL;
+	int move_score = 0;
+	if(result.best != -1) {
+		move_pawn = root_pawns[result.best];
+		move_target = root_targets[result.best];
+		move_score = result.scores[result.best];
+	}
+
+	// Use a power instead if it looks better than the best move.
+	ActionEnumerator::action use = ActionEnumerator::action();
+	int use_value = 0;
+	if(!skip_powers) {
+		std::vector<ActionEnumerator::action> candidates;
+		for(std::vector<pawn_ptr>::iterator itr(my_pawns.begin()); itr != my_pawns.end(); ++itr) {
+			// Confused pawns don't get to pick a direction.
+			if((*itr)->flags & PWR_CONFUSED) {
+				continue;
 			}
-			if(tile && pawn->can_move(tile, server.game_state)) {
-				move_pawn = pawn;
-				move_target = tile;
+			room->game_state->actions.enumerate(*itr, room->game_state, candidates);
+		}
+
+		for(std::vector<ActionEnumerator::action>::iterator a = candidates.begin(); a != candidates.end(); ++a) {
+			int value = power_value(*a, colour);
+			if(value > use_value) {
+				use = *a;
+				use_value = value;
 			}
 		}
 	}
-	if(threatened_pawn) {
-		assert(threatened_pawn && threat_target);
+	if(use_value > 0 && (!move_pawn || use_value > move_score - evaluator.evaluate(colour))) {
 		protocol::message msg;
-		msg.set_msg(protocol::MOVE);
+		msg.set_msg(protocol::USE);
 		msg.add_pawns();
-		msg.mutable_pawns(0)->set_col(threatened_pawn->cur_tile->col);
-		msg.mutable_pawns(0)->set_row(threatened_pawn->cur_tile->row);
-		msg.mutable_pawns(0)->set_new_col(threat_target->col);
-		msg.mutable_pawns(0)->set_new_row(threat_target->row);
-		last_was_move = true;
-		server.handle_msg_game(*server.turn, msg);
-	} else if(move_pawn) {
+		msg.mutable_pawns(0)->set_col(use.pawn->cur_tile->col);
+		msg.mutable_pawns(0)->set_row(use.pawn->cur_tile->row);
+		msg.mutable_pawns(0)->set_use_power(use.power);
+		msg.set_power_direction(use.direction);
+		if(use.target) {
+			msg.add_tiles();
+			msg.mutable_tiles(0)->set_col(use.target->col);
+			msg.mutable_tiles(0)->set_row(use.target->row);
+		}
+		// Using a power doesn't end the turn, the OK brings us back here.
+		last_was_move = false;
+		room->handle_msg_game(*room->turn, msg);
+		return;
+	}
+
+	skip_powers = false;
+	if(move_pawn) {
 		assert(move_pawn && move_target);
 		protocol::message msg;
 		msg.set_msg(protocol::MOVE);
@@ -659,30 +1937,53 @@ void Server::ai_client::ai_think()
 		msg.mutable_pawns(0)->set_new_col(move_target->col);
 		msg.mutable_pawns(0)->set_new_row(move_target->row);
 		last_was_move = true;
-		server.handle_msg_game(*server.turn, msg);
+		room->handle_msg_game(*room->turn, msg);
 	} else {
 		protocol::message msg;
 		msg.set_msg(protocol::RESIGN);
 		last_was_move = true;
-		server.handle_msg_game(*server.turn, msg);
+		room->handle_msg_game(*room->turn, msg);
+	}
+}
+
+void Room::replay_client::Write(const protocol::message &msg)
+{
+	if(replay) {
+		replay->watch(msg);
 	}
 }
 
-void Server::ai_client::Write(const protocol::message &msg)
+void Room::ai_client::Write(const protocol::message &msg)
 {
+	if(room->batch_write(msg, this)) {
+		return;
+	}
+	if(msg.msg() == protocol::BATCH) {
+		for(int i = 0; i < msg.batch_size(); ++i) {
+			Write(msg.batch(i));
+		}
+		return;
+	}
+
 	if(msg.msg() == protocol::OK && last_was_move) {
 		last_was_move = false;
 		return;
 	}
 	last_was_move = false;
+	if(msg.msg() == protocol::BADMOVE) {
+		skip_powers = true;
+	}
 	if(msg.msg() == protocol::OK || msg.msg() == protocol::BADMOVE) {
-		if(&**server.turn == this) {
-			server.io_service.post(boost::bind(&ai_client::ai_think, this));
+		// Held until the end of the batch, by when the game may be over.
+		if(room->state == GAME && room->turn != room->clients.end() && &**room->turn == this) {
+			room->strand.post(boost::bind(&base_client::ai_think, *room->turn));
 		}
 	}
 }
 
-bool Server::handle_msg_lobby(Server::Client::ptr client, const protocol::message &msg) {
+bool Room::handle_msg_lobby(Room::Client::ptr client, const protocol::message &msg) {
+	Metrics::Timer timer(lobby_handlers[msg.msg()]);
+
 	if(msg.msg() == protocol::INIT) {
 		int c;
 		bool match = true;
@@ -728,10 +2029,14 @@ bool Server::handle_msg_lobby(Server::Client::ptr client, const protocol::messag
 		}
 
 		ginfo.set_map_name(map_name);
+		ginfo.set_room(name);
 
 		ginfo.set_fog_of_war(fog_of_war);
 		ginfo.set_king_of_the_hill(king_of_the_hill);
 
+		client->session = new_session();
+		ginfo.set_session(client->session);
+
 		client->Write(ginfo);
 
 		protocol::message pjoin;
@@ -745,12 +2050,18 @@ bool Server::handle_msg_lobby(Server::Client::ptr client, const protocol::messag
 
 		WriteAll(pjoin, client.get());
 	}else if(msg.msg() == protocol::BEGIN && client->id == ADMIN_ID) {
-		StartGame();
+		StartGame(rand());
 	}else if(msg.msg() == protocol::CHANGE_MAP && client->id == ADMIN_ID) {
 		try {
 			ServerGameState *new_state = new ServerGameState(*this);
-			new_state->load_file("scenario/" + msg.map_name());
+			try {
+				Scenarios::load(*new_state, msg.map_name());
+			} catch(...) {
+				delete new_state;
+				throw;
+			}
 			map_name = msg.map_name();
+			update_info();
 			delete game_state;
 			game_state = new_state;
 
@@ -778,6 +2089,7 @@ bool Server::handle_msg_lobby(Server::Client::ptr client, const protocol::messag
 				}
 
 				ginfo.set_map_name(map_name);
+				ginfo.set_room(name);
 
 				ginfo.set_fog_of_war(fog_of_war);
 				ginfo.set_king_of_the_hill(king_of_the_hill);
@@ -799,7 +2111,7 @@ bool Server::handle_msg_lobby(Server::Client::ptr client, const protocol::messag
 		WriteAll(msg);
 	} else if(msg.msg() == protocol::CCOLOUR && msg.players_size() == 1) {
 		if(client->id == ADMIN_ID || client->id == msg.players(0).id()) {
-			boost::shared_ptr<Server::base_client> c = get_client(msg.players(0).id());
+			boost::shared_ptr<Room::base_client> c = get_client(msg.players(0).id());
 
 			if(c) {
 				c->colour = (PlayerColour)msg.players(0).colour();
@@ -811,7 +2123,7 @@ bool Server::handle_msg_lobby(Server::Client::ptr client, const protocol::messag
 	} else if(msg.msg() == protocol::KICK && client->id == ADMIN_ID &&
 		  // The admin cannot kick themselves.
 		  msg.player_id() != ADMIN_ID) {
-		boost::shared_ptr<Server::base_client> c = get_client(msg.player_id());
+		boost::shared_ptr<Room::base_client> c = get_client(msg.player_id());
 		if(c) {
 			std::cout << "Kicking player " << msg.player_id() << std::endl;
 			c->Quit("Kicked");
@@ -825,10 +2137,18 @@ bool Server::handle_msg_lobby(Server::Client::ptr client, const protocol::messag
 	return true;
 }
 
-bool Server::handle_msg_game(boost::shared_ptr<Server::base_client> client, const protocol::message &msg) {
-	if(doing_worm_stuff) {
-		return true;
+bool Room::handle_msg_game(boost::shared_ptr<Room::base_client> client, const protocol::message &msg) {
+	Metrics::Timer timer(game_handlers[msg.msg()]);
+
+	// Rejected actions are logged too, a confused pawn uses up random
+	// numbers even when it doesn't get anywhere.
+	if(replay && (msg.msg() == protocol::MOVE || msg.msg() == protocol::USE || msg.msg() == protocol::RESIGN)) {
+		replay->action(client->id, msg);
 	}
+
+	// Everything a move or power use changes goes out as one batch.
+	batch_scope scope(*this);
+
 	if(msg.msg() == protocol::MOVE) {
 		if(msg.pawns_size() != 1) {
 			client->WriteBasic(protocol::BADMOVE);
@@ -846,7 +2166,7 @@ bool Server::handle_msg_game(boost::shared_ptr<Server::base_client> client, cons
 		}
 
 		if((pawn->flags & PWR_CONFUSED) && !(pawn->flags & PWR_JUMP)) {
-			int r = rand() % 6;
+			int r = game_state->rng() % 6;
 			switch (r) {
 				case 0:
 				case 1:
@@ -858,7 +2178,7 @@ bool Server::handle_msg_game(boost::shared_ptr<Server::base_client> client, cons
 							choices.push_back(temp);
 					}
 					if (choices.size() > 0)
-						tile = choices[rand() % choices.size()];
+						tile = choices[game_state->rng() % choices.size()];
 					break;
 				}
 				case 3: {
@@ -923,43 +2243,10 @@ bool Server::handle_msg_game(boost::shared_ptr<Server::base_client> client, cons
 				if((power_info.direction & dir) == 0) continue;
 				directions.push_back(dir);
 			}
-			direction = directions[rand() % directions.size()];
+			direction = directions[game_state->rng() % directions.size()];
 		}
 
-		switch(direction) {
-		case Powers::Power::undirected:
-			break;
-		case Powers::Power::east_west:
-			area = pawn->RowTiles();
-			break;
-		case Powers::Power::northeast_southwest:
-			area = pawn->fs_tiles();
-			break;
-		case Powers::Power::northwest_southeast:
-			area = pawn->bs_tiles();
-			break;
-		case Powers::Power::radial:
-			area = pawn->RadialTiles();
-			break;
-		case Powers::Power::east:
-			area = std::vector<Tile *>(1, game_state->tile_right_of(pawn->cur_tile));
-			break;
-		case Powers::Power::west:
-			area = std::vector<Tile *>(1, game_state->tile_left_of(pawn->cur_tile));
-			break;
-		case Powers::Power::northeast:
-			area = std::vector<Tile *>(1, game_state->tile_ne_of(pawn->cur_tile));
-			break;
-		case Powers::Power::southwest:
-			area = std::vector<Tile *>(1, game_state->tile_sw_of(pawn->cur_tile));
-			break;
-		case Powers::Power::northwest:
-			area = std::vector<Tile *>(1, game_state->tile_nw_of(pawn->cur_tile));
-			break;
-		case Powers::Power::southeast:
-			area = std::vector<Tile *>(1, game_state->tile_se_of(pawn->cur_tile));
-			break;
-		case Powers::Power::targeted: {
+		if(direction == Powers::Power::targeted) {
 			if(msg.tiles_size() != 1) {
 				client->WriteBasic(protocol::BADMOVE);
 				return true;
@@ -970,12 +2257,7 @@ bool Server::handle_msg_game(boost::shared_ptr<Server::base_client> client, cons
 				return true;
 			}
 			area = std::vector<Tile *>(1, t);
-			break;
-		}
-		case Powers::Power::point:
-			area = std::vector<Tile *>(1, pawn->cur_tile);
-			break;
-		default:
+		}else if(!game_state->power_area(pawn, direction, area)) {
 			fprintf(stderr, "Ignoring bad power direction %x\n", msg.power_direction());
 			client->WriteBasic(protocol::BADMOVE);
 			return true;
@@ -994,9 +2276,7 @@ bool Server::handle_msg_game(boost::shared_ptr<Server::base_client> client, cons
 				update_one_pawn(pawn);
 			}
 
-			if(!doing_worm_stuff) {
-				client->WriteBasic(protocol::OK);
-			}
+			client->WriteBasic(protocol::OK);
 
 			if(!CheckForGameOver()) {
 				// Make sure the player still has pawns.
@@ -1022,7 +2302,7 @@ bool Server::handle_msg_game(boost::shared_ptr<Server::base_client> client, cons
 	return true;
 }
 
-boost::shared_ptr<Server::base_client> Server::get_client(uint16_t id) {
+boost::shared_ptr<Room::base_client> Room::get_client(uint16_t id) {
 	client_iterator i = clients.begin();
 
 	for(; i != clients.end(); i++) {
@@ -1031,67 +2311,89 @@ boost::shared_ptr<Server::base_client> Server::get_client(uint16_t id) {
 		}
 	}
 
-	return boost::shared_ptr<Server::base_client>();
+	return boost::shared_ptr<Room::base_client>();
 }
 
-void Server::update_one_pawn(pawn_ptr pawn)
+void Room::update_one_pawn(pawn_ptr pawn)
 {
-	protocol::message update;
-	update.set_msg(protocol::UPDATE);
+	game_state->evaluator.tile_changed(pawn->cur_tile);
 
-	update.add_pawns();
-	pawn->CopyToProto(update.mutable_pawns(0), true);
+	uint32_t fields = pawn->dirty();
+	if(!fields) {
+		return;
+	}
 
-	WriteAll(update);
+	protocol::message *update = new_message(protocol::UPDATE);
+	pawn->CopyToProto(update->add_pawns(), fields);
+
+	WriteAll(*update);
 }
 
-void Server::update_one_tile(Tile *tile)
+void Room::update_one_tile(Tile *tile)
 {
-	protocol::message update;
-	update.set_msg(protocol::UPDATE);
+	game_state->evaluator.tile_changed(tile);
+
+	uint32_t fields = tile->dirty();
+	if(!fields) {
+		return;
+	}
 
-	tile->CopyToProto(update.add_tiles());
+	protocol::message *update = new_message(protocol::UPDATE);
+	tile->CopyToProto(update->add_tiles(), fields);
 
-	WriteAll(update);
+	WriteAll(*update);
 }
 
-void Server::worm_tick(const boost::system::error_code &/*ec*/)
+/* Only the heights of tiles decide where the worm goes, so the whole path
+ * is worked out before anything happens. Clients are sent the path to play
+ * at their own pace and everything the worm does is done at once.
+*/
+void Room::run_worm(pawn_ptr pawn, int range)
 {
-	assert(doing_worm_stuff);
+	Tile::List path;
+	std::map<Tile *, int> heights;
+	Tile *tile = pawn->cur_tile;
 
-	if(worm_range == 0) {
-		doing_worm_stuff = false;
-		(*turn)->WriteBasic(protocol::OK);
-		return;
-	}
-	worm_range -= 1;
+	for(int step = 0; step < range; ++step) {
+		path.push_back(tile);
 
-	if (worm_tile->height < 2) {
-		game_state->add_animator(new TileAnimators::ElevationAnimator(
-			Tile::List(1, worm_tile), worm_tile, 0, TileAnimators::RELATIVE, 1));
-		game_state->set_tile_height(worm_tile, worm_tile->height + 1);
-	}
-	if(worm_tile->pawn && worm_tile->pawn->colour != worm_pawn->colour) {
-		game_state->destroy_pawn(worm_tile->pawn, Pawn::ANT_ATTACK, worm_pawn);
-		game_state->add_animator("boom", worm_tile);
-	}
-	game_state->update_tile(worm_tile);
+		int &height = heights.insert(std::make_pair(tile, tile->height)).first->second;
+		if(height < 2) {
+			height++;
+		}
 
-	std::vector<Tile*> choices;
-	for (int i = 0; i < 6; i++) {
-		Tile* temp = (game_state->*(tile_coord_fns[i]))(worm_tile);
-		if (temp && temp->height < 2)
-			choices.push_back(temp);
-	}
+		std::vector<Tile*> choices;
+		for (int i = 0; i < 6; i++) {
+			Tile* temp = (game_state->*(tile_coord_fns[i]))(tile);
+			if (temp && heights.insert(std::make_pair(temp, temp->height)).first->second < 2)
+				choices.push_back(temp);
+		}
 
-	if (choices.size() == 0) {
-		doing_worm_stuff = false;
-		(*turn)->WriteBasic(protocol::OK);
-		return;
+		if (choices.size() == 0) {
+			break;
+		}
+
+		tile = choices[game_state->rng() % choices.size()];
 	}
 
-	worm_tile = choices[rand() % choices.size()];
+	game_state->add_animator(new TileAnimators::WormAnimator(path, WORM_INTERVAL));
+
+	PlayerColour colour = pawn->colour;
+
+	for(Tile::List::iterator t = path.begin(); t != path.end(); ++t) {
+		if((*t)->height < 2) {
+			(*t)->SetHeight((*t)->height + 1);
+		}
+		if((*t)->pawn && (*t)->pawn->colour != colour) {
+			game_state->destroy_pawn((*t)->pawn, Pawn::ANT_ATTACK, pawn);
+		}
+	}
 
-	worm_timer.expires_at(worm_timer.expires_at() + boost::posix_time::milliseconds(1000));
-	worm_timer.async_wait(boost::bind(&Server::worm_tick, this, boost::asio::placeholders::error));
+	// One update for each tile, however many times the worm went over it.
+	std::set<Tile *> updated;
+	for(Tile::List::iterator t = path.begin(); t != path.end(); ++t) {
+		if(updated.insert(*t).second) {
+			game_state->update_tile(*t);
+		}
+	}
 }
@@ -2,30 +2,44 @@
 #define NETWORK_HPP
 
 #include <queue>
+#include <deque>
 #include <stdint.h>
+#include <time.h>
 #include <string>
 #include <set>
+#include <map>
 #include <boost/asio.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/shared_array.hpp>
 #include <boost/enable_shared_from_this.hpp>
 #include <vector>
 #include <boost/thread.hpp>
+#include <google/protobuf/arena.h>
 
 #include "hexradius.pb.h"
 #include "hexradius.hpp"
+#include "replay.hpp"
 
 class ServerGameState;
 class Tile;
-
-class Server {
+class MoveBook;
+class Replay;
+
+/* One game, with its own players, lobby and game state. Rooms are created
+ * by the Server as players ask for them, and go away once the last player
+ * has left.
+*/
+class Room : public boost::enable_shared_from_this<Room> {
 	friend class ServerGameState;
+	friend class Server;
+	friend class Replay;
 	struct base_client {
-		base_client(Server &server) :
-			server(server), colour(NOINIT), qcalled(false)
+		base_client(const boost::shared_ptr<Room> &room) :
+			room(room), colour(NOINIT), qcalled(false)
 		{}
 
-		Server &server;
+		// Not set until the client has joined a room.
+		boost::shared_ptr<Room> room;
 
 		uint16_t id;
 		std::string playername;
@@ -37,31 +51,78 @@ class Server {
 
 		virtual ~base_client();
 		virtual void Write(const protocol::message &msg);
+		// Write a message that has already been serialised into frame.
+		virtual void Write(const protocol::message &msg, const send_buf &frame);
 		void WriteBasic(protocol::msgtype type);
 		virtual void send_quit_message(const std::string &msg);
 		void Quit(const std::string &msg, bool send_to_client = true);
 		virtual void ai_think();
 	};
-	struct Client : public boost::enable_shared_from_this<Server::Client>, public base_client {
-		typedef boost::shared_ptr<Server::Client> ptr;
-		typedef void (Server::Client::*write_cb)(const boost::system::error_code&, ptr);
+	struct Client : public boost::enable_shared_from_this<Room::Client>, public base_client {
+		typedef boost::shared_ptr<Room::Client> ptr;
+		typedef void (Room::Client::*write_cb)(const boost::system::error_code&, ptr);
 
 		struct server_send_buf : send_buf {
 			write_cb callback;
 
-			server_send_buf(const protocol::message &msg) : send_buf(msg) {}
+			server_send_buf(const send_buf &frame, write_cb cb) : send_buf(frame), callback(cb) {}
 		};
 
-		Client(boost::asio::io_service &io_service, Server &s) :
-			base_client(s), socket(io_service)
+		Client(boost::asio::io_service &io_service, Server &host) :
+			base_client(boost::shared_ptr<Room>()), host(host), socket(io_service), write_batch(0),
+			queued_bytes(0), max_queued_bytes(0), max_queued_frames(0),
+			over_limit_since(0), queue_full(false),
+			sent_floor(0), detached(false), resume_timer(io_service)
 		{}
 
+		~Client();
+
+		Server &host;
 		boost::asio::ip::tcp::socket socket;
 
 		uint32_t msgsize;
 		std::vector<char> msgbuf;
-
-		std::queue<server_send_buf> send_queue;
+		// Parsed in place for every message, so its memory is reused.
+		protocol::message msgin;
+
+		std::deque<server_send_buf> send_queue;
+		// Frames at the front of send_queue being written, 0 if idle.
+		size_t write_batch;
+
+		/* A client that stops reading would have everything the game
+		 * sends queued up for it. Once the queue goes over the limits in
+		 * options, pending updates are coalesced, and if it stays over
+		 * them for longer than the grace period (or goes over twice the
+		 * limits) the client is disconnected.
+		*/
+		size_t queued_bytes;
+		size_t max_queued_bytes, max_queued_frames;
+		time_t over_limit_since; // 0 if within the limits.
+		bool queue_full; // Being disconnected, send nothing more.
+
+		bool over_limit(unsigned int factor = 1) const;
+		void check_queue();
+		void coalesce();
+		void QueueFull(ptr cptr);
+
+		/* A player who loses the connection mid-game can come back with
+		 * their session (see Room::resume), so the last frames sent to
+		 * them are kept for catching up from.
+		*/
+		std::string session;
+		std::deque<send_buf> sent;
+		// seq of the newest frame no longer in sent. Anyone who has seen
+		// less than this needs a snapshot instead.
+		uint32_t sent_floor;
+		// The connection has gone and the place is held until
+		// resume_timer expires.
+		bool detached;
+		boost::asio::deadline_timer resume_timer;
+
+		void remember(const send_buf &frame);
+		// The connection went, hold the place if in a game or quit.
+		void Disconnect(const std::string &msg, bool send_to_client = true);
+		void ResumeTimeout(const boost::system::error_code& error, ptr cptr);
 
 		virtual void send_quit_message(const std::string &msg);
 
@@ -69,18 +130,35 @@ class Server {
 		void BeginRead2(const boost::system::error_code& error, ptr cptr);
 		void FinishRead(const boost::system::error_code& error, ptr cptr);
 
+		void StartWrite();
 		void FinishWrite(const boost::system::error_code& error, ptr cptr);
 		virtual void Write(const protocol::message &msg);
+		virtual void Write(const protocol::message &msg, const send_buf &frame);
 		void Write(const protocol::message &msg, write_cb callback);
+		void Write(const protocol::message &msg, const send_buf &frame, write_cb callback);
+		// Queue a frame without counting or remembering it.
+		void Send(const send_buf &frame, write_cb callback);
 
 		void FinishQuit(const boost::system::error_code& error, ptr cptr);
+		// The room list has been sent, wait for the next message.
+		void FinishRoomList(const boost::system::error_code& error, ptr cptr);
 	};
 	struct ai_client : public base_client {
-		ai_client(Server &s) : base_client(s), last_was_move(false) {}
+		ai_client(const boost::shared_ptr<Room> &room) : base_client(room), last_was_move(false), skip_powers(false) {}
 		virtual void ai_think();
 		virtual void Write(const protocol::message &msg);
 
 		bool last_was_move;
+		// Set when a power use was rejected, cleared when the turn ends.
+		bool skip_powers;
+	};
+	// Stands in for a player while a game log is played back.
+	struct replay_client : public base_client {
+		replay_client(const boost::shared_ptr<Room> &room, Replay *replay = NULL) : base_client(room), replay(replay) {}
+		virtual void Write(const protocol::message &msg);
+
+		// Given everything the client is sent, if set.
+		Replay *replay;
 	};
 
 	struct client_compare {
@@ -90,8 +168,9 @@ class Server {
 	};
 
 public:
-	Server(uint16_t port, const std::string &scenario_file);
-	~Server();
+	// Rooms playing back a game log have no host.
+	Room(boost::asio::io_service &io_service, Server *host, const std::string &name, const std::string &scenario_file);
+	~Room();
 
 	ServerGameState *game_state;
 
@@ -99,15 +178,31 @@ private:
 	typedef std::set<boost::shared_ptr<base_client>,client_compare> client_set;
 	typedef client_set::iterator client_iterator;
 
-	boost::asio::io_service io_service;
-	boost::asio::ip::tcp::acceptor acceptor;
-	boost::thread worker;
+	Server *host;
+	std::string name;
+	boost::asio::io_service &io_service;
+	// Every handler of the room runs through this, so the room never runs
+	// on two threads at once even though the server has several.
+	boost::asio::io_service::strand strand;
+	// Set once the server has dropped the room.
+	bool closed;
+
+	// What the room list says about the room, updated on the strand so
+	// that other threads can read it.
+	mutable boost::mutex info_mutex;
+	protocol::room info;
+	void update_info();
 
 	client_set clients;
 	uint16_t idcounter;
 
 	std::string map_name;
 
+	// AI move book for the map, if there is one, and the scenario colour
+	// of each player colour, since the book uses the scenario's colours.
+	boost::shared_ptr<MoveBook> book;
+	PlayerColour book_colours[SPECTATE];
+
 	client_iterator turn;
 	enum { LOBBY, GAME } state;
 
@@ -117,24 +212,83 @@ private:
 	bool fog_of_war;
 	bool king_of_the_hill;
 
-	bool doing_worm_stuff;
-	pawn_ptr worm_pawn;
-	Tile *worm_tile;
-	int worm_range;
-	boost::asio::deadline_timer worm_timer;
-	void worm_tick(const boost::system::error_code &/*ec*/);
+	// Log of the game in progress, if games are being logged.
+	boost::shared_ptr<ReplayLog> replay;
+	void start_replay(uint64_t board_hash);
+
+	// Send a worm crawling range tiles from pawn.
+	void run_worm(pawn_ptr pawn, int range);
+
+	// Add a client that asked for this room, it still has to send INIT.
+	void join(Room::Client::ptr client);
+	// True once no connected player is left.
+	bool empty() const;
+	// Stop the game and drop everyone left (AI players).
+	void close();
+	void describe(protocol::room &r) const;
+	// GINFO, and BEGIN, SCORE_UPDATE and TURN if in a game, bringing a
+	// client with the given id up to date with the room.
+	void snapshot(std::vector<protocol::message> &out, uint16_t viewer) const;
+
+	/* Connections watching the room from outside (relays). They get
+	 * everything sent to every client, but aren't in the game, so the
+	 * room does the same work however many viewers are behind them.
+	*/
+	std::vector<Client::ptr> subscribers;
+	void subscribe(Client::ptr client);
+	// Send a new snapshot, marked as one.
+	void send_snapshot(Client::ptr client);
+	// Returns false if it isn't a subscriber.
+	bool unsubscribe(base_client *client);
+
+	// Numbers frames, see protocol::message::seq.
+	uint32_t seq;
+	std::string new_session();
+	// Put client in the place of the player whose session is in the INIT
+	// and send what they missed. Returns false if there is no such player.
+	bool resume(Client::ptr client, const protocol::message &init);
+
+	bool HandleMessage(Room::Client::ptr client, const protocol::message &msg);
 
-	void worker_main();
+	typedef boost::shared_array<char> wbuf_ptr;
 
-	void StartAccept();
-	void HandleAccept(Server::Client::ptr client, const boost::system::error_code& err);
-	bool HandleMessage(Server::Client::ptr client, const protocol::message &msg);
+	// Serialise the message once and queue the same frame to every client.
+	void WriteAll(const protocol::message &msg, Room::base_client *exempt = NULL);
+
+	/* While a batch is open, messages to clients are held back and sent
+	 * as one BATCH message per client when the outermost batch ends.
+	 * Consecutive UPDATEs to the same clients are merged into one.
+	*/
+	struct batch_entry {
+		protocol::message *msg; // On the arena.
+		// Only sent to this client if set, never sent to exempt.
+		base_client *to, *exempt;
+	};
+	std::vector<batch_entry> batch;
+	int batch_depth;
 
-	typedef boost::shared_array<char> wbuf_ptr;
+	// Outbound messages, freed all at once when the outermost batch
+	// ends. Messages built with new_message() are batched without a
+	// copy, so they must not be changed after they are written.
+	std::vector<char> arena_block;
+	google::protobuf::Arena arena;
+	protocol::message *new_message(protocol::msgtype type);
+
+	struct batch_scope {
+		Room &room;
+
+		batch_scope(Room &r) : room(r) { room.begin_batch(); }
+		~batch_scope() { room.end_batch(); }
+	};
 
-	void WriteAll(const protocol::message &msg, Server::base_client *exempt = NULL);
+	void begin_batch();
+	void end_batch();
+	// Hold msg back if a batch is open. Returns false if it should be sent now.
+	bool batch_write(const protocol::message &msg, base_client *to, base_client *exempt = NULL);
 
-	void StartGame();
+	send_buf serialise(const protocol::message &msg);
+
+	void StartGame(uint32_t seed);
 	void add_ai_player();
 	bool CheckForGameOver();
 
@@ -144,15 +298,61 @@ private:
 	// Suck pawn towards the black hole's tile.
 	void black_hole_suck_pawn(Tile *tile, pawn_ptr pawn);
 
-	bool handle_msg_lobby(Server::Client::ptr client, const protocol::message &msg);
+	bool handle_msg_lobby(Room::Client::ptr client, const protocol::message &msg);
 	bool handle_msg_game(boost::shared_ptr<base_client> client, const protocol::message &msg);
 
-	boost::shared_ptr<Server::base_client> get_client(uint16_t id);
+	boost::shared_ptr<Room::base_client> get_client(uint16_t id);
 
-	// Send an UPDATE message for one pawn.
+	// Send an UPDATE message with the changed fields of one pawn.
 	void update_one_pawn(pawn_ptr pawn);
-	// Send an UPDATE message for one tile.
+	// Send an UPDATE message with the changed fields of one tile.
 	void update_one_tile(Tile *tile);
 };
 
+/* Accepts connections on one port and hands each to the room named in
+ * its INIT, creating the room if it doesn't exist. Before that, a
+ * connection can only ask for the list of rooms.
+*/
+class Server {
+	friend class Room;
+public:
+	Server(uint16_t port, const std::string &scenario_file);
+	~Server();
+
+private:
+	boost::asio::io_service io_service;
+	boost::asio::ip::tcp::acceptor acceptor;
+	// Run io_service, options.server_threads of them.
+	boost::thread_group workers;
+
+	// Game logs of every room. Goes after the rooms are gone.
+	ReplayWriter replays;
+
+	// Writes the metrics every options.metrics_interval seconds.
+	boost::asio::deadline_timer metrics_timer;
+	void dump_metrics(const boost::system::error_code &error);
+
+	// Map of rooms created without naming one.
+	std::string default_map;
+
+	typedef std::map<std::string, boost::shared_ptr<Room> > room_map;
+	room_map rooms;
+	boost::mutex rooms_mutex;
+
+	void worker_main();
+
+	void StartAccept();
+	void HandleAccept(Room::Client::ptr client, const boost::system::error_code& err);
+	// Handle a message from a client that hasn't joined a room yet.
+	bool HandleMessage(Room::Client::ptr client, const protocol::message &msg);
+	// Add the client to the room and hand it the INIT, on the room's strand.
+	void JoinRoom(boost::shared_ptr<Room> room, Room::Client::ptr client, const protocol::message &init);
+	// Subscribe the client to the room, on the room's strand.
+	void WatchRoom(boost::shared_ptr<Room> room, Room::Client::ptr client);
+	// Give a returning player their place back, on the room's strand.
+	void ResumeRoom(boost::shared_ptr<Room> room, Room::Client::ptr client, const protocol::message &init);
+	// Drop the room if nobody is left in it, on the room's strand.
+	void close_room(boost::shared_ptr<Room> room);
+};
+
 #endif /* !NETWORK_HPP */
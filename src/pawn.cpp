@@ -44,7 +44,7 @@ static Tile* line_end(Tile* start, boost::function<Tile*(Tile*)> move_fn) {
 	}
 }
 
-bool Pawn::can_move(Tile *tile, ServerGameState *state) {
+bool Pawn::can_move(Tile *tile, GameState *state) {
 	// Move only onto adjacent tiles or friendly landing pads.
 	Tile::List adjacent_tiles = move_tiles();
 
@@ -97,13 +97,13 @@ void Pawn::force_move(Tile *tile, ServerGameState *state) {
 
 	if(tile->has_black_hole) {
 		state->destroy_pawn(shared_from_this(), Pawn::BLACKHOLE);
-		state->add_animator("ohshitifelldownahole", tile);
+		state->add_animator(protocol::FALL, tile);
 		return;
 	}
 
 	if(tile->smashed && !(flags & PWR_CLIMB)) {
 		state->destroy_pawn(shared_from_this(), Pawn::FELL_OUT_OF_THE_WORLD);
-		state->add_animator("ohshitifelldownahole", tile);
+		state->add_animator(protocol::FALL, tile);
 		return;
 	}
 
@@ -122,7 +122,7 @@ void Pawn::force_move(Tile *tile, ServerGameState *state) {
 
 void Pawn::detonate_mine(ServerGameState *state)
 {
-	state->add_animator("boom", cur_tile);
+	state->add_animator(protocol::BOOM, cur_tile);
 	cur_tile->has_mine = false;
 	state->update_tile(cur_tile);
 	// Shield protects from one mine.
@@ -179,15 +179,42 @@ Tile::List Pawn::fs_tiles(int range)
 Tile::List Pawn::linear_tiles(int range)
 { return game_state->linear_tiles(cur_tile, range); }
 
+uint32_t Pawn::dirty() const {
+	uint32_t d = 0;
+
+	if(!sent.has_colour() || sent.colour() != (protocol::colour)colour) d |= DIRTY_COLOUR;
+	if(!sent.has_range() || sent.range() != (uint32_t)range) d |= DIRTY_RANGE;
+	if(!sent.has_flags() || sent.flags() != flags) d |= DIRTY_FLAGS;
+
+	if(!sent.all_powers() || (size_t)sent.powers_size() != powers.size()) {
+		d |= DIRTY_POWERS;
+	}else{
+		PowerList::const_iterator i = powers.begin();
+		for(int p = 0; i != powers.end(); ++i, ++p) {
+			if(sent.powers(p).index() != (uint32_t)i->first || sent.powers(p).num() != (uint32_t)i->second) {
+				d |= DIRTY_POWERS;
+				break;
+			}
+		}
+	}
+
+	return d;
+}
+
 void Pawn::CopyToProto(protocol::pawn *p, bool copy_powers) {
+	CopyToProto(p, (uint32_t)(copy_powers ? DIRTY_ALL : DIRTY_ALL & ~DIRTY_POWERS));
+}
+
+void Pawn::CopyToProto(protocol::pawn *p, uint32_t fields) {
 	p->set_col(cur_tile->col);
 	p->set_row(cur_tile->row);
-	p->set_colour((protocol::colour)colour);
-	p->set_range(range);
-	p->set_flags(flags);
+	if(fields & DIRTY_COLOUR) p->set_colour((protocol::colour)colour);
+	if(fields & DIRTY_RANGE) p->set_range(range);
+	if(fields & DIRTY_FLAGS) p->set_flags(flags);
 
-	if(copy_powers) {
+	if(fields & DIRTY_POWERS) {
 		p->clear_powers();
+		p->set_all_powers(true);
 		PowerList::iterator i = powers.begin();
 
 		for(; i != powers.end(); i++) {
@@ -197,7 +224,16 @@ void Pawn::CopyToProto(protocol::pawn *p, bool copy_powers) {
 			p->mutable_powers(index)->set_index(i->first);
 			p->mutable_powers(index)->set_num(i->second);
 		}
+
+		sent.clear_powers();
 	}
+
+	sent.MergeFrom(*p);
+}
+
+void Pawn::mark_sent() {
+	protocol::pawn p;
+	CopyToProto(&p, (uint32_t)DIRTY_ALL);
 }
 
 bool Pawn::has_power()
@@ -27,9 +27,25 @@ public:
 	void destroy(destroy_type dt);
 	bool destroyed();
 
+	// Fields of protocol::pawn that can be sent on their own.
+	enum {
+		DIRTY_COLOUR = 1<<0,
+		DIRTY_RANGE  = 1<<1,
+		DIRTY_FLAGS  = 1<<2,
+		DIRTY_POWERS = 1<<3,
+		DIRTY_ALL    = (1<<4) - 1,
+	};
+
+	// Fields that differ from the last copy made by CopyToProto.
+	uint32_t dirty() const;
+
 	void CopyToProto(protocol::pawn *p, bool copy_powers);
+	// Copy the given fields and remember them as sent.
+	void CopyToProto(protocol::pawn *p, uint32_t fields);
+	// Remember every field as sent, after sending the pawn another way.
+	void mark_sent();
 
-	bool can_move(Tile *new_tile, ServerGameState *state);
+	bool can_move(Tile *new_tile, GameState *state);
 	// Perform a move without performing the move checks.
 	// Moving on to a friendly pawn will still smash it!
 	void force_move(Tile *new_tile, ServerGameState *state);
@@ -54,6 +70,10 @@ public:
 	Tile::List linear_tiles(int range);
 
 	bool has_power();
+
+private:
+	// Field values as last copied to a message.
+	protocol::pawn sent;
 };
 
 #endif
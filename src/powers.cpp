@@ -11,7 +11,7 @@
 
 using namespace Powers;
 
-int Powers::RandomPower(bool fog_of_war) {
+int Powers::RandomPower(game_rng &rng, bool fog_of_war) {
 	int total = 0;
 	for (size_t i = 0; i < powers.size(); i++) {
 		if(!fog_of_war && (Powers::powers[i].requirements & Powers::REQ_FOG_OF_WAR)) {
@@ -20,7 +20,7 @@ int Powers::RandomPower(bool fog_of_war) {
 		total += Powers::powers[i].spawn_rate;
 	}
 
-	int n = rand() % total;
+	int n = rng() % total;
 	for (size_t i = 0; i < powers.size(); i++) {
 		if(!fog_of_war && (Powers::powers[i].requirements & Powers::REQ_FOG_OF_WAR)) {
 			continue;
@@ -35,11 +35,49 @@ int Powers::RandomPower(bool fog_of_war) {
 	abort();
 }
 
+unsigned int Powers::area_properties(pawn_ptr pawn, const std::vector<Tile *> &area) {
+	unsigned int props = 0;
+
+	for(std::vector<Tile *>::const_iterator i = area.begin(); i != area.end(); ++i) {
+		Tile *tile = *i;
+		if(!tile) continue;
+
+		if(tile->pawn) {
+			pawn_ptr p = tile->pawn;
+			props |= AREA_PAWN;
+			if(p->colour != pawn->colour) {
+				props |= AREA_ENEMY_PAWN;
+				if(!(p->flags & PWR_CONFUSED)) props |= AREA_UNCONFUSED_ENEMY;
+				if((p->flags & PWR_GOOD) || p->range > 0) props |= AREA_PURIFIABLE_PAWN;
+			}else if(p->flags & ~PWR_GOOD) {
+				props |= AREA_PURIFIABLE_PAWN;
+			}
+		}
+
+		if((tile->has_mine && tile->mine_colour != pawn->colour) ||
+		   (tile->has_landing_pad && tile->landing_pad_colour != pawn->colour) ||
+		   (tile->has_eye && tile->eye_colour != pawn->colour)) {
+			props |= AREA_FOREIGN_FEATURE;
+		}
+
+		if(tile->has_power) props |= AREA_ORB;
+		if(tile->height != +2) props |= AREA_BELOW_MAX;
+		if(tile->height != -2) props |= AREA_ABOVE_MIN;
+
+		if(!tile->smashed && !tile->has_black_hole) {
+			if(!tile->has_mine) props |= AREA_MINEABLE;
+			if(!(tile->has_landing_pad && tile->landing_pad_colour == pawn->colour)) props |= AREA_PADDABLE;
+		}
+	}
+
+	return props;
+}
+
 static void destroy_enemies(pawn_ptr pawn, const Tile::List &area, ServerGameState *state, Pawn::destroy_type dt, bool enemies_only, bool smash_tile) {
 	for(Tile::List::const_iterator i = area.begin(); i != area.end(); ++i) {
 		if((*i)->pawn && (!enemies_only || (*i)->pawn->colour != pawn->colour)) {
 			state->destroy_pawn((*i)->pawn, dt, pawn);
-			state->add_animator("pow", *i);
+			state->add_animator(protocol::POW, *i);
 			if(smash_tile) {
 				(*i)->smashed = true;
 				(*i)->has_mine = false;
@@ -51,7 +89,7 @@ static void destroy_enemies(pawn_ptr pawn, const Tile::List &area, ServerGameSta
 	}
 }
 
-static bool can_destroy_enemies(pawn_ptr pawn, const Tile::List &area, ServerGameState *, bool enemies_only) {
+static bool can_destroy_enemies(pawn_ptr pawn, const Tile::List &area, GameState *, bool enemies_only) {
 	for(Tile::List::const_iterator i = area.begin(); i != area.end(); ++i) {
 		if((*i)->pawn && (!enemies_only || (*i)->pawn->colour != pawn->colour)) {
 			return true;
@@ -61,7 +99,7 @@ static bool can_destroy_enemies(pawn_ptr pawn, const Tile::List &area, ServerGam
 }
 
 /// Destroy: Nice & simple, just destroy enemy pawns in the target area.
-static bool test_destroy_power(pawn_ptr pawn, const Tile::List &area, ServerGameState *state)
+static bool test_destroy_power(pawn_ptr pawn, const Tile::List &area, GameState *state)
 {
 	return can_destroy_enemies(pawn, area, state, true);
 }
@@ -72,7 +110,7 @@ static void use_destroy_power(pawn_ptr pawn, const Tile::List &area, ServerGameS
 }
 
 /// Confuse: Confused pawns have a chance to move in the wrong direction when moved.
-static bool test_confuse_power(pawn_ptr pawn, const Tile::List &area, ServerGameState */*state*/) {
+static bool test_confuse_power(pawn_ptr pawn, const Tile::List &area, GameState */*state*/) {
 	for(Tile::List::const_iterator i = area.begin(); i != area.end(); ++i) {
 		if((*i)->pawn && (*i)->pawn->colour != pawn->colour && !((*i)->pawn->flags & PWR_CONFUSED)) {
 			return true;
@@ -91,7 +129,7 @@ static void use_confuse_power(pawn_ptr pawn, const Tile::List &area, ServerGameS
 }
 
 /// Hijack: Recruit pawns.
-static bool test_hijack_power(pawn_ptr pawn, const Tile::List &area, ServerGameState */*state*/) {
+static bool test_hijack_power(pawn_ptr pawn, const Tile::List &area, GameState */*state*/) {
 	for(Tile::List::const_iterator i = area.begin(); i != area.end(); ++i) {
 		if((*i)->pawn && (*i)->pawn->colour != pawn->colour) {
 			return true;
@@ -110,7 +148,7 @@ static void use_hijack_power(pawn_ptr pawn, const Tile::List &area, ServerGameSt
 }
 
 /// Annihilate: Destroy *all* pawns in the target area.
-static bool test_annihilate_power(pawn_ptr pawn, const Tile::List &area, ServerGameState *state) {
+static bool test_annihilate_power(pawn_ptr pawn, const Tile::List &area, GameState *state) {
 	return can_destroy_enemies(pawn, area, state, false);
 }
 
@@ -119,7 +157,7 @@ static void use_annihilate_power(pawn_ptr pawn, const Tile::List &area, ServerGa
 }
 
 /// Smash: Destroy enemy pawns in the target area and smash the tiles they're on.
-static bool test_smash_power(pawn_ptr pawn, const Tile::List &area, ServerGameState *state) {
+static bool test_smash_power(pawn_ptr pawn, const Tile::List &area, GameState *state) {
 	return can_destroy_enemies(pawn, area, state, true);
 }
 
@@ -137,7 +175,7 @@ static void raise_tile(pawn_ptr pawn, const Tile::List &, ServerGameState *state
 	state->set_tile_height(pawn->cur_tile, pawn->cur_tile->height + 1);
 }
 
-static bool can_raise_tile(pawn_ptr pawn, const Tile::List &, ServerGameState *) {
+static bool can_raise_tile(pawn_ptr pawn, const Tile::List &, GameState *) {
 	return pawn->cur_tile->height != +2;
 }
 
@@ -151,12 +189,12 @@ static void lower_tile(pawn_ptr pawn, const Tile::List &, ServerGameState *state
 	state->set_tile_height(pawn->cur_tile, pawn->cur_tile->height - 1);
 }
 
-static bool can_lower_tile(pawn_ptr pawn, const Tile::List &, ServerGameState *) {
+static bool can_lower_tile(pawn_ptr pawn, const Tile::List &, GameState *) {
 	return pawn->cur_tile->height != -2;
 }
 
 // Common test function for dig & elevate.
-static bool can_dig_elevate_tiles(const Tile::List &area, ServerGameState *, int target_elevation) {
+static bool can_dig_elevate_tiles(const Tile::List &area, GameState *, int target_elevation) {
 	for(Tile::List::const_iterator i = area.begin(); i != area.end(); i++) {
 		if((*i)->height != target_elevation) {
 			return true;
@@ -180,7 +218,7 @@ static void use_elevate_power(pawn_ptr pawn, const Tile::List &area, ServerGameS
 	dig_elevate_tiles(pawn, area, state, +2);
 }
 
-static bool test_elevate_power(pawn_ptr /*pawn*/, const Tile::List &area, ServerGameState *state) {
+static bool test_elevate_power(pawn_ptr /*pawn*/, const Tile::List &area, GameState *state) {
 	return can_dig_elevate_tiles(area, state, +2);
 }
 
@@ -189,7 +227,7 @@ static void use_dig_power(pawn_ptr pawn, const Tile::List &area, ServerGameState
 	dig_elevate_tiles(pawn, area, state, -2);
 }
 
-static bool test_dig_power(pawn_ptr /*pawn*/, const Tile::List &area, ServerGameState *state) {
+static bool test_dig_power(pawn_ptr /*pawn*/, const Tile::List &area, GameState *state) {
 	return can_dig_elevate_tiles(area, state, -2);
 }
 
@@ -220,7 +258,7 @@ static void use_purify_power(pawn_ptr pawn, const Tile::List &area, ServerGameSt
 	}
 }
 
-static bool test_purify_power(pawn_ptr pawn, const Tile::List &area, ServerGameState *) {
+static bool test_purify_power(pawn_ptr pawn, const Tile::List &area, GameState *) {
 	for(Tile::List::const_iterator i = area.begin(); i != area.end(); i++) {
 		if((*i)->has_mine && (*i)->mine_colour != pawn->colour) {
 			return true;
@@ -254,7 +292,7 @@ static void use_pickup_power(pawn_ptr pawn, const Tile::List &area, ServerGameSt
 	}
 }
 
-static bool test_pickup_power(pawn_ptr /*pawn*/, const Tile::List &area, ServerGameState *) {
+static bool test_pickup_power(pawn_ptr /*pawn*/, const Tile::List &area, GameState *) {
 	for(Tile::List::const_iterator i = area.begin(); i != area.end(); i++) {
 		if((*i)->has_power) {
 			return true;
@@ -278,7 +316,7 @@ static void use_repaint_power(pawn_ptr pawn, const Tile::List &area, ServerGameS
 	}
 }
 
-static bool test_repaint_power(pawn_ptr pawn, const Tile::List &area, ServerGameState *) {
+static bool test_repaint_power(pawn_ptr pawn, const Tile::List &area, GameState *) {
 	for(Tile::List::const_iterator i = area.begin(); i != area.end(); i++) {
 		if ((*i)->has_mine && (*i)->mine_colour != pawn->colour)
 			return true;
@@ -317,7 +355,7 @@ static void use_wrap_power(pawn_ptr, const Tile::List &area, ServerGameState *st
 	}
 }
 
-static bool test_wrap_power(pawn_ptr, const Tile::List &area, ServerGameState *state, int direction) {
+static bool test_wrap_power(pawn_ptr, const Tile::List &area, GameState *state, int direction) {
 	for (Tile::List::const_iterator it = area.begin(); it != area.end(); it++) {
 		if (direction == Powers::Power::east_west) {
 			if (!state->tile_left_of(*it) && !((*it)->wrap & (1 << Tile::WRAP_LEFT)))
@@ -346,9 +384,14 @@ static void teleport(pawn_ptr pawn, const Tile::List &, ServerGameState *state)
 	state->teleport_hack(pawn);
 }
 
-static bool can_teleport(pawn_ptr, const Tile::List &, ServerGameState *state) {
-	Tile::List targets = RandomTiles(state->tiles, 1, false, false, false, false);
-	return !targets.empty();
+static bool can_teleport(pawn_ptr, const Tile::List &, GameState *state) {
+	// The AI asks too, so this mustn't use up random numbers.
+	for(Tile::List::iterator t = state->tiles.begin(); t != state->tiles.end(); ++t) {
+		if(!(*t)->smashed && !(*t)->has_black_hole && !(*t)->has_mine && !(*t)->pawn) {
+			return true;
+		}
+	}
+	return false;
 }
 
 /// Mine: Add a mine modification to the targeted area.
@@ -359,7 +402,7 @@ static bool can_mine_tile(Tile *tile) {
 	return true;
 }
 
-static bool test_mine_power(pawn_ptr /*pawn*/, const Tile::List &area, ServerGameState *) {
+static bool test_mine_power(pawn_ptr /*pawn*/, const Tile::List &area, GameState *) {
 	for(Tile::List::const_iterator i = area.begin(); i != area.end(); ++i) {
 		if(can_mine_tile(*i)) {
 			return true;
@@ -398,7 +441,7 @@ static void landing_pad(pawn_ptr pawn, const Tile::List &area, ServerGameState *
 	}
 }
 
-static bool can_landing_pad(pawn_ptr pawn, const Tile::List &area, ServerGameState *) {
+static bool can_landing_pad(pawn_ptr pawn, const Tile::List &area, GameState *) {
 	for(Tile::List::const_iterator i = area.begin(); i != area.end(); ++i) {
 		if(can_landing_pad_tile(pawn, *i)) {
 			return true;
@@ -413,7 +456,7 @@ static bool can_landing_pad(pawn_ptr pawn, const Tile::List &area, ServerGameSta
 static void black_hole(pawn_ptr pawn, const Tile::List &, ServerGameState *state) {
 	Tile *tile = pawn->cur_tile;
 	state->destroy_pawn(pawn, Pawn::BLACKHOLE, pawn);
-	state->add_animator("ohshitifelldownahole", tile);
+	state->add_animator(protocol::FALL, tile);
 	tile->has_black_hole = true;
 	tile->black_hole_power = pawn->range + 1;
 	tile->has_mine = false;
@@ -422,7 +465,7 @@ static void black_hole(pawn_ptr pawn, const Tile::List &, ServerGameState *state
 	state->update_tile(tile);
 }
 
-static bool can_black_hole(pawn_ptr, const Tile::List &, ServerGameState *) {
+static bool can_black_hole(pawn_ptr, const Tile::List &, GameState *) {
 	return true;
 }
 
@@ -433,11 +476,11 @@ static void increase_range(pawn_ptr pawn, const Tile::List &, ServerGameState *s
 	state->update_pawn(pawn);
 }
 
-static bool can_increase_range(pawn_ptr pawn, const Tile::List &, ServerGameState *) {
+static bool can_increase_range(pawn_ptr pawn, const Tile::List &, GameState *) {
 	return (pawn->range < 3);
 }
 
-static bool can_use_upgrade(pawn_ptr pawn, const Tile::List &, ServerGameState *, uint32_t upgrade)
+static bool can_use_upgrade(pawn_ptr pawn, const Tile::List &, GameState *, uint32_t upgrade)
 {
 	return !(pawn->flags & upgrade);
 }
@@ -454,13 +497,13 @@ static void use_eye(pawn_ptr pawn, const Tile::List &, ServerGameState *state)
 	state->update_tile(pawn->cur_tile);
 }
 
-static bool can_eye(pawn_ptr pawn, const Tile::List &, ServerGameState *) {
+static bool can_eye(pawn_ptr pawn, const Tile::List &, GameState *) {
 	if(pawn->cur_tile->has_eye && pawn->cur_tile->eye_colour == pawn->colour) return false;
 	if(pawn->cur_tile->has_black_hole) return false;
 	return true;
 }
 
-static bool can_worm(pawn_ptr, const Tile::List &, ServerGameState *) {
+static bool can_worm(pawn_ptr, const Tile::List &, GameState *) {
 	return true;
 }
 
@@ -469,7 +512,7 @@ static void use_worm(pawn_ptr pawn, const Tile::List &, ServerGameState *state)
 }
 
 /// Scramble Powers: Change a pawn's powers into the same number of randomly chosen ones
-static bool can_scramble(pawn_ptr pawn, const Tile::List &, ServerGameState *) {
+static bool can_scramble(pawn_ptr pawn, const Tile::List &, GameState *) {
 	return pawn->powers.size() > 1; // Not including the scramble power.
 }
 
@@ -491,13 +534,13 @@ static void use_scramble(pawn_ptr pawn, const Tile::List &, ServerGameState *sta
 
 	// Add new powers.
 	for(int i = 0; i < total_powers; ++i) {
-		pawn->AddPower(Powers::RandomPower(false));
+		pawn->AddPower(Powers::RandomPower(state->rng, false));
 	}
 	state->update_pawn(pawn);
 }
 
 /// Prod: Do thing.
-static bool can_prod(pawn_ptr, const Tile::List &, ServerGameState *) {
+static bool can_prod(pawn_ptr, const Tile::List &, GameState *) {
 	return true;
 }
 
@@ -509,7 +552,7 @@ static void use_prod(pawn_ptr pawn, const Tile::List &area, ServerGameState *sta
 		if(tile->pawn) {
 			tile->pawn->detonate_mine(state);
 		} else {
-			state->add_animator("boom", tile);
+			state->add_animator(protocol::BOOM, tile);
 			tile->has_mine = false;
 			state->update_tile(tile);
 		}
@@ -521,11 +564,12 @@ static void use_prod(pawn_ptr pawn, const Tile::List &area, ServerGameState *sta
 
 static void def_power(const char *name,
 		      boost::function<void(pawn_ptr, const std::vector<Tile *> &, ServerGameState *)> use_fn,
-		      boost::function<bool(pawn_ptr, const std::vector<Tile *> &, ServerGameState *)> test_fn,
+		      boost::function<bool(pawn_ptr, const std::vector<Tile *> &, GameState *)> test_fn,
 		      int probability, unsigned int direction,
+		      unsigned int preconditions = 0,
 		      unsigned int requirements = 0)
 {
-	powers.push_back((Power){name, use_fn, test_fn, probability, direction, requirements});
+	powers.push_back((Power){name, use_fn, test_fn, probability, direction, requirements, preconditions});
 }
 
 static void def_upgrade_power(const char *name, uint32_t upgrade, int probability, unsigned int requirements = 0)
@@ -535,24 +579,37 @@ static void def_upgrade_power(const char *name, uint32_t upgrade, int probabilit
 		  boost::bind(can_use_upgrade, _1, _2, _3, upgrade),
 		  probability,
 		  Powers::Power::undirected,
+		  0,
 		  requirements);
 }
 
 std::vector<Powers::Power> Powers::powers;
 void Powers::init_powers()
 {
-	def_power("Destroy",         use_destroy_power,    test_destroy_power,    100, Powers::Power::linear|Powers::Power::radial);
-	def_power("Annihilate",      use_annihilate_power, test_annihilate_power, 100, Powers::Power::linear|Powers::Power::radial);
-	def_power("Smash",           use_smash_power,      test_smash_power,      100, Powers::Power::linear|Powers::Power::radial);
-	def_power("Elevate",         use_elevate_power,    test_elevate_power,     70, Powers::Power::linear|Powers::Power::radial);
-	def_power("Dig",             use_dig_power,        test_dig_power,         70, Powers::Power::linear|Powers::Power::radial);
-	def_power("Purify",          use_purify_power,     test_purify_power,     100, Powers::Power::linear|Powers::Power::radial);
-	def_power("Mine",            use_mine_power,       test_mine_power,        80, Powers::Power::linear|Powers::Power::radial);
-	def_power("Pick Up",         use_pickup_power,     test_pickup_power,     100, Powers::Power::linear|Powers::Power::radial);
-	def_power("Repaint",         use_repaint_power,    test_repaint_power,    100, Powers::Power::linear|Powers::Power::radial);
-	def_power("Confuse",         use_confuse_power,    test_confuse_power,     60, Powers::Power::linear|Powers::Power::radial);
-	def_power("Hijack",          use_hijack_power,     test_hijack_power,      50, Powers::Power::linear|Powers::Power::radial);
-	def_power("Landing Pad",     landing_pad,          can_landing_pad,        60, Powers::Power::point);
+	def_power("Destroy",         use_destroy_power,    test_destroy_power,    100, Powers::Power::linear|Powers::Power::radial,
+	          Powers::AREA_ENEMY_PAWN);
+	def_power("Annihilate",      use_annihilate_power, test_annihilate_power, 100, Powers::Power::linear|Powers::Power::radial,
+	          Powers::AREA_PAWN);
+	def_power("Smash",           use_smash_power,      test_smash_power,      100, Powers::Power::linear|Powers::Power::radial,
+	          Powers::AREA_ENEMY_PAWN);
+	def_power("Elevate",         use_elevate_power,    test_elevate_power,     70, Powers::Power::linear|Powers::Power::radial,
+	          Powers::AREA_BELOW_MAX);
+	def_power("Dig",             use_dig_power,        test_dig_power,         70, Powers::Power::linear|Powers::Power::radial,
+	          Powers::AREA_ABOVE_MIN);
+	def_power("Purify",          use_purify_power,     test_purify_power,     100, Powers::Power::linear|Powers::Power::radial,
+	          Powers::AREA_FOREIGN_FEATURE | Powers::AREA_PURIFIABLE_PAWN);
+	def_power("Mine",            use_mine_power,       test_mine_power,        80, Powers::Power::linear|Powers::Power::radial,
+	          Powers::AREA_MINEABLE);
+	def_power("Pick Up",         use_pickup_power,     test_pickup_power,     100, Powers::Power::linear|Powers::Power::radial,
+	          Powers::AREA_ORB);
+	def_power("Repaint",         use_repaint_power,    test_repaint_power,    100, Powers::Power::linear|Powers::Power::radial,
+	          Powers::AREA_FOREIGN_FEATURE);
+	def_power("Confuse",         use_confuse_power,    test_confuse_power,     60, Powers::Power::linear|Powers::Power::radial,
+	          Powers::AREA_UNCONFUSED_ENEMY);
+	def_power("Hijack",          use_hijack_power,     test_hijack_power,      50, Powers::Power::linear|Powers::Power::radial,
+	          Powers::AREA_ENEMY_PAWN);
+	def_power("Landing Pad",     landing_pad,          can_landing_pad,        60, Powers::Power::point,
+	          Powers::AREA_PADDABLE);
 
 	def_power("Raise Tile",      raise_tile,           can_raise_tile,         50, Powers::Power::undirected);
 	def_power("Lower Tile",      lower_tile,           can_lower_tile,         50, Powers::Power::undirected);
@@ -564,7 +621,7 @@ void Powers::init_powers()
 
 	def_power("Prod",            use_prod,             can_prod,              100, Powers::Power::adjacent);
 
-	def_power("Watchful Eye",    use_eye,              can_eye,                20, Powers::Power::undirected, Powers::REQ_FOG_OF_WAR);
+	def_power("Watchful Eye",    use_eye,              can_eye,                20, Powers::Power::undirected, 0, Powers::REQ_FOG_OF_WAR);
 
 	def_upgrade_power("Hover",        PWR_CLIMB,       30);
 	def_upgrade_power("Shield",       PWR_SHIELD,      30);
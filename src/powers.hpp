@@ -6,6 +6,7 @@
 
 #include "hexradius.hpp"
 
+class GameState;
 class ServerGameState;
 class Tile;
 
@@ -21,12 +22,27 @@ const uint32_t PWR_GOOD = (PWR_SHIELD | PWR_CLIMB | PWR_INVISIBLE | PWR_INFRAVIS
 namespace Powers {
 	const unsigned int REQ_FOG_OF_WAR = 1<<0;
 
+	// Properties of a target area, see area_properties().
+	// A power whose area has none of its preconditions can't do anything
+	// there, so there is no point in calling can_use.
+	const unsigned int AREA_PAWN             = 1<<0; // Any pawn.
+	const unsigned int AREA_ENEMY_PAWN       = 1<<1;
+	const unsigned int AREA_UNCONFUSED_ENEMY = 1<<2;
+	const unsigned int AREA_PURIFIABLE_PAWN  = 1<<3; // Enemy with upgrades or friend with bad flags.
+	const unsigned int AREA_FOREIGN_FEATURE  = 1<<4; // Mine, landing pad or eye of another colour.
+	const unsigned int AREA_ORB              = 1<<5;
+	const unsigned int AREA_BELOW_MAX        = 1<<6; // Tile that can be raised.
+	const unsigned int AREA_ABOVE_MIN        = 1<<7; // Tile that can be lowered.
+	const unsigned int AREA_MINEABLE         = 1<<8;
+	const unsigned int AREA_PADDABLE         = 1<<9;
+
 	struct Power {
 		const char *name;
 		// Acually use the power.
 		boost::function<void(pawn_ptr, const std::vector<Tile *> &, ServerGameState *)> func;
 		// Verify that the power can be used and will do something.
-		boost::function<bool(pawn_ptr, const std::vector<Tile *> &, ServerGameState *)> can_use;
+		// Only looks at the board, so clients can ask too.
+		boost::function<bool(pawn_ptr, const std::vector<Tile *> &, GameState *)> can_use;
 		int spawn_rate;
 
 		enum {
@@ -59,12 +75,19 @@ namespace Powers {
 
 		// Spawn requirements.
 		unsigned int requirements;
+
+		// AREA_* properties, at least one of which the target area must
+		// have for the power to be usable. Zero if there is no cheap test.
+		unsigned int preconditions;
 	};
 
 	extern std::vector<Power> powers;
 	void init_powers();
 
-	int RandomPower(bool fog_of_war);
+	// Compute the AREA_* properties of an area for a pawn.
+	unsigned int area_properties(pawn_ptr pawn, const std::vector<Tile *> &area);
+
+	int RandomPower(game_rng &rng, bool fog_of_war);
 }
 
 #endif /* !POWERS_HPP */
@@ -0,0 +1,275 @@
+#include <stdio.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <algorithm>
+#include <boost/bind.hpp>
+
+#include "relay.hpp"
+
+// Ask for a new snapshot once what has happened since is this many times
+// its size, but not before there is at least history_min of it.
+static const size_t history_factor = 4;
+static const size_t history_min = 256 * 1024;
+
+Relay::Relay(const std::string &server, uint16_t server_port, const std::string &room, uint16_t port) :
+	acceptor(io_service), upstream(io_service), room(room),
+	history_bytes(0), snapshot_bytes(0), snapshot(0), refreshing(false), msgsize(0)
+{
+	boost::asio::ip::tcp::resolver resolver(io_service);
+	boost::asio::ip::tcp::resolver::query query(server, "");
+	boost::asio::ip::tcp::endpoint ep = *resolver.resolve(query);
+	ep.port(server_port);
+
+	upstream.connect(ep);
+	upstream.set_option(boost::asio::ip::tcp::no_delay(true));
+
+	boost::asio::ip::tcp::endpoint endpoint(boost::asio::ip::tcp::v4(), port);
+
+	acceptor.open(endpoint.protocol());
+	acceptor.set_option(boost::asio::ip::tcp::acceptor::reuse_address(true));
+	acceptor.bind(endpoint);
+	acceptor.listen();
+}
+
+void Relay::run() {
+	watch();
+	ReadSize();
+	StartAccept();
+
+	io_service.run();
+}
+
+void Relay::watch() {
+	protocol::message msg;
+	msg.set_msg(protocol::WATCH);
+	msg.set_room(room);
+
+	send_buf frame(msg);
+
+	// Sent rarely and small, so block rather than queue.
+	boost::system::error_code ec;
+	boost::asio::write(upstream, boost::asio::buffer(frame.buf.get(), frame.size), ec);
+	if(ec) {
+		fprintf(stderr, "Relay write error: %s\n", ec.message().c_str());
+	}
+
+	refreshing = true;
+}
+
+void Relay::StartAccept() {
+	viewer::ptr v(new viewer(*this));
+	acceptor.async_accept(v->socket, boost::bind(&Relay::HandleAccept, this, v, boost::asio::placeholders::error));
+}
+
+void Relay::HandleAccept(viewer::ptr v, const boost::system::error_code &error) {
+	if(error) {
+		if(error != boost::asio::error::operation_aborted) {
+			fprintf(stderr, "Relay accept error: %s\n", error.message().c_str());
+			StartAccept();
+		}
+		return;
+	}
+
+	boost::system::error_code ec;
+	v->socket.set_option(boost::asio::ip::tcp::no_delay(true), ec);
+
+	viewers.insert(v);
+	// With nothing to send yet, wait for the first snapshot.
+	v->snapshot = history.empty() ? snapshot + 1 : snapshot;
+
+	for(std::vector<send_buf>::iterator i = history.begin(); i != history.end(); ++i) {
+		v->Write(*i);
+	}
+
+	v->BeginRead();
+	StartAccept();
+}
+
+void Relay::ReadSize() {
+	async_read(upstream, boost::asio::buffer(&msgsize, sizeof(uint32_t)),
+		boost::bind(&Relay::FinishReadSize, this, boost::asio::placeholders::error));
+}
+
+void Relay::FinishReadSize(const boost::system::error_code &error) {
+	uint32_t size = ntohl(msgsize);
+
+	if(error) {
+		lost_server(error.message());
+		return;
+	}
+	if(size > MAX_MSGSIZE) {
+		lost_server("Oversized message");
+		return;
+	}
+
+	// Keep the size with the message so the frame can be passed on as is.
+	msgbuf.reset(new char[size + sizeof(uint32_t)]);
+	memcpy(msgbuf.get(), &msgsize, sizeof(uint32_t));
+
+	async_read(upstream, boost::asio::buffer(msgbuf.get() + sizeof(uint32_t), size),
+		boost::bind(&Relay::FinishRead, this, boost::asio::placeholders::error));
+}
+
+void Relay::FinishRead(const boost::system::error_code &error) {
+	if(error) {
+		lost_server(error.message());
+		return;
+	}
+
+	handle_frame(send_buf(msgbuf, ntohl(msgsize) + sizeof(uint32_t)));
+	ReadSize();
+}
+
+void Relay::lost_server(const std::string &why) {
+	fprintf(stderr, "Relay lost the server: %s\n", why.c_str());
+
+	boost::system::error_code ec;
+	acceptor.close(ec);
+	upstream.close(ec);
+
+	// Viewers still being written to are closed once they have
+	// everything, so they see why the room went.
+	std::set<viewer::ptr> v = viewers;
+	for(std::set<viewer::ptr>::iterator i = v.begin(); i != v.end(); ++i) {
+		if(!(*i)->write_batch) {
+			(*i)->Close();
+		}
+	}
+}
+
+void Relay::handle_frame(const send_buf &frame) {
+	protocol::message msg;
+	if(!msg.ParseFromArray(frame.buf.get() + sizeof(uint32_t), frame.size - sizeof(uint32_t))) {
+		fprintf(stderr, "Relay: Invalid message recieved\n");
+		return;
+	}
+
+	if(msg.snapshot()) {
+		if(msg.msg() == protocol::GINFO) {
+			// A new snapshot replaces everything before it.
+			history.clear();
+			history_bytes = snapshot_bytes = 0;
+			snapshot++;
+			refreshing = false;
+		}
+
+		history.push_back(frame);
+		history_bytes += frame.size;
+		snapshot_bytes += frame.size;
+
+		// Only viewers that joined part way through want the rest of it,
+		// anyone else is already past this point.
+		std::set<viewer::ptr> v = viewers;
+		for(std::set<viewer::ptr>::iterator i = v.begin(); i != v.end(); ++i) {
+			if((*i)->snapshot == snapshot) {
+				(*i)->Write(frame);
+			}
+		}
+
+		return;
+	}
+
+	history.push_back(frame);
+	history_bytes += frame.size;
+
+	std::set<viewer::ptr> v = viewers;
+	for(std::set<viewer::ptr>::iterator i = v.begin(); i != v.end(); ++i) {
+		(*i)->Write(frame);
+	}
+
+	if(!refreshing && history_bytes > std::max(snapshot_bytes * history_factor, history_min)) {
+		watch();
+	}
+}
+
+void Relay::viewer::Write(const send_buf &frame) {
+	if(!socket.is_open()) {
+		return;
+	}
+
+	send_queue.push_back(frame);
+	queued_bytes += frame.size;
+
+	if(queued_bytes > (size_t)options.send_queue_kb * 1024 || send_queue.size() > (size_t)options.send_queue_frames) {
+		fprintf(stderr, "Relay: Disconnecting viewer, send queue at %u frames, %u bytes\n",
+			(unsigned int)send_queue.size(), (unsigned int)queued_bytes);
+		Close();
+		return;
+	}
+
+	if(!write_batch) {
+		StartWrite();
+	}
+}
+
+void Relay::viewer::StartWrite() {
+	std::vector<boost::asio::const_buffer> buffers;
+	size_t bytes = 0;
+
+	for(std::deque<send_buf>::iterator i = send_queue.begin(); i != send_queue.end(); ++i) {
+		if(!buffers.empty() && (buffers.size() == MAX_WRITE_FRAMES || bytes + i->size > MAX_WRITE_BYTES)) {
+			break;
+		}
+
+		buffers.push_back(boost::asio::buffer(i->buf.get(), i->size));
+		bytes += i->size;
+	}
+
+	write_batch = buffers.size();
+	async_write(socket, buffers, boost::bind(&viewer::FinishWrite, shared_from_this(), boost::asio::placeholders::error));
+}
+
+void Relay::viewer::FinishWrite(const boost::system::error_code &error) {
+	for(size_t i = 0; i < write_batch; ++i) {
+		queued_bytes -= send_queue[i].size;
+	}
+	send_queue.erase(send_queue.begin(), send_queue.begin() + write_batch);
+	write_batch = 0;
+
+	if(error) {
+		Close();
+		return;
+	}
+
+	if(!send_queue.empty()) {
+		StartWrite();
+	}else if(!relay.upstream.is_open()) {
+		Close();
+	}
+}
+
+void Relay::viewer::BeginRead() {
+	async_read(socket, boost::asio::buffer(&msgsize, sizeof(uint32_t)),
+		boost::bind(&viewer::FinishReadSize, shared_from_this(), boost::asio::placeholders::error));
+}
+
+void Relay::viewer::FinishReadSize(const boost::system::error_code &error) {
+	uint32_t size = ntohl(msgsize);
+
+	if(error || size > MAX_MSGSIZE) {
+		Close();
+		return;
+	}
+
+	msgbuf.resize(size);
+	async_read(socket, boost::asio::buffer(msgbuf),
+		boost::bind(&viewer::FinishRead, shared_from_this(), boost::asio::placeholders::error));
+}
+
+void Relay::viewer::FinishRead(const boost::system::error_code &error) {
+	if(error) {
+		Close();
+		return;
+	}
+
+	BeginRead();
+}
+
+void Relay::viewer::Close() {
+	boost::system::error_code ec;
+	socket.close(ec);
+
+	// The queue goes with the viewer, once any write still running on it
+	// has finished.
+	relay.viewers.erase(shared_from_this());
+}
@@ -0,0 +1,95 @@
+#ifndef RELAY_HPP
+#define RELAY_HPP
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <set>
+#include <boost/asio.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/enable_shared_from_this.hpp>
+
+#include "hexradius.hpp"
+
+/* Watches one room on a server and passes what it sends on to any number
+ * of spectators, so the server only does the work of one. A spectator
+ * connecting late gets the last snapshot of the room and everything since,
+ * and the relay asks for a new snapshot once that gets much bigger than
+ * the snapshot itself.
+ *
+ * Frames are passed on as they were read, without parsing them again for
+ * each spectator.
+*/
+class Relay {
+public:
+	Relay(const std::string &server, uint16_t server_port, const std::string &room, uint16_t port);
+
+	// Relay until the server closes the connection.
+	void run();
+
+private:
+	struct viewer : public boost::enable_shared_from_this<viewer> {
+		typedef boost::shared_ptr<viewer> ptr;
+
+		viewer(Relay &relay) : relay(relay), socket(relay.io_service), queued_bytes(0), write_batch(0), snapshot(0) {}
+
+		Relay &relay;
+		boost::asio::ip::tcp::socket socket;
+
+		std::deque<send_buf> send_queue;
+		size_t queued_bytes;
+		// Frames at the front of send_queue being written, 0 if idle.
+		size_t write_batch;
+
+		// Snapshot the viewer started from.
+		unsigned int snapshot;
+
+		uint32_t msgsize;
+		std::vector<char> msgbuf;
+
+		void Write(const send_buf &frame);
+		void StartWrite();
+		void FinishWrite(const boost::system::error_code &error);
+
+		// Anything the viewer sends is ignored, reading is only to
+		// notice it going.
+		void BeginRead();
+		void FinishReadSize(const boost::system::error_code &error);
+		void FinishRead(const boost::system::error_code &error);
+
+		void Close();
+	};
+
+	boost::asio::io_service io_service;
+	boost::asio::ip::tcp::acceptor acceptor;
+	boost::asio::ip::tcp::socket upstream;
+	std::string room;
+
+	std::set<viewer::ptr> viewers;
+
+	// The last snapshot and everything since.
+	std::vector<send_buf> history;
+	size_t history_bytes, snapshot_bytes;
+	unsigned int snapshot;
+	bool refreshing;
+
+	uint32_t msgsize;
+	send_buf::buf_ptr msgbuf;
+
+	void StartAccept();
+	void HandleAccept(viewer::ptr v, const boost::system::error_code &error);
+
+	void ReadSize();
+	void FinishReadSize(const boost::system::error_code &error);
+	void FinishRead(const boost::system::error_code &error);
+	void handle_frame(const send_buf &frame);
+	// Stop taking viewers and close them once they have been sent
+	// everything, which ends run().
+	void lost_server(const std::string &why);
+
+	// Ask the server for a new snapshot.
+	void watch();
+};
+
+#endif /* !RELAY_HPP */
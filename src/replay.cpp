@@ -0,0 +1,640 @@
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <map>
+#include <sstream>
+#include <iostream>
+#include <stdexcept>
+#include <arpa/inet.h>
+#include <boost/bind.hpp>
+#include <boost/filesystem.hpp>
+
+#include "replay.hpp"
+#include "network.hpp"
+#include "gamestate.hpp"
+#include "chunk.hpp"
+
+using boost::asio::ip::tcp;
+
+// Seconds on the monotonic clock.
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+uint64_t scenario_hash(const protocol::packed_board &board)
+{
+	std::string pb;
+	board.SerializeToString(&pb);
+
+	// FNV-1a.
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	for(size_t i = 0; i < pb.size(); ++i) {
+		hash ^= (unsigned char)pb[i];
+		hash *= 0x100000001b3ULL;
+	}
+
+	return hash;
+}
+
+ReplayWriter::ReplayWriter() : stopping(false)
+{
+	thread = boost::thread(boost::bind(&ReplayWriter::run, this));
+}
+
+ReplayWriter::~ReplayWriter()
+{
+	{
+		boost::lock_guard<boost::mutex> lock(mutex);
+		stopping = true;
+	}
+
+	wake.notify_one();
+	thread.join();
+}
+
+void ReplayWriter::append(const std::string &filename, const std::string &data, bool last)
+{
+	job j;
+	j.filename = filename;
+	j.data = data;
+	j.last = last;
+
+	{
+		boost::lock_guard<boost::mutex> lock(mutex);
+		jobs.push_back(j);
+	}
+
+	wake.notify_one();
+}
+
+void ReplayWriter::run()
+{
+	// Open logs, NULL for ones that couldn't be opened.
+	std::map<std::string, FILE*> files;
+
+	while(1) {
+		std::deque<job> todo;
+
+		{
+			boost::unique_lock<boost::mutex> lock(mutex);
+			while(jobs.empty() && !stopping) {
+				wake.wait(lock);
+			}
+
+			if(jobs.empty()) {
+				break;
+			}
+
+			todo.swap(jobs);
+		}
+
+		for(std::deque<job>::iterator j = todo.begin(); j != todo.end(); ++j) {
+			std::map<std::string, FILE*>::iterator f = files.find(j->filename);
+			if(f == files.end()) {
+				boost::filesystem::path path(j->filename);
+				boost::system::error_code ec;
+				if(path.has_parent_path()) {
+					boost::filesystem::create_directories(path.parent_path(), ec);
+				}
+
+				FILE *fh = fopen(j->filename.c_str(), "ab");
+				if(!fh) {
+					fprintf(stderr, "Can't write game log %s\n", j->filename.c_str());
+				}
+
+				f = files.insert(std::make_pair(j->filename, fh)).first;
+			}
+
+			if(f->second && !j->data.empty() && fwrite(j->data.data(), j->data.size(), 1, f->second) != 1) {
+				fprintf(stderr, "Error writing game log %s\n", j->filename.c_str());
+				fclose(f->second);
+				f->second = NULL;
+			}
+
+			if(j->last) {
+				if(f->second) {
+					fclose(f->second);
+				}
+				files.erase(f);
+			}
+		}
+
+		// Whatever was queued is on disk before waiting for more.
+		for(std::map<std::string, FILE*>::iterator f = files.begin(); f != files.end(); ++f) {
+			if(f->second) {
+				fflush(f->second);
+			}
+		}
+	}
+
+	for(std::map<std::string, FILE*>::iterator f = files.begin(); f != files.end(); ++f) {
+		if(f->second) {
+			fclose(f->second);
+		}
+	}
+}
+
+ReplayLog::ReplayLog(ReplayWriter &writer, const std::string &filename, protocol::replay_record &header) :
+	writer(writer), filename(filename)
+{
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	writer.append(filename, "HRR1", false);
+	append(header);
+}
+
+ReplayLog::~ReplayLog()
+{
+	writer.append(filename, std::string(), true);
+}
+
+void ReplayLog::action(uint16_t player_id, const protocol::message &msg)
+{
+	protocol::replay_record record;
+	record.set_player_id(player_id);
+	record.mutable_action()->CopyFrom(msg);
+
+	append(record);
+}
+
+void ReplayLog::append(protocol::replay_record &record)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	record.set_time((now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000);
+
+	std::string data(sizeof(uint32_t), 0);
+	record.AppendToString(&data);
+
+	uint32_t size = htonl(data.size() - sizeof(uint32_t));
+	data.replace(0, sizeof(uint32_t), (const char*)&size, sizeof(uint32_t));
+
+	writer.append(filename, data, false);
+}
+
+Replay::Replay(const std::string &filename, unsigned int checkpoint_interval) :
+	checkpoint_interval(checkpoint_interval),
+	next(0), turns(0), collect(false), ended(false)
+{
+	FILE *fh = fopen(filename.c_str(), "rb");
+	if(!fh) {
+		throw std::runtime_error("Could not open " + filename);
+	}
+
+	char magic[4];
+	if(fread(magic, 4, 1, fh) != 1 || memcmp(magic, "HRR1", 4) != 0) {
+		fclose(fh);
+		throw std::runtime_error(filename + " is not a game log");
+	}
+
+	std::string pb;
+	uint32_t size;
+	while(fread(&size, sizeof(size), 1, fh) == 1) {
+		pb.resize(ntohl(size));
+		if(!pb.empty() && fread(&pb[0], pb.size(), 1, fh) != 1) {
+			// Cut short by the server going away, play what there is.
+			fprintf(stderr, "%s: Last record incomplete\n", filename.c_str());
+			break;
+		}
+
+		records.push_back(protocol::replay_record());
+		if(!records.back().ParseFromString(pb)) {
+			fclose(fh);
+			throw std::runtime_error("Bad record in " + filename);
+		}
+	}
+
+	fclose(fh);
+
+	if(records.empty() || !records[0].has_map_name()) {
+		throw std::runtime_error(filename + " has no header");
+	}
+
+	restart();
+}
+
+Replay::~Replay()
+{
+	if(room) {
+		room->close();
+		settle();
+	}
+}
+
+void Replay::new_room()
+{
+	if(room) {
+		room->close();
+		settle();
+	}
+
+	room.reset(new Room(io_service, NULL, "replay", header().map_name()));
+	room->fog_of_war = header().fog_of_war();
+	room->king_of_the_hill = header().king_of_the_hill();
+
+	ended = false;
+	inbox.clear();
+}
+
+// The watcher joins after the game has started, so it doesn't change who
+// goes first, and always spectates, so it never gets a turn.
+void Replay::add_watcher()
+{
+	boost::shared_ptr<Room::replay_client> watcher(new Room::replay_client(room, this));
+	watcher->id = WATCHER_ID;
+	watcher->playername = "Replay";
+	watcher->colour = SPECTATE;
+	watcher->score = 0;
+
+	room->clients.insert(watcher);
+}
+
+void Replay::restart()
+{
+	new_room();
+
+	protocol::message loaded;
+	room->game_state->serialize_packed(loaded);
+	if(scenario_hash(loaded.board()) != header().scenario_hash()) {
+		throw std::runtime_error("Game log was recorded on a different " + header().map_name());
+	}
+
+	for(int i = 0; i < header().players_size(); ++i) {
+		const protocol::player &p = header().players(i);
+
+		boost::shared_ptr<Room::replay_client> client(new Room::replay_client(room));
+		client->id = p.id();
+		client->playername = p.name();
+		client->colour = (PlayerColour)p.colour();
+		client->score = 0;
+
+		room->clients.insert(client);
+	}
+
+	room->StartGame(header().seed());
+	if(room->state != Room::GAME) {
+		throw std::runtime_error("Game in log could not be started");
+	}
+
+	add_watcher();
+	settle();
+
+	next = 1;
+	turns = 1;
+
+	if(checkpoints.empty()) {
+		save_checkpoint();
+	}
+}
+
+bool Replay::step()
+{
+	if(finished()) {
+		return false;
+	}
+
+	const protocol::replay_record &record = records[next++];
+	const protocol::message &action = record.action();
+
+	boost::shared_ptr<Room::base_client> client = room->get_client(record.player_id());
+
+	if(room->state == Room::GAME && client) {
+		if(action.msg() == protocol::MOVE || action.msg() == protocol::USE || action.msg() == protocol::RESIGN) {
+			room->handle_msg_game(client, action);
+		}else if(action.msg() == protocol::PQUIT) {
+			client->Quit("Left the game", false);
+		}
+	}
+
+	settle();
+
+	if(checkpoint_interval && turns >= checkpoints.back().turn + checkpoint_interval && room->state == Room::GAME) {
+		save_checkpoint();
+	}
+
+	return true;
+}
+
+void Replay::seek(unsigned int turn)
+{
+	// Latest checkpoint that isn't past the turn.
+	std::vector<checkpoint>::iterator c = checkpoints.begin();
+	while(c + 1 != checkpoints.end() && (c + 1)->turn <= turn) {
+		++c;
+	}
+
+	if(turn < turns || c->turn > turns) {
+		restore(*c);
+	}
+
+	while(turns < turn && step()) {}
+}
+
+uint32_t Replay::next_time() const
+{
+	return finished() ? records.back().time() : records[next].time();
+}
+
+void Replay::take_messages(std::vector<protocol::message> &out)
+{
+	collect = true;
+
+	out.insert(out.end(), inbox.begin(), inbox.end());
+	inbox.clear();
+}
+
+void Replay::describe(std::vector<protocol::message> &out) const
+{
+	room->snapshot(out, WATCHER_ID);
+}
+
+uint64_t Replay::board_hash() const
+{
+	protocol::message board;
+	room->game_state->serialize_packed(board);
+
+	return scenario_hash(board.board());
+}
+
+bool Replay::diverged() const
+{
+	const protocol::message &last = records.back().action();
+	if(last.msg() != protocol::GOVER) {
+		// The log stops before the end.
+		return false;
+	}
+
+	return !ended || gover.is_draw() != last.is_draw() || gover.player_id() != last.player_id();
+}
+
+void Replay::watch(const protocol::message &msg)
+{
+	if(msg.msg() == protocol::BATCH) {
+		for(int i = 0; i < msg.batch_size(); ++i) {
+			note(msg.batch(i));
+		}
+	}else{
+		note(msg);
+	}
+
+	if(collect) {
+		inbox.push_back(msg);
+	}
+}
+
+void Replay::note(const protocol::message &msg)
+{
+	if(msg.msg() == protocol::TURN) {
+		turns++;
+	}else if(msg.msg() == protocol::GOVER) {
+		gover = msg;
+		ended = true;
+	}
+}
+
+void Replay::save_checkpoint()
+{
+	checkpoints.push_back(checkpoint());
+	checkpoint &c = checkpoints.back();
+
+	c.record = next;
+	c.turn = turns;
+
+	room->game_state->serialize_packed(c.board);
+	for(Tile::List::iterator t = room->game_state->tiles.begin(); t != room->game_state->tiles.end(); ++t) {
+		c.powers.push_back((*t)->power);
+	}
+
+	std::ostringstream rng;
+	rng << room->game_state->rng;
+	c.rng = rng.str();
+
+	c.pspawn_turns = room->pspawn_turns;
+	c.pspawn_num = room->pspawn_num;
+
+	for(Room::client_set::iterator i = room->clients.begin(); i != room->clients.end(); ++i) {
+		if((*i)->id == WATCHER_ID) {
+			continue;
+		}
+
+		protocol::player p;
+		p.set_id((*i)->id);
+		p.set_name((*i)->playername);
+		p.set_colour((protocol::colour)(*i)->colour);
+		p.set_score((*i)->score);
+		c.players.push_back(p);
+	}
+
+	c.turn_id = room->turn != room->clients.end() ? (*room->turn)->id : -1;
+}
+
+void Replay::restore(const checkpoint &c)
+{
+	new_room();
+
+	ServerGameState *state = new ServerGameState(*room);
+	delete room->game_state;
+	room->game_state = state;
+
+	state->deserialize(c.board);
+	for(size_t i = 0; i < state->tiles.size() && i < c.powers.size(); ++i) {
+		state->tiles[i]->power = c.powers[i];
+	}
+
+	state->seed = header().seed();
+	std::istringstream rng(c.rng);
+	rng >> state->rng;
+
+	state->evaluator.sync(*state);
+
+	for(Tile::List::iterator t = state->tiles.begin(); t != state->tiles.end(); ++t) {
+		(*t)->mark_sent();
+		if((*t)->pawn) {
+			(*t)->pawn->mark_sent();
+		}
+	}
+
+	room->pspawn_turns = c.pspawn_turns;
+	room->pspawn_num = c.pspawn_num;
+
+	for(std::vector<protocol::player>::const_iterator p = c.players.begin(); p != c.players.end(); ++p) {
+		boost::shared_ptr<Room::replay_client> client(new Room::replay_client(room));
+		client->id = p->id();
+		client->playername = p->name();
+		client->colour = (PlayerColour)p->colour();
+		client->score = p->score();
+
+		room->clients.insert(client);
+	}
+
+	room->state = Room::GAME;
+	room->turn = room->clients.end();
+	for(Room::client_set::iterator i = room->clients.begin(); i != room->clients.end(); ++i) {
+		if((*i)->id == c.turn_id) {
+			room->turn = i;
+		}
+	}
+
+	add_watcher();
+
+	next = c.record;
+	turns = c.turn;
+}
+
+void Replay::settle()
+{
+	io_service.reset();
+	io_service.poll();
+}
+
+ReplayServer::ReplayServer(const std::string &filename, uint16_t port, unsigned int speed, unsigned int start_turn) :
+	filename(filename), speed(speed), start_turn(start_turn),
+	acceptor(io_service, tcp::endpoint(tcp::v4(), port)), socket(io_service)
+{
+	thread = boost::thread(boost::bind(&ReplayServer::run, this));
+}
+
+ReplayServer::~ReplayServer()
+{
+	thread.interrupt();
+
+	// Wakes the thread if it is blocked on the socket.
+	boost::system::error_code ec;
+	socket.shutdown(tcp::socket::shutdown_both, ec);
+	::shutdown(acceptor.native_handle(), SHUT_RDWR);
+
+	thread.join();
+}
+
+static void write_frame(tcp::socket &socket, const protocol::message &msg)
+{
+	send_buf frame(msg);
+	boost::asio::write(socket, boost::asio::buffer(frame.buf.get(), frame.size));
+}
+
+void ReplayServer::run()
+{
+	try {
+		acceptor.accept(socket);
+		socket.set_option(tcp::no_delay(true));
+
+		// Whatever the client says in its INIT, it gets the game.
+		uint32_t size;
+		boost::asio::read(socket, boost::asio::buffer(&size, sizeof(size)));
+		std::vector<char> init(ntohl(size));
+		boost::asio::read(socket, boost::asio::buffer(init));
+
+		Replay replay(filename);
+		replay.seek(start_turn);
+
+		std::vector<protocol::message> msgs;
+		replay.describe(msgs);
+
+		double start = now();
+		uint32_t start_time = replay.next_time();
+
+		while(1) {
+			for(std::vector<protocol::message>::iterator m = msgs.begin(); m != msgs.end(); ++m) {
+				write_frame(socket, *m);
+			}
+			msgs.clear();
+
+			if(replay.finished()) {
+				break;
+			}
+
+			if(speed) {
+				double due = start + (replay.next_time() - start_time) / 1000.0 / speed;
+				double wait = due - now();
+				if(wait > 0) {
+					boost::this_thread::sleep(boost::posix_time::milliseconds((long)(wait * 1000)));
+				}
+			}
+
+			replay.step();
+			replay.take_messages(msgs);
+		}
+
+		// Leave the end of the game up until the client goes.
+		boost::system::error_code ec;
+		while(1) {
+			boost::asio::read(socket, boost::asio::buffer(&size, sizeof(size)), ec);
+			if(ec) {
+				break;
+			}
+
+			std::vector<char> ignored(ntohl(size));
+			boost::asio::read(socket, boost::asio::buffer(ignored), ec);
+		}
+	} catch(boost::thread_interrupted &) {
+	} catch(std::exception &e) {
+		std::cerr << "Replay: " << e.what() << std::endl;
+	}
+}
+
+int run_replay(const std::string &filename, unsigned int seek_turn, unsigned int checkpoint_interval)
+{
+	try {
+		double start = now();
+		Replay replay(filename, checkpoint_interval);
+		double loaded = now();
+
+		while(replay.step()) {}
+		double played = now();
+
+		unsigned int turns = replay.turn();
+		uint64_t hash = replay.board_hash();
+
+		printf("%s: %s, %u players, %u turns, %lu records\n",
+			filename.c_str(), replay.header().map_name().c_str(),
+			(unsigned int)replay.header().players_size(), turns, (unsigned long)replay.records_played());
+		printf("load %.3f s, play %.3f s, %.0f turns/s, %.0f records/s\n",
+			loaded - start, played - loaded,
+			turns / (played - loaded), replay.records_played() / (played - loaded));
+
+		const protocol::message *result = replay.result();
+		if(result) {
+			printf("result: %s %u, board %016llx\n", result->is_draw() ? "draw" : "won by",
+				result->player_id(), (unsigned long long)hash);
+		}else{
+			printf("result: unfinished, board %016llx\n", (unsigned long long)hash);
+		}
+
+		if(replay.diverged()) {
+			fprintf(stderr, "Game played back differently to how it was logged\n");
+			return 1;
+		}
+
+		if(!seek_turn) {
+			seek_turn = turns / 2;
+		}
+
+		// Seeking from a checkpoint and playing from the start must agree.
+		double seek_start = now();
+		replay.seek(seek_turn);
+		double seeked = now();
+		uint64_t seek_hash = replay.board_hash();
+
+		Replay fresh(filename, 0);
+		double fresh_start = now();
+		fresh.seek(seek_turn);
+		double fresh_seeked = now();
+
+		printf("seek to turn %u: %.3f ms from a checkpoint, %.3f ms from the start, board %016llx\n",
+			replay.turn(), (seeked - seek_start) * 1000, (fresh_seeked - fresh_start) * 1000,
+			(unsigned long long)seek_hash);
+
+		if(fresh.board_hash() != seek_hash || fresh.turn() != replay.turn()) {
+			fprintf(stderr, "Seeking from a checkpoint gave a different board\n");
+			return 1;
+		}
+	} catch(std::exception &e) {
+		fprintf(stderr, "%s: %s\n", filename.c_str(), e.what());
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,176 @@
+#ifndef REPLAY_HPP
+#define REPLAY_HPP
+
+#include <stdint.h>
+#include <time.h>
+#include <string>
+#include <deque>
+#include <vector>
+#include <boost/asio.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+#include <boost/utility.hpp>
+
+#include "hexradius.pb.h"
+
+class Room;
+
+/* Game logs. A log is the "HRR1" magic followed by replay_record messages,
+ * each prefixed with its size as a big-endian uint32. The first record says
+ * what the game started from, the rest are the actions handed to the rules
+ * in the order they were handled. Together with the seed that is enough to
+ * play the game again.
+*/
+
+// Hash of a board, to check a log is played back on the map it came from.
+uint64_t scenario_hash(const protocol::packed_board &board);
+
+/* Appends to log files on a thread of its own, so nothing waiting on the
+ * disk holds up a room.
+*/
+class ReplayWriter : boost::noncopyable {
+public:
+	ReplayWriter();
+	// Writes out anything still queued.
+	~ReplayWriter();
+
+	// Append data to the file, closing it after if last is set.
+	void append(const std::string &filename, const std::string &data, bool last);
+
+private:
+	struct job {
+		std::string filename;
+		std::string data;
+		bool last;
+	};
+
+	boost::mutex mutex;
+	boost::condition_variable wake;
+	std::deque<job> jobs;
+	bool stopping;
+
+	boost::thread thread;
+	void run();
+};
+
+// The log of one game, closed when destroyed.
+class ReplayLog : boost::noncopyable {
+public:
+	ReplayLog(ReplayWriter &writer, const std::string &filename, protocol::replay_record &header);
+	~ReplayLog();
+
+	void action(uint16_t player_id, const protocol::message &msg);
+
+private:
+	ReplayWriter &writer;
+	std::string filename;
+	struct timespec start;
+
+	void append(protocol::replay_record &record);
+};
+
+/* Plays a game log back through the rules in a room of its own, as fast
+ * as step() is called. Every checkpoint_interval turns (0 for only at the
+ * start) the whole game is saved, so seeking only has to play forward from
+ * the nearest checkpoint before the turn wanted.
+*/
+class Replay : boost::noncopyable {
+public:
+	Replay(const std::string &filename, unsigned int checkpoint_interval = 10);
+	~Replay();
+
+	const protocol::replay_record &header() const { return records[0]; }
+
+	// Play the next record. Returns false at the end of the log.
+	bool step();
+	// Go to the start of a turn, or the end of the log if it is shorter.
+	void seek(unsigned int turn);
+
+	// Turns started so far, counting from 1.
+	unsigned int turn() const { return turns; }
+	bool finished() const { return next >= records.size(); }
+	// Milliseconds into the game of the next record.
+	uint32_t next_time() const;
+	size_t records_played() const { return next; }
+
+	// Messages the watcher has been sent since last taken.
+	void take_messages(std::vector<protocol::message> &out);
+	// Messages that bring a watcher joining now up to date.
+	void describe(std::vector<protocol::message> &out) const;
+
+	// Hash of the board as it is now.
+	uint64_t board_hash() const;
+	// GOVER from playing the game, NULL if it hasn't ended.
+	const protocol::message *result() const { return ended ? &gover : NULL; }
+	// True if the game didn't end the way the log says it did.
+	bool diverged() const;
+
+	// Called by the watcher with everything it is sent.
+	void watch(const protocol::message &msg);
+
+private:
+	struct checkpoint {
+		size_t record;
+		unsigned int turn;
+
+		protocol::message board;
+		std::vector<int> powers; // Of every tile, the board only has which have one.
+		std::string rng;
+		int pspawn_turns, pspawn_num;
+
+		std::vector<protocol::player> players; // Score included.
+		int turn_id; // -1 if nobody's.
+	};
+
+	std::vector<protocol::replay_record> records;
+	unsigned int checkpoint_interval;
+	std::vector<checkpoint> checkpoints;
+
+	boost::asio::io_service io_service;
+	boost::shared_ptr<Room> room;
+
+	size_t next;
+	unsigned int turns;
+
+	bool collect;
+	std::vector<protocol::message> inbox;
+
+	bool ended;
+	protocol::message gover;
+
+	void new_room();
+	void add_watcher();
+	// Count turns and look for the end of the game.
+	void note(const protocol::message &msg);
+	void restart();
+	void save_checkpoint();
+	void restore(const checkpoint &c);
+	// Run what the room has posted.
+	void settle();
+};
+
+/* Serves a game log to one GUI client as if it were a spectator in the
+ * game, speed times as fast as it was played or as fast as the client
+ * takes it if speed is 0.
+*/
+class ReplayServer : boost::noncopyable {
+public:
+	ReplayServer(const std::string &filename, uint16_t port, unsigned int speed, unsigned int start_turn);
+	~ReplayServer();
+
+private:
+	std::string filename;
+	unsigned int speed, start_turn;
+
+	boost::asio::io_service io_service;
+	boost::asio::ip::tcp::acceptor acceptor;
+	boost::asio::ip::tcp::socket socket;
+
+	boost::thread thread;
+	void run();
+};
+
+// Play a game log headless as a benchmark and check it plays back the same.
+int run_replay(const std::string &filename, unsigned int seek_turn, unsigned int checkpoint_interval);
+
+#endif /* !REPLAY_HPP */
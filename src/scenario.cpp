@@ -0,0 +1,71 @@
+#include <sys/stat.h>
+#include <map>
+#include <stdexcept>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+
+#include "scenario.hpp"
+#include "gamestate.hpp"
+#include "metrics.hpp"
+
+static Metrics::Counter scenario_loads("scenario_loads");
+static Metrics::Counter scenario_copies("scenario_copies");
+
+namespace {
+	struct scenario {
+		struct timespec mtime;
+		off_t size;
+
+		GameState board;
+	};
+
+	// By file, however it was named.
+	typedef std::pair<dev_t, ino_t> file_id;
+
+	boost::mutex mutex;
+	std::map<file_id, boost::shared_ptr<const scenario> > scenarios;
+}
+
+// The parsed scenario in filename, parsing it again if it has changed.
+static boost::shared_ptr<const scenario> get(const std::string &filename)
+{
+	struct stat st;
+	if(stat(filename.c_str(), &st) != 0) {
+		throw std::runtime_error("Could not open " + filename);
+	}
+
+	boost::unique_lock<boost::mutex> lock(mutex);
+
+	file_id id(st.st_dev, st.st_ino);
+	std::map<file_id, boost::shared_ptr<const scenario> >::iterator i = scenarios.find(id);
+	if(i != scenarios.end() && i->second->size == st.st_size &&
+	   i->second->mtime.tv_sec == st.st_mtim.tv_sec && i->second->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+		return i->second;
+	}
+
+	boost::shared_ptr<scenario> loaded(new scenario);
+	loaded->mtime = st.st_mtim;
+	loaded->size = st.st_size;
+	loaded->board.load_file(filename);
+
+	scenario_loads.add();
+
+	// Games copying the old board hold on to it until they're done.
+	scenarios[id] = loaded;
+	return loaded;
+}
+
+void Scenarios::load(GameState &state, const std::string &map_name)
+{
+	if(map_name.empty() || map_name.find('/') != std::string::npos) {
+		throw std::runtime_error("Bad scenario name " + map_name);
+	}
+
+	boost::shared_ptr<const scenario> s = get("scenario/" + map_name);
+
+	// Nothing changes a board once it is in the cache, so it can be
+	// copied without the lock.
+	state.copy(s->board);
+
+	scenario_copies.add();
+}
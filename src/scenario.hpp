@@ -0,0 +1,22 @@
+#ifndef SCENARIO_HPP
+#define SCENARIO_HPP
+
+#include <string>
+
+class GameState;
+
+/* Scenario files, parsed once for the whole process. Each file is kept as
+ * a board nobody plays on and games are copied from it, which saves reading
+ * and parsing the file every time a game starts. A file that has changed on
+ * disk since it was parsed is parsed again, so maps can be edited while the
+ * server is running.
+*/
+namespace Scenarios {
+	// Give state a copy of the board of the named scenario. Names are
+	// files in scenario/, they come from clients so can't have a '/' in.
+	// Throws std::runtime_error like GameState::load_file if the
+	// scenario can't be loaded.
+	void load(GameState &state, const std::string &map_name);
+}
+
+#endif /* !SCENARIO_HPP */
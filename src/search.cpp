@@ -0,0 +1,212 @@
+#include <algorithm>
+#include <boost/atomic.hpp>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
+#include "search.hpp"
+#include "ttable.hpp"
+
+const int INFINITE_SCORE = 1000000;
+
+// Multiplied by the side to move and mixed into the board hash, so
+// searches for different AI colours don't share entries.
+const uint64_t SIDE_KEY = 0x9E3779B97F4A7C15ULL;
+
+namespace {
+	class Searcher {
+	public:
+		Searcher(const Evaluator &e, PlayerColour c, TranspositionTable *t);
+
+		int negamax(int depth, int alpha, int beta, bool mine);
+
+		Evaluator evaluator;
+		unsigned long nodes, probes, hits;
+
+	private:
+		PlayerColour colour;
+		std::vector<PlayerColour> opponents;
+		TranspositionTable *table;
+		uint64_t side_keys[2]; // Opponents, us.
+	};
+
+	struct root_work {
+		const Evaluator *evaluator;
+		PlayerColour colour;
+		const std::vector<Evaluator::move> *root;
+		int depth;
+		TranspositionTable *table;
+
+		boost::atomic<size_t> next;
+		boost::atomic<unsigned long> nodes, probes, hits;
+		std::vector<int> scores;
+
+		root_work() : next(0), nodes(0), probes(0), hits(0) {}
+	};
+}
+
+Searcher::Searcher(const Evaluator &e, PlayerColour c, TranspositionTable *t) :
+	evaluator(e), nodes(0), probes(0), hits(0), colour(c), table(t)
+{
+	// The layout keeps games on other maps out of each other's entries.
+	side_keys[0] = SIDE_KEY * (2 * c + 1) ^ e.layout();
+	side_keys[1] = SIDE_KEY * (2 * c + 2) ^ e.layout();
+
+	for(int o = 0; o < SPECTATE; ++o) {
+		if(o != c) {
+			opponents.push_back((PlayerColour)o);
+		}
+	}
+}
+
+int Searcher::negamax(int depth, int alpha, int beta, bool mine)
+{
+	++nodes;
+
+	// Leaves are cheaper to evaluate than to look up in a table that
+	// doesn't fit in the cache, and there are more of them than the rest.
+	if(depth == 0) {
+		int stand = evaluator.evaluate(colour);
+		return mine ? stand : -stand;
+	}
+
+	uint64_t key = evaluator.hash() ^ side_keys[mine];
+	int hash_from = -1, hash_to = -1;
+
+	TranspositionTable::entry e;
+	bool found = false;
+	if(table) {
+		++probes;
+		found = table->probe(key, e);
+	}
+	if(found) {
+		++hits;
+		if(e.depth >= depth) {
+			if(e.bound == TranspositionTable::EXACT) return e.score;
+			if(e.bound == TranspositionTable::LOWER && e.score >= beta) return e.score;
+			if(e.bound == TranspositionTable::UPPER && e.score <= alpha) return e.score;
+		}
+		hash_from = e.from;
+		hash_to = e.to;
+	}
+
+	int stand = evaluator.evaluate(colour);
+	if(!mine) {
+		stand = -stand;
+	}
+
+	std::vector<Evaluator::move> moves;
+	if(mine) {
+		evaluator.moves(colour, moves);
+	}else{
+		for(std::vector<PlayerColour>::iterator o = opponents.begin(); o != opponents.end(); ++o) {
+			evaluator.moves(*o, moves);
+		}
+	}
+	if(moves.empty()) {
+		return stand;
+	}
+
+	// Try the best move from the table first.
+	for(size_t i = 0; i < moves.size(); ++i) {
+		if(moves[i].from == hash_from && moves[i].to == hash_to) {
+			std::swap(moves[0], moves[i]);
+			break;
+		}
+	}
+
+	int alpha_orig = alpha;
+	int best = -INFINITE_SCORE;
+	int best_move = 0;
+	for(size_t i = 0; i < moves.size(); ++i) {
+		evaluator.make_move(moves[i]);
+		int score = -negamax(depth - 1, -beta, -alpha, !mine);
+		evaluator.undo_move();
+
+		if(score > best) {
+			best = score;
+			best_move = i;
+		}
+		if(best > alpha) {
+			alpha = best;
+		}
+		if(alpha >= beta) {
+			break;
+		}
+	}
+
+	if(table) {
+		e.score = best;
+		e.depth = depth;
+		e.bound = best <= alpha_orig ? TranspositionTable::UPPER
+			: best >= beta ? TranspositionTable::LOWER
+			: TranspositionTable::EXACT;
+		e.from = moves[best_move].from;
+		e.to = moves[best_move].to;
+		table->store(key, e);
+	}
+
+	return best;
+}
+
+uint64_t Search::position_key(uint64_t board_hash, PlayerColour to_move)
+{
+	// Same as a Searcher for to_move looking at its own turn.
+	return board_hash ^ SIDE_KEY * (2 * to_move + 2);
+}
+
+static void search_roots(root_work *work)
+{
+	Searcher searcher(*work->evaluator, work->colour, work->table);
+
+	size_t i;
+	while((i = work->next.fetch_add(1)) < work->root->size()) {
+		searcher.evaluator.make_move((*work->root)[i]);
+		work->scores[i] = -searcher.negamax(work->depth - 1, -INFINITE_SCORE, INFINITE_SCORE, false);
+		searcher.evaluator.undo_move();
+	}
+
+	work->nodes.fetch_add(searcher.nodes);
+	work->probes.fetch_add(searcher.probes);
+	work->hits.fetch_add(searcher.hits);
+}
+
+Search::result Search::search(const Evaluator &evaluator, PlayerColour colour,
+	const std::vector<Evaluator::move> &root, int depth, int threads,
+	TranspositionTable *table)
+{
+	if(table) {
+		table->new_search();
+	}
+
+	root_work work;
+	work.evaluator = &evaluator;
+	work.colour = colour;
+	work.root = &root;
+	work.depth = depth < 1 ? 1 : depth;
+	work.table = table;
+	work.scores.assign(root.size(), -INFINITE_SCORE);
+
+	if(threads <= 1) {
+		search_roots(&work);
+	}else{
+		boost::thread_group workers;
+		for(int t = 0; t < threads; ++t) {
+			workers.create_thread(boost::bind(&search_roots, &work));
+		}
+		workers.join_all();
+	}
+
+	result r;
+	r.best = -1;
+	r.scores = work.scores;
+	r.nodes = work.nodes;
+	r.probes = work.probes;
+	r.hits = work.hits;
+	for(size_t i = 0; i < root.size(); ++i) {
+		if(r.best == -1 || r.scores[i] > r.scores[r.best]) {
+			r.best = i;
+		}
+	}
+
+	return r;
+}
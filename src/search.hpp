@@ -0,0 +1,34 @@
+#ifndef SEARCH_HPP
+#define SEARCH_HPP
+
+#include <vector>
+
+#include "evaluator.hpp"
+
+class TranspositionTable;
+
+/* Alpha-beta search over the evaluator's compact board.
+ *
+ * Opponents are searched as a single side that may move any pawn that
+ * isn't ours. Root moves are handed out to worker threads, each with its
+ * own copy of the evaluator, which share the transposition table. The
+ * table may also be shared with searches of other games.
+*/
+namespace Search {
+	struct result {
+		int best;                // Index into the root moves, -1 if none.
+		std::vector<int> scores; // Score of each root move.
+		unsigned long nodes;
+		unsigned long probes, hits; // Transposition table lookups.
+	};
+
+	// Key of a board hash with a colour to move, as used in the move
+	// book. The transposition table also mixes in the board layout.
+	uint64_t position_key(uint64_t board_hash, PlayerColour to_move);
+
+	result search(const Evaluator &evaluator, PlayerColour colour,
+		const std::vector<Evaluator::move> &root, int depth, int threads,
+		TranspositionTable *table);
+}
+
+#endif /* !SEARCH_HPP */
@@ -0,0 +1,291 @@
+#include <algorithm>
+#include <stdlib.h>
+#include <limits.h>
+
+#include "threatmap.hpp"
+#include "gamestate.hpp"
+#include "powers.hpp"
+
+ThreatMap::ThreatMap() : min_col(0), min_row(0), width(0), height(0) {}
+
+// Directions a power can hit a pawn in, or zero if it isn't an attack.
+static unsigned int attack_directions(int power)
+{
+	const Powers::Power &p = Powers::powers[power];
+	if(!(p.preconditions & (Powers::AREA_PAWN | Powers::AREA_ENEMY_PAWN))) {
+		return 0;
+	}
+	return p.direction & ~(Powers::Power::point | Powers::Power::targeted);
+}
+
+unsigned int ThreatMap::enemy_count(kind k, const Tile *tile, PlayerColour colour) const
+{
+	int i = cell_of(tile);
+	unsigned int n = 0;
+	for(int c = 0; c < SPECTATE; ++c) {
+		if(c != colour) {
+			n += counts[k][c][i];
+		}
+	}
+	return n;
+}
+
+void ThreatMap::resize(GameState &state)
+{
+	int mincol = 0, maxcol = -1, minrow = 0, maxrow = -1;
+	for(Tile::List::iterator t = state.tiles.begin(); t != state.tiles.end(); ++t) {
+		if(maxcol < mincol) {
+			mincol = maxcol = (*t)->col;
+			minrow = maxrow = (*t)->row;
+		}
+		mincol = std::min(mincol, (*t)->col);
+		maxcol = std::max(maxcol, (*t)->col);
+		minrow = std::min(minrow, (*t)->row);
+		maxrow = std::max(maxrow, (*t)->row);
+	}
+
+	int w = maxcol - mincol + 3, h = maxrow - minrow + 3;
+	if(w == width && h == height && mincol == min_col && minrow == min_row) {
+		return;
+	}
+
+	min_col = mincol;
+	min_row = minrow;
+	width = w;
+	height = h;
+
+	size_t cells = width * height;
+	exists.resize(cells);
+	heights.resize(cells);
+	owner.resize(cells);
+	climb.resize(cells);
+	target.resize(cells);
+
+	row_key.resize(cells);
+	bs_key.resize(cells);
+	fs_key.resize(cells);
+	cube_x.resize(cells);
+	cube_z.resize(cells);
+
+	for(int y = 0; y < height; ++y) {
+		int row = y - 1 + min_row;
+		for(int x = 0; x < width; ++x) {
+			int col = x - 1 + min_col;
+			int i = y * width + x;
+
+			// Same lines as GameState::row_tiles, bs_tiles and fs_tiles.
+			row_key[i] = row;
+			bs_key[i] = col - (row >> 1);
+			fs_key[i] = col + ((row + 1) >> 1);
+
+			// Cube coordinates, odd rows are shifted right.
+			cube_x[i] = col - ((row - (row & 1)) >> 1);
+			cube_z[i] = row;
+		}
+	}
+}
+
+static inline unsigned int reaches(int8_t owner, int8_t height, uint8_t climb, int colour, int min_height)
+{
+	return (owner == colour) & ((height >= min_height) | climb);
+}
+
+void ThreatMap::count_adjacent(int colour)
+{
+	uint16_t *adjacent = &counts[ADJACENT][colour][0];
+	uint16_t *stomp = &counts[STOMP][colour][0];
+
+	const int8_t *h = &heights[0], *o = &owner[0];
+	const uint8_t *cl = &climb[0], *ex = &exists[0], *tg = &target[0];
+
+	for(int y = 1; y < height - 1; ++y) {
+		int odd = (y - 1 + min_row) & 1;
+
+		// Neighbours above and below are at up, up+1, down and down+1.
+		int up = -width - !odd;
+		int down = width - !odd;
+
+		int start = y * width + 1, end = y * width + width - 1;
+		for(int i = start; i < end; ++i) {
+			int min_height = h[i] - 1;
+
+			unsigned int n =
+				reaches(o[i - 1], h[i - 1], cl[i - 1], colour, min_height) +
+				reaches(o[i + 1], h[i + 1], cl[i + 1], colour, min_height) +
+				reaches(o[i + up], h[i + up], cl[i + up], colour, min_height) +
+				reaches(o[i + up + 1], h[i + up + 1], cl[i + up + 1], colour, min_height) +
+				reaches(o[i + down], h[i + down], cl[i + down], colour, min_height) +
+				reaches(o[i + down + 1], h[i + down + 1], cl[i + down + 1], colour, min_height);
+
+			n *= ex[i];
+			adjacent[i] = n;
+			stomp[i] = n * (tg[i] & (o[i] != colour));
+		}
+	}
+}
+
+void ThreatMap::count_ranged(GameState &state)
+{
+	const int row_min = row_key[0], row_span = row_key[width * height - 1] - row_min + 1;
+	const int bs_min = bs_key[(height - 1) * width], bs_span = bs_key[width - 1] - bs_min + 1;
+	const int fs_min = fs_key[0], fs_span = fs_key[width * height - 1] - fs_min + 1;
+
+	std::vector<int> row_band[SPECTATE], bs_band[SPECTATE], fs_band[SPECTATE];
+
+	struct radial {
+		int cell, radius, colour;
+	};
+	std::vector<radial> radials;
+
+	for(Tile::List::iterator t = state.tiles.begin(); t != state.tiles.end(); ++t) {
+		pawn_ptr pawn = (*t)->pawn;
+		if(!pawn) {
+			continue;
+		}
+
+		unsigned int dirs = 0;
+		for(Pawn::PowerList::iterator p = pawn->powers.begin(); p != pawn->powers.end(); ++p) {
+			if(p->second > 0) {
+				dirs |= attack_directions(p->first);
+			}
+		}
+		if(!dirs) {
+			continue;
+		}
+
+		int c = pawn->colour, i = cell_of(*t), r = pawn->range;
+		uint16_t *ranged = &counts[RANGED][c][0];
+
+		if(dirs & (Powers::Power::east_west | Powers::Power::northwest_southeast | Powers::Power::northeast_southwest)) {
+			if(row_band[c].empty()) {
+				row_band[c].assign(row_span + 1, 0);
+				bs_band[c].assign(bs_span + 1, 0);
+				fs_band[c].assign(fs_span + 1, 0);
+			}
+
+			struct {
+				unsigned int direction;
+				std::vector<int> &band;
+				int key, min, span;
+			} lines[] = {
+				{ Powers::Power::east_west, row_band[c], row_key[i], row_min, row_span },
+				{ Powers::Power::northwest_southeast, bs_band[c], bs_key[i], bs_min, bs_span },
+				{ Powers::Power::northeast_southwest, fs_band[c], fs_key[i], fs_min, fs_span },
+			};
+
+			for(int l = 0; l < 3; ++l) {
+				if(dirs & lines[l].direction) {
+					int lo = std::max(lines[l].key - r - lines[l].min, 0);
+					int hi = std::min(lines[l].key + r - lines[l].min, lines[l].span - 1);
+					lines[l].band[lo]++;
+					lines[l].band[hi + 1]--;
+				}
+			}
+		}
+
+		if(dirs & Powers::Power::radial) {
+			radial rad = { i, r + 1, c };
+			radials.push_back(rad);
+		}
+
+		int odd = (*t)->row & 1;
+		struct {
+			unsigned int direction;
+			int offset;
+		} steps[] = {
+			{ Powers::Power::east, 1 },
+			{ Powers::Power::west, -1 },
+			{ Powers::Power::northeast, -width + odd },
+			{ Powers::Power::northwest, -width - !odd },
+			{ Powers::Power::southeast, width + odd },
+			{ Powers::Power::southwest, width - !odd },
+		};
+		for(int s = 0; s < 6; ++s) {
+			if(dirs & steps[s].direction) {
+				ranged[i + steps[s].offset] += exists[i + steps[s].offset];
+			}
+		}
+	}
+
+	const int cells = width * height;
+	const uint8_t *ex = &exists[0];
+
+	for(int c = 0; c < SPECTATE; ++c) {
+		if(row_band[c].empty()) {
+			continue;
+		}
+
+		for(int k = 1; k < row_span; ++k) row_band[c][k] += row_band[c][k - 1];
+		for(int k = 1; k < bs_span; ++k) bs_band[c][k] += bs_band[c][k - 1];
+		for(int k = 1; k < fs_span; ++k) fs_band[c][k] += fs_band[c][k - 1];
+
+		uint16_t *ranged = &counts[RANGED][c][0];
+		const int *rb = &row_band[c][0] - row_min, *bb = &bs_band[c][0] - bs_min, *fb = &fs_band[c][0] - fs_min;
+		const int16_t *rk = &row_key[0], *bk = &bs_key[0], *fk = &fs_key[0];
+
+		for(int i = 0; i < cells; ++i) {
+			ranged[i] += (rb[rk[i]] + bb[bk[i]] + fb[fk[i]]) * ex[i];
+		}
+	}
+
+	// Only the rows and columns within reach of each radial pawn.
+	const int16_t *cx = &cube_x[0], *cz = &cube_z[0];
+	for(std::vector<radial>::iterator rad = radials.begin(); rad != radials.end(); ++rad) {
+		uint16_t *ranged = &counts[RANGED][rad->colour][0];
+		int x = cx[rad->cell], z = cz[rad->cell], radius = rad->radius;
+		int py = rad->cell / width, px = rad->cell % width;
+
+		int y0 = std::max(py - radius, 0), y1 = std::min(py + radius, height - 1);
+		int x0 = std::max(px - radius - 1, 0), x1 = std::min(px + radius + 1, width - 1);
+
+		for(int y = y0; y <= y1; ++y) {
+			for(int i = y * width + x0; i <= y * width + x1; ++i) {
+				int dx = cx[i] - x, dz = cz[i] - z;
+				int d = std::max(std::max(abs(dx), abs(dz)), abs(dx + dz));
+				ranged[i] += (d <= radius) & ex[i];
+			}
+		}
+	}
+}
+
+void ThreatMap::build(GameState &state)
+{
+	resize(state);
+
+	size_t cells = width * height;
+
+	std::fill(exists.begin(), exists.end(), 0);
+	std::fill(heights.begin(), heights.end(), 0);
+	std::fill(owner.begin(), owner.end(), -1);
+	std::fill(climb.begin(), climb.end(), 0);
+	std::fill(target.begin(), target.end(), 0);
+
+	bool present[SPECTATE] = { false };
+
+	for(Tile::List::iterator t = state.tiles.begin(); t != state.tiles.end(); ++t) {
+		int i = cell_of(*t);
+
+		exists[i] = !(*t)->has_black_hole;
+		// Only hovering pawns can get onto smashed tiles, like cliffs.
+		heights[i] = (*t)->smashed ? SCHAR_MAX : (*t)->height;
+
+		pawn_ptr pawn = (*t)->pawn;
+		if(pawn && pawn->colour < SPECTATE) {
+			owner[i] = pawn->colour;
+			climb[i] = (pawn->flags & PWR_CLIMB) != 0;
+			target[i] = !(pawn->flags & PWR_SHIELD);
+			present[pawn->colour] = true;
+		}
+	}
+
+	for(int c = 0; c < SPECTATE; ++c) {
+		for(int k = 0; k < KINDS; ++k) {
+			counts[k][c].assign(cells, 0);
+		}
+		if(present[c]) {
+			count_adjacent(c);
+		}
+	}
+
+	count_ranged(state);
+}
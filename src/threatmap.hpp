@@ -0,0 +1,69 @@
+#ifndef THREATMAP_HPP
+#define THREATMAP_HPP
+
+#include <vector>
+#include <stdint.h>
+
+#include "hexradius.hpp"
+#include "tile.hpp"
+
+class GameState;
+
+/* Per-tile attack counts for every colour.
+ *
+ * The board is copied into a padded grid with one array per property, so
+ * each pass is a straight loop over a row with fixed neighbour offsets.
+ * Line powers are counted with a difference array per line direction and
+ * added to every tile in one more pass, radial powers with one pass per
+ * pawn holding one.
+*/
+class ThreatMap {
+public:
+	enum kind {
+		STOMP,    // Pawns that can step onto the tile and stomp whoever is there.
+		ADJACENT, // Pawns that can step onto the tile.
+		RANGED,   // Pawns with an attack power covering the tile.
+		KINDS
+	};
+
+	ThreatMap();
+
+	void build(GameState &state);
+
+	// Attacks on a tile by pawns of one colour.
+	unsigned int count(kind k, const Tile *tile, PlayerColour by) const
+	{
+		return counts[k][by][cell_of(tile)];
+	}
+
+	// Attacks on a tile by pawns of every colour except one.
+	unsigned int enemy_count(kind k, const Tile *tile, PlayerColour colour) const;
+
+private:
+	int min_col, min_row;
+	int width, height; // Including a border of empty cells.
+
+	// Board, one entry per grid cell.
+	std::vector<uint8_t> exists;
+	std::vector<int8_t> heights;
+	std::vector<int8_t> owner; // -1 if empty.
+	std::vector<uint8_t> climb;
+	std::vector<uint8_t> target; // Unshielded pawn.
+
+	// Keys of the three lines and the hex distance through each cell.
+	std::vector<int16_t> row_key, bs_key, fs_key;
+	std::vector<int16_t> cube_x, cube_z;
+
+	std::vector<uint16_t> counts[KINDS][SPECTATE];
+
+	int cell_of(const Tile *tile) const
+	{
+		return (tile->row - min_row + 1) * width + (tile->col - min_col + 1);
+	}
+
+	void resize(GameState &state);
+	void count_adjacent(int colour);
+	void count_ranged(GameState &state);
+};
+
+#endif /* !THREATMAP_HPP */
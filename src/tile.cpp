@@ -25,22 +25,49 @@ bool Tile::SetHeight(int h) {
 	}
 }
 
-void Tile::CopyToProto(protocol::tile *t) const {
+uint32_t Tile::dirty() const {
+	uint32_t d = 0;
+
+	if(!sent.has_height() || sent.height() != height) d |= DIRTY_HEIGHT;
+	if(!sent.has_power() || sent.power() != has_power) d |= DIRTY_POWER;
+	if(!sent.has_smashed() || sent.smashed() != smashed) d |= DIRTY_SMASHED;
+	if(!sent.has_has_mine() || sent.has_mine() != has_mine) d |= DIRTY_HAS_MINE;
+	if(!sent.has_mine_colour() || sent.mine_colour() != (uint32_t)mine_colour) d |= DIRTY_MINE_COLOUR;
+	if(!sent.has_has_landing_pad() || sent.has_landing_pad() != has_landing_pad) d |= DIRTY_HAS_LANDING_PAD;
+	if(!sent.has_landing_pad_colour() || sent.landing_pad_colour() != (uint32_t)landing_pad_colour) d |= DIRTY_LANDING_PAD_COLOUR;
+	if(!sent.has_has_black_hole() || sent.has_black_hole() != has_black_hole) d |= DIRTY_HAS_BLACK_HOLE;
+	if(!sent.has_black_hole_power() || sent.black_hole_power() != (uint32_t)black_hole_power) d |= DIRTY_BLACK_HOLE_POWER;
+	if(!sent.has_has_eye() || sent.has_eye() != has_eye) d |= DIRTY_HAS_EYE;
+	if(!sent.has_eye_colour() || sent.eye_colour() != (uint32_t)eye_colour) d |= DIRTY_EYE_COLOUR;
+	if(!sent.has_wrap() || sent.wrap() != wrap) d |= DIRTY_WRAP;
+	if(!sent.has_hill() || sent.hill() != hill) d |= DIRTY_HILL;
+
+	return d;
+}
+
+void Tile::CopyToProto(protocol::tile *t, uint32_t fields) const {
 	t->set_col(col);
 	t->set_row(row);
-	t->set_height(height);
-	t->set_power(has_power);
-	t->set_smashed(smashed);
-	t->set_has_mine(has_mine);
-	t->set_mine_colour(mine_colour);
-	t->set_has_landing_pad(has_landing_pad);
-	t->set_landing_pad_colour(landing_pad_colour);
-	t->set_has_black_hole(has_black_hole);
-	t->set_black_hole_power(black_hole_power);
-	t->set_has_eye(has_eye);
-	t->set_eye_colour(eye_colour);
-	t->set_wrap(wrap);
-	t->set_hill(hill);
+	if(fields & DIRTY_HEIGHT) t->set_height(height);
+	if(fields & DIRTY_POWER) t->set_power(has_power);
+	if(fields & DIRTY_SMASHED) t->set_smashed(smashed);
+	if(fields & DIRTY_HAS_MINE) t->set_has_mine(has_mine);
+	if(fields & DIRTY_MINE_COLOUR) t->set_mine_colour(mine_colour);
+	if(fields & DIRTY_HAS_LANDING_PAD) t->set_has_landing_pad(has_landing_pad);
+	if(fields & DIRTY_LANDING_PAD_COLOUR) t->set_landing_pad_colour(landing_pad_colour);
+	if(fields & DIRTY_HAS_BLACK_HOLE) t->set_has_black_hole(has_black_hole);
+	if(fields & DIRTY_BLACK_HOLE_POWER) t->set_black_hole_power(black_hole_power);
+	if(fields & DIRTY_HAS_EYE) t->set_has_eye(has_eye);
+	if(fields & DIRTY_EYE_COLOUR) t->set_eye_colour(eye_colour);
+	if(fields & DIRTY_WRAP) t->set_wrap(wrap);
+	if(fields & DIRTY_HILL) t->set_hill(hill);
+
+	sent.MergeFrom(*t);
+}
+
+void Tile::mark_sent() const {
+	protocol::tile t;
+	CopyToProto(&t);
 }
 
 void Tile::update_from_proto(const protocol::tile &t)
@@ -62,7 +89,7 @@ void Tile::update_from_proto(const protocol::tile &t)
 	if(t.has_hill()) hill = t.hill();
 }
 
-Tile::List RandomTiles(Tile::List _tiles, int num, bool unique, bool include_mines, bool include_holes, bool include_occupied) {
+Tile::List RandomTiles(game_rng &rng, Tile::List _tiles, int num, bool unique, bool include_mines, bool include_holes, bool include_occupied) {
 	Tile::List ret, tiles;
 
 	BOOST_FOREACH(Tile *tile, _tiles) {
@@ -74,7 +101,7 @@ Tile::List RandomTiles(Tile::List _tiles, int num, bool unique, bool include_min
 
 	while(tiles.size() && num) {
 		Tile::List::iterator i = tiles.begin();
-		i += rand() % tiles.size();
+		i += rng() % tiles.size();
 
 		ret.push_back(*i);
 
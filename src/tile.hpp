@@ -52,14 +52,42 @@ struct Tile {
 	uint32_t wrap;
 	enum wrap_direction { WRAP_RIGHT, WRAP_LEFT, WRAP_UP_RIGHT, WRAP_DOWN_RIGHT, WRAP_UP_LEFT, WRAP_DOWN_LEFT };
 
+	// Fields of protocol::tile that can be sent on their own.
+	enum {
+		DIRTY_HEIGHT             = 1<<0,
+		DIRTY_POWER              = 1<<1,
+		DIRTY_SMASHED            = 1<<2,
+		DIRTY_HAS_MINE           = 1<<3,
+		DIRTY_MINE_COLOUR        = 1<<4,
+		DIRTY_HAS_LANDING_PAD    = 1<<5,
+		DIRTY_LANDING_PAD_COLOUR = 1<<6,
+		DIRTY_HAS_BLACK_HOLE     = 1<<7,
+		DIRTY_BLACK_HOLE_POWER   = 1<<8,
+		DIRTY_HAS_EYE            = 1<<9,
+		DIRTY_EYE_COLOUR         = 1<<10,
+		DIRTY_WRAP               = 1<<11,
+		DIRTY_HILL               = 1<<12,
+		DIRTY_ALL                = (1<<13) - 1,
+	};
+
 	Tile(int c, int r, int h);
 
 	bool SetHeight(int h);
 
-	void CopyToProto(protocol::tile *t) const;
+	// Fields that differ from the last copy made by CopyToProto.
+	uint32_t dirty() const;
+
+	// Copy the given fields and remember them as sent.
+	void CopyToProto(protocol::tile *t, uint32_t fields = DIRTY_ALL) const;
+	// Remember every field as sent, after sending the tile another way.
+	void mark_sent() const;
 	void update_from_proto(const protocol::tile &t);
+
+private:
+	// Field values as last copied to a message.
+	mutable protocol::tile sent;
 };
 
-Tile::List RandomTiles(Tile::List tiles, int num, bool unique, bool include_mines, bool include_holes, bool include_occupied);
+Tile::List RandomTiles(game_rng &rng, Tile::List tiles, int num, bool unique, bool include_mines, bool include_holes, bool include_occupied);
 
 #endif
@@ -1,9 +1,12 @@
 #include <cmath>
 #include <iostream>
+#include <map>
+#include <set>
 #include <boost/foreach.hpp>
 #include "hexradius.hpp"
 #include "tile_anims.hpp"
 #include "client.hpp"
+#include "gamestate.hpp"
 
 int sign(int n) { return (n == 0)? n : (abs(n) / n); }
 // Are these defined somewhere already?
@@ -69,35 +72,81 @@ namespace TileAnimators {
 
 		return did_stuff;
 	}
+
+	WormAnimator::WormAnimator(Tile::List path, unsigned int interval):
+		Animator(path), interval(interval), heights(path.size()), last_visit(path.size()), next(0) {
+		std::map<Tile*, int> height;
+		for(size_t i = 0; i < tiles.size(); ++i) {
+			int &h = height.insert(std::make_pair(tiles[i], tiles[i]->height)).first->second;
+			heights[i] = h;
+			if (h < 2)
+				h++;
+		}
+
+		std::set<Tile*> seen;
+		for(size_t i = tiles.size(); i-- > 0;) {
+			last_visit[i] = seen.insert(tiles[i]).second;
+		}
+
+		// Hold every tile where it was until the worm gets to it.
+		BOOST_FOREACH(Tile* t, seen) {
+			t->animating = true;
+			t->anim_height = t->height;
+		}
+
+		start_time = SDL_GetTicks();
+	}
+
+	bool WormAnimator::do_stuff() {
+		unsigned int t = SDL_GetTicks() - start_time;
+
+		while (next < tiles.size() && next * interval <= t)
+			next++;
+
+		bool did_stuff = next < tiles.size();
+
+		// Later visits to a tile take over from earlier ones.
+		for(size_t i = 0; i < next; ++i) {
+			Tile *tile = tiles[i];
+			int from = heights[i];
+			int to = (from < 2) ? from + 1 : from;
+
+			int this_t = t - i * interval;
+			if (this_t > 1500) {
+				tile->anim_height = to;
+				if (last_visit[i])
+					tile->animating = false;
+			}
+			else {
+				tile->anim_height = to
+					+ (from - to)
+					* cos(2 * PI * this_t / 1000.0) / pow(12, this_t / 1000.0);
+				did_stuff = true;
+			}
+		}
+
+		return did_stuff;
+	}
 }
 
-protocol::message TileAnimators::ElevationAnimator::serialize()
+void TileAnimators::ElevationAnimator::serialize(protocol::animation &anim, const ServerGameState &state)
 {
-	protocol::message msg;
-	msg.set_msg(protocol::TILE_ANIMATION);
-	msg.set_animation_name("elevation");
-
-	center->CopyToProto(msg.add_tiles());
+	anim.set_type(protocol::ELEVATION);
+	anim.set_tile(state.tile_index(center));
 	for(Tile::List::iterator t = tiles.begin(); t != tiles.end(); ++t) {
-		(*t)->CopyToProto(msg.add_tiles());
+		anim.add_tiles(state.tile_index(*t));
 	}
+	anim.set_delay_factor(delay_factor);
+	anim.set_relative(mode == RELATIVE);
+	anim.set_target_elevation(target_elevation);
+}
 
-	protocol::key_value *delay_factor_kv = msg.add_misc();
-	delay_factor_kv->set_key("delay-factor");
-	delay_factor_kv->set_float_value(delay_factor);
-	protocol::key_value *mode_kv = msg.add_misc();
-	mode_kv->set_key("mode");
-	switch(mode) {
-	case ABSOLUTE:
-		mode_kv->set_string_value("absolute");
-		break;
-	case RELATIVE:
-		mode_kv->set_string_value("relative");
-		break;
-	default: abort();
+void TileAnimators::WormAnimator::serialize(protocol::animation &anim, const ServerGameState &state)
+{
+	anim.set_type(protocol::WORM);
+	anim.set_tile(state.tile_index(tiles[0]));
+	for(Tile::List::iterator t = tiles.begin(); t != tiles.end(); ++t) {
+		anim.add_tiles(state.tile_index(*t));
 	}
-	protocol::key_value *target_elevation_kv = msg.add_misc();
-	target_elevation_kv->set_key("target-elevation");
-	target_elevation_kv->set_int_value(target_elevation);
-	return msg;
+	anim.set_interval(interval);
 }
@@ -7,6 +7,8 @@
 #undef ABSOLUTE
 #undef RELATIVE
 
+class ServerGameState;
+
 namespace TileAnimators {
 	struct Animator {
 		Tile::List tiles;
@@ -18,7 +20,8 @@ namespace TileAnimators {
 		// If false, the client will stop running & delete the animation.
 		virtual bool do_stuff() = 0;
 		virtual ~Animator();
-		virtual protocol::message serialize() = 0;
+		// Fill in the animation of an ANIMATION message.
+		virtual void serialize(protocol::animation &anim, const ServerGameState &state) = 0;
 	};
 
 	enum ElevationMode { ABSOLUTE, RELATIVE };
@@ -26,13 +29,27 @@ namespace TileAnimators {
 	struct ElevationAnimator: public Animator {
 		ElevationAnimator(Tile::List _tiles, Tile* center, float delay_factor, ElevationMode mode, int target_elevation);
 		virtual bool do_stuff();
-		virtual protocol::message serialize();
+		virtual void serialize(protocol::animation &anim, const ServerGameState &state);
 
 		Tile *center;
 		float delay_factor;
 		ElevationMode mode;
 		int target_elevation;
 	};
+
+	// Tiles rise one after another along the path of a worm, interval
+	// milliseconds apart. The path is every tile the worm crawls over,
+	// in order, which can be the same tile more than once.
+	struct WormAnimator: public Animator {
+		WormAnimator(Tile::List path, unsigned int interval);
+		virtual bool do_stuff();
+		virtual void serialize(protocol::animation &anim, const ServerGameState &state);
+
+		unsigned int interval;
+		std::vector<int> heights; // Of each tile on the path before the worm got there.
+		std::vector<bool> last_visit; // True where the worm doesn't come back to the tile.
+		size_t next; // First step the worm hasn't got to.
+	};
 }
 
 #endif
@@ -0,0 +1,149 @@
+#include <limits.h>
+
+#include "ttable.hpp"
+
+/* Entry data layout:
+ *
+ *  0-21  score
+ * 22-35  from (0x3FFF for none)
+ * 36-49  to (0x3FFF for none)
+ * 50-55  depth + 1, so a used entry is never zero
+ * 56-57  bound
+ * 58-63  generation
+*/
+
+const unsigned int AGE_MASK = 0x3F;
+const int MAX_DEPTH = 62;
+const int NO_TILE = 0x3FFF;
+
+TranspositionTable::TranspositionTable(unsigned int megabytes) : mask(0), generation(0)
+{
+	size_t buckets = 1;
+	while(buckets * 2 * sizeof(bucket) <= (size_t)megabytes * 1024 * 1024) {
+		buckets *= 2;
+	}
+
+	table.reset(new bucket[buckets]);
+	mask = buckets - 1;
+
+	for(size_t b = 0; b < buckets; ++b) {
+		for(int s = 0; s < BUCKET_SIZE; ++s) {
+			table[b].slots[s].key.store(0, boost::memory_order_relaxed);
+			table[b].slots[s].data.store(0, boost::memory_order_relaxed);
+		}
+	}
+}
+
+void TranspositionTable::new_search()
+{
+	generation.fetch_add(1, boost::memory_order_relaxed);
+}
+
+bool TranspositionTable::pack(const entry &e, unsigned int age, uint64_t &data)
+{
+	// Rather than clamp a score and have it come back wrong, don't keep it.
+	if(e.score > MAX_SCORE || e.score < -MAX_SCORE) {
+		return false;
+	}
+
+	// A shallower depth only costs a re-search, and a missing best move
+	// is just a worse guess at the move order.
+	int depth = e.depth < 0 ? 0 : (e.depth > MAX_DEPTH ? MAX_DEPTH : e.depth);
+	int from = e.from < 0 || e.from >= NO_TILE ? NO_TILE : e.from;
+	int to = e.to < 0 || e.to >= NO_TILE ? NO_TILE : e.to;
+
+	data = (uint64_t)(e.score & 0x3FFFFF) |
+		(uint64_t)from << 22 |
+		(uint64_t)to << 36 |
+		(uint64_t)(depth + 1) << 50 |
+		(uint64_t)e.bound << 56 |
+		(uint64_t)(age & AGE_MASK) << 58;
+	return true;
+}
+
+void TranspositionTable::unpack(uint64_t data, entry &e)
+{
+	int from = (data >> 22) & NO_TILE, to = (data >> 36) & NO_TILE;
+
+	// Sign extend the score.
+	e.score = (int)((data & 0x3FFFFF) ^ 0x200000) - 0x200000;
+	e.from = from == NO_TILE ? -1 : from;
+	e.to = to == NO_TILE ? -1 : to;
+	e.depth = depth_of(data);
+	e.bound = (bound_type)((data >> 56) & 3);
+}
+
+int TranspositionTable::depth_of(uint64_t data)
+{
+	return (int)((data >> 50) & 0x3F) - 1;
+}
+
+unsigned int TranspositionTable::age_of(uint64_t data)
+{
+	return (data >> 58) & AGE_MASK;
+}
+
+bool TranspositionTable::probe(uint64_t key, entry &e)
+{
+	bucket &b = table[key & mask];
+	for(int s = 0; s < BUCKET_SIZE; ++s) {
+		uint64_t data = b.slots[s].data.load(boost::memory_order_relaxed);
+		if(data && (b.slots[s].key.load(boost::memory_order_relaxed) ^ data) == key) {
+			unpack(data, e);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void TranspositionTable::store(uint64_t key, const entry &e)
+{
+	unsigned int age = generation.load(boost::memory_order_relaxed) & AGE_MASK;
+
+	uint64_t data;
+	if(!pack(e, age, data)) {
+		return;
+	}
+
+	// Take the same position or an empty slot if there is one, otherwise
+	// the shallowest entry, counting old generations as very shallow.
+	bucket &b = table[key & mask];
+	slot *victim = NULL;
+	int victim_worth = INT_MAX;
+	for(int s = 0; s < BUCKET_SIZE; ++s) {
+		slot &sl = b.slots[s];
+		uint64_t old = sl.data.load(boost::memory_order_relaxed);
+		if(!old || (sl.key.load(boost::memory_order_relaxed) ^ old) == key) {
+			victim = &sl;
+			break;
+		}
+
+		int worth = depth_of(old) - 8 * (int)((age - age_of(old)) & AGE_MASK);
+		if(worth < victim_worth) {
+			victim = &sl;
+			victim_worth = worth;
+		}
+	}
+
+	victim->data.store(data, boost::memory_order_relaxed);
+	victim->key.store(key ^ data, boost::memory_order_relaxed);
+}
+
+int TranspositionTable::usage() const
+{
+	unsigned int age = generation.load(boost::memory_order_relaxed) & AGE_MASK;
+
+	size_t sample = mask + 1 < 250 ? mask + 1 : 250;
+	int used = 0;
+	for(size_t b = 0; b < sample; ++b) {
+		for(int s = 0; s < BUCKET_SIZE; ++s) {
+			uint64_t data = table[b].slots[s].data.load(boost::memory_order_relaxed);
+			if(data && age_of(data) == age) {
+				++used;
+			}
+		}
+	}
+
+	return used * 1000 / (sample * BUCKET_SIZE);
+}
@@ -0,0 +1,69 @@
+#ifndef TTABLE_HPP
+#define TTABLE_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+#include <boost/atomic.hpp>
+#include <boost/scoped_array.hpp>
+
+/* Transposition table for the AI search.
+ *
+ * A fixed number of four entry buckets, allocated up front. Entries are
+ * two 64-bit words, the packed data and the key XORed with the data, so
+ * threads can read and write without locks: an entry torn by a concurrent
+ * write fails the key check and is treated as a miss.
+ *
+ * The server keeps one table for every game it runs, so results from
+ * earlier turns are reused. Each search bumps the generation and entries
+ * left over from old generations are the first to be replaced.
+*/
+class TranspositionTable {
+public:
+	enum bound_type { EXACT, LOWER, UPPER };
+
+	enum { MAX_SCORE = (1 << 21) - 1 };
+
+	struct entry {
+		int score; // Entries scored beyond +/-MAX_SCORE aren't kept.
+		int depth;
+		bound_type bound;
+		int from, to; // Best move as evaluator tile indices, -1 if none.
+	};
+
+	TranspositionTable(unsigned int megabytes);
+
+	// Call at the start of each search.
+	void new_search();
+
+	bool probe(uint64_t key, entry &e);
+	void store(uint64_t key, const entry &e);
+
+	size_t entries() const { return (mask + 1) * BUCKET_SIZE; }
+
+	// Permille of a sample of entries written by the current search.
+	int usage() const;
+
+private:
+	enum { BUCKET_SIZE = 4 };
+
+	struct slot {
+		boost::atomic<uint64_t> key;
+		boost::atomic<uint64_t> data;
+	};
+
+	struct bucket {
+		slot slots[BUCKET_SIZE];
+	};
+
+	boost::scoped_array<bucket> table;
+	size_t mask;
+
+	boost::atomic<unsigned int> generation;
+
+	static bool pack(const entry &e, unsigned int age, uint64_t &data);
+	static void unpack(uint64_t data, entry &e);
+	static int depth_of(uint64_t data);
+	static unsigned int age_of(uint64_t data);
+};
+
+#endif /* !TTABLE_HPP */